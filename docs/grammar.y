@@ -92,7 +92,7 @@ return_statement
     : RETURN [ expression ] EOL
 
 struct_declaration
-    : STRUCT UIDENT constrained_type_params [ where_clause ] EOL INDENT struct_vars [ impl_body ] DEDENT
+    : [ VALUE ] STRUCT UIDENT constrained_type_params [ where_clause ] EOL INDENT struct_vars [ impl_body ] DEDENT
 
 variable_declaration
     : LIDENT COLON_EQUAL expression EOL
@@ -0,0 +1,298 @@
+// Microbenchmark for the collector's copy and scan loops. Builds synthetic
+// object graphs in the nursery and copies them into the old generation the way
+// a minor collection would, reporting the copying throughput.
+//
+// Build and run from the repository root:
+//
+//   gcc -O2 -std=gnu99 lib/gc_bench.c lib/library.c -o build/gc_bench -pthread
+//   build/gc_bench [--gc-copy-order=breadth] [rounds]
+//
+// Only the (serial) copying collector is measured
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "library.h"
+
+// Normally emitted by the compiler
+uint64_t __stackMap[1] = {0};
+uint64_t __stackMapCallSites[1];
+int32_t __stackMapDescriptors[1];
+uint64_t __allocationSites = 0;
+uint64_t __typeDescriptors[1];
+uint64_t __packShortStrings = 1;
+
+// Collector internals (see library.c)
+extern uint64_t* heapStart;
+extern uint64_t* heapPointer;
+extern uint64_t* heapEnd;
+extern uint64_t* oldPointer;
+extern uint64_t* oldEnd;
+extern uint64_t* otherStart;
+extern uint64_t* allocPtr;
+extern uint64_t* allocEnd;
+extern uint64_t* scanPtr;
+extern int majorCollection;
+
+void fail(const char* str);
+void saveCommandLine(int pargc, char** pargv) asm("saveCommandLine");
+void initializeHeap() asm("initializeHeap");
+void* try_mymalloc(size_t) asm("try_mymalloc");
+void copyRoot(uint64_t* root);
+void gcScan();
+
+void* gcAllocate(size_t sizeInBytes)
+{
+    void* result = try_mymalloc(sizeInBytes);
+    if (!result)
+        fail("*** Exception: gc_bench: nursery is full");
+
+    return result;
+}
+
+#define MAX_ROOTS 4096
+
+uint64_t graphRoots[MAX_ROOTS];
+size_t graphRootCount;
+
+// Leave some of the nursery unused, so that building a graph never fails
+#define NURSERY_SLACK (256 << 10)
+
+int nurseryHasRoom()
+{
+    return (heapEnd - heapPointer) * sizeof(uint64_t) > NURSERY_SLACK;
+}
+
+SplObject* newObject(uint64_t tag, uint64_t refMask, size_t fields)
+{
+    SplObject* object = gcAllocate(fields * sizeof(uint64_t));
+    ((uint64_t*)object)[-1] |= MAKE_STRUCT_LAYOUT(HEADER_STRUCT, tag, refMask);
+    memset(object, 0, fields * sizeof(uint64_t));
+
+    return object;
+}
+
+SplObject* newBoxedArray(size_t length)
+{
+    Array* array = gcAllocate(sizeof(Array) + length * sizeof(uint64_t));
+    ((uint64_t*)array)[-1] |= HEADER_BOXED_ARRAY;
+    array->numElements = length;
+
+    return (SplObject*)array;
+}
+
+uint64_t* fields(SplObject* object)
+{
+    return (uint64_t*)object;
+}
+
+uint64_t* elements(SplObject* array)
+{
+    return (uint64_t*)((Array*)array + 1);
+}
+
+uint64_t randomState = 88172645463325252ULL;
+
+uint64_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+// Cons cells linked in allocation order
+void buildList()
+{
+    SplObject* head = NULL;
+    while (nurseryHasRoom())
+    {
+        SplObject* cell = newObject(1, 1, 2);
+        fields(cell)[0] = (uint64_t)head;
+        fields(cell)[1] = 42;
+        head = cell;
+    }
+
+    graphRoots[graphRootCount++] = (uint64_t)head;
+}
+
+// Cons cells linked in a random order, so that following the list jumps
+// around the nursery
+void buildShuffledList()
+{
+    SplObject** cells = NULL;
+    size_t count = 0, capacity = 0;
+    while (nurseryHasRoom())
+    {
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 1024;
+            cells = realloc(cells, capacity * sizeof(SplObject*));
+        }
+
+        cells[count++] = newObject(1, 1, 2);
+    }
+
+    for (size_t i = count - 1; i > 0; --i)
+    {
+        size_t j = nextRandom() % (i + 1);
+        SplObject* tmp = cells[i];
+        cells[i] = cells[j];
+        cells[j] = tmp;
+    }
+
+    for (size_t i = 0; i + 1 < count; ++i)
+    {
+        fields(cells[i])[0] = (uint64_t)cells[i + 1];
+    }
+
+    graphRoots[graphRootCount++] = (uint64_t)cells[0];
+    free(cells);
+}
+
+SplObject* buildTree(int depth)
+{
+    if (depth == 0)
+        return NULL;
+
+    SplObject* node = newObject(1, 3, 3);
+    fields(node)[0] = (uint64_t)buildTree(depth - 1);
+    fields(node)[1] = (uint64_t)buildTree(depth - 1);
+    fields(node)[2] = depth;
+
+    return node;
+}
+
+// Complete binary trees
+void buildTrees()
+{
+    while (nurseryHasRoom() && graphRootCount < MAX_ROOTS)
+    {
+        graphRoots[graphRootCount++] = (uint64_t)buildTree(10);
+    }
+}
+
+// A static string, like the ones the compiler emits: a header outside of the
+// heap, followed by the object
+uint64_t staticString[] = { MAKE_HEADER(2), 5, 0x6f6c6c6568 };
+
+// Boxed arrays of records which have a mix of pointer and non-pointer fields,
+// some pointing to leaves and some to a static string
+void buildRecords()
+{
+    while (nurseryHasRoom() && graphRootCount < MAX_ROOTS)
+    {
+        size_t length = 256;
+        SplObject* array = newBoxedArray(length);
+        for (size_t i = 0; i < length; ++i)
+        {
+            SplObject* record = newObject(2, 0x55, 8);
+            for (size_t j = 0; j < 8; j += 2)
+            {
+                if (j == 6)
+                {
+                    fields(record)[j] = (uint64_t)(staticString + 1);
+                }
+                else
+                {
+                    SplObject* leaf = newObject(3, 0, 1 + j);
+                    fields(record)[j] = (uint64_t)leaf;
+                }
+
+                fields(record)[j + 1] = i;
+            }
+
+            elements(array)[i] = (uint64_t)record;
+        }
+
+        graphRoots[graphRootCount++] = (uint64_t)array;
+    }
+}
+
+uint64_t nanoseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Copy everything reachable from the roots out of the nursery, and return the
+// number of bytes copied. The copies are then discarded, along with the nursery
+size_t copyGraph(uint64_t* elapsed)
+{
+    majorCollection = 0;
+    allocPtr = oldPointer;
+    allocEnd = oldEnd;
+    scanPtr = oldPointer;
+
+    uint64_t startTime = nanoseconds();
+
+    for (size_t i = 0; i < graphRootCount; ++i)
+    {
+        copyRoot(&graphRoots[i]);
+    }
+
+    gcScan();
+
+    *elapsed = nanoseconds() - startTime;
+
+    heapPointer = heapStart;
+    graphRootCount = 0;
+
+    return (allocPtr - oldPointer) * sizeof(uint64_t);
+}
+
+typedef struct Benchmark
+{
+    const char* name;
+    void (*build)();
+} Benchmark;
+
+Benchmark benchmarks[] =
+{
+    { "list", buildList },
+    { "shuffled list", buildShuffledList },
+    { "trees", buildTrees },
+    { "records", buildRecords },
+};
+
+int main(int argc, char** argv)
+{
+    // The runtime consumes the --gc- options from argv
+    int rounds = 20;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--gc-", 5) != 0)
+            rounds = atoi(argv[i]);
+    }
+
+    saveCommandLine(argc, argv);
+    initializeHeap();
+
+    // The mark-region collector has no to-space to copy into
+    if (!otherStart)
+        fail("*** Exception: gc_bench only measures the copying collector");
+
+    printf("%-16s %12s %12s %12s\n", "graph", "bytes", "best (us)", "MB/s");
+
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+    {
+        uint64_t best = UINT64_MAX;
+        size_t bytesCopied = 0;
+        for (int round = 0; round < rounds; ++round)
+        {
+            benchmarks[i].build();
+
+            uint64_t elapsed;
+            bytesCopied = copyGraph(&elapsed);
+            if (elapsed < best)
+                best = elapsed;
+        }
+
+        printf("%-16s %12zu %12" PRIu64 " %12.0f\n", benchmarks[i].name, bytesCopied, best / 1000,
+            bytesCopied / (best / 1e9) / 1e6);
+    }
+
+    return 0;
+}
@@ -3,6 +3,7 @@
 
 #include "library.h"
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <math.h>
 #include <stdint.h>
@@ -10,7 +11,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 void fail(const char* str)
 {
@@ -26,36 +37,269 @@ char* strContent(String* s)
     return (char*)(s + 1);
 }
 
-String* makeStr(const char* data)
+// Returns a pointer through which s can be read like an array. A short string
+// is copied into the buffer, which has to live as long as the result is used
+String* unpackStr(String* s, ShortString* buffer)
+{
+    if (!IS_SHORT_STRING(s))
+        return s;
+
+    buffer->array.numElements = SHORT_STRING_LENGTH(s);
+    buffer->bytes = (uintptr_t)s & SHORT_STRING_BYTES_MASK;
+
+    return &buffer->array;
+}
+
+// Emitted by the compiler: zero if the program stores into strings, which
+// then always have to be arrays
+extern uint64_t __packShortStrings;
+
+String* makeStrWithLength(const char* data, size_t n)
 {
-    size_t n = strlen(data);
+    if (n <= SHORT_STRING_MAX && __packShortStrings)
+    {
+        uint64_t bytes = 0;
+        memcpy(&bytes, data, n);
+        return MAKE_SHORT_STRING(bytes, n);
+    }
 
-    String* result = gcAllocate(sizeof(SplObject) + n);
-    result->constructorTag = UNBOXED_ARRAY_TAG;
+    String* result = gcAllocate(sizeof(String) + n);
     result->numElements = n;
     memcpy(strContent(result), data, n);
 
     return result;
 }
 
+String* makeStr(const char* data)
+{
+    return makeStrWithLength(data, strlen(data));
+}
+
 uint64_t strLength(String* s)
 {
     return s->numElements;
 }
 
-// FNV-1a 64-bit
+// Mixes in a word at a time with a multiply and xor-shift, starting from the
+// length so that the zero padding of the last word can't cause collisions, and
+// finishes with the MurmurHash3 avalanche
+static uint64_t hashBytes(const char* p, size_t n)
+{
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ n;
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 31;
+    }
+
+    if (n > 0)
+    {
+        uint64_t word = 0;
+        memcpy(&word, p, n);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 31;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+// Short strings hash the same as arrays with the same characters
 uint64_t strHash(String* s)
 {
-    uint64_t hash = 14695981039346656037ULL;
+    ShortString shortString;
+    s = unpackStr(s, &shortString);
+
+    return hashBytes(strContent(s), strLength(s));
+}
+
+// The hash of the characters [start, start + n) of s, for StrView in String.enc
+uint64_t strHashRange(String* s, uint64_t start, uint64_t n)
+{
+    ShortString shortString;
+    s = unpackStr(s, &shortString);
+
+    return hashBytes(strContent(s) + start, n);
+}
+
+int64_t strEqual(String* lhs, String* rhs)
+{
+    // Includes two short strings with the same characters
+    if (lhs == rhs)
+        return 1;
+
+    ShortString lhsShort, rhsShort;
+    lhs = unpackStr(lhs, &lhsShort);
+    rhs = unpackStr(rhs, &rhsShort);
+
+    size_t n = strLength(lhs);
+    return n == strLength(rhs) && memcmp(strContent(lhs), strContent(rhs), n) == 0;
+}
+
+// Compares n characters of two strings, from the given positions
+int64_t strRangeEqual(String* lhs, uint64_t lhsStart, String* rhs, uint64_t rhsStart, uint64_t n)
+{
+    ShortString lhsShort, rhsShort;
+    lhs = unpackStr(lhs, &lhsShort);
+    rhs = unpackStr(rhs, &rhsShort);
+
+    return memcmp(strContent(lhs) + lhsStart, strContent(rhs) + rhsStart, n) == 0;
+}
+
+// Copies characters between strings. The destination is never a short string,
+// because it comes straight from unsafeEmptyArray
+void strCopy(String* dest, uint64_t destPos, String* src, uint64_t srcPos, uint64_t n)
+{
+    ShortString shortString;
+    src = unpackStr(src, &shortString);
+
+    memcpy(strContent(dest) + destPos, strContent(src) + srcPos, n);
+}
+
+// Index of the first c at or after from, or the length if there isn't one
+uint64_t strFindChar(String* s, char c, uint64_t from)
+{
+    ShortString shortString;
+    s = unpackStr(s, &shortString);
+
+    size_t n = strLength(s);
+    if (from >= n)
+        return n;
 
     char* content = strContent(s);
-    for (size_t i = 0; i < strLength(s); ++i)
+    char* found = memchr(content + from, c, n - from);
+    return found ? (uint64_t)(found - content) : n;
+}
+
+// Whitespace (as in isSpace in String.enc) is scanned for 16 or 32 characters
+// at a time. scanSpace returns the index of the first character whose isSpace
+// is stopAtSpace, or n
+static inline int isStringSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static size_t scanSpaceScalar(const char* p, size_t n, int stopAtSpace)
+{
+    size_t i = 0;
+    while (i < n && isStringSpace(p[i]) != stopAtSpace)
+        ++i;
+
+    return i;
+}
+
+#if defined(__x86_64__)
+
+static size_t scanSpaceSSE2(const char* p, size_t n, int stopAtSpace)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i tab = _mm_set1_epi8('\t');
+    unsigned flip = stopAtSpace ? 0 : 0xffff;
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
     {
-        hash ^= content[i];
-        hash *= 1099511628211;
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i matches = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, newline)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, tab)));
+
+        unsigned mask = (unsigned)_mm_movemask_epi8(matches) ^ flip;
+        if (mask)
+            return i + __builtin_ctz(mask);
     }
 
-    return hash;
+    return i + scanSpaceScalar(p + i, n - i, stopAtSpace);
+}
+
+__attribute__((target("avx2")))
+static size_t scanSpaceAVX2(const char* p, size_t n, int stopAtSpace)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    uint32_t flip = stopAtSpace ? 0 : 0xffffffff;
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i matches = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, newline)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, tab)));
+
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(matches) ^ flip;
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + scanSpaceSSE2(p + i, n - i, stopAtSpace);
+}
+
+#endif
+
+// Chosen by initializeStringKernels for this CPU
+static size_t (*scanSpace)(const char* p, size_t n, int stopAtSpace) = scanSpaceScalar;
+
+void initializeStringKernels()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    scanSpace = __builtin_cpu_supports("avx2") ? scanSpaceAVX2 : scanSpaceSSE2;
+#endif
+}
+
+// Index of the first whitespace character at or after from, or the length
+uint64_t strFindSpace(String* s, uint64_t from)
+{
+    ShortString shortString;
+    s = unpackStr(s, &shortString);
+
+    size_t n = strLength(s);
+    if (from >= n)
+        return n;
+
+    return from + scanSpace(strContent(s) + from, n - from, 1);
+}
+
+// Index of the first non-whitespace character at or after from, or the length
+uint64_t strSkipSpace(String* s, uint64_t from)
+{
+    ShortString shortString;
+    s = unpackStr(s, &shortString);
+
+    size_t n = strLength(s);
+    if (from >= n)
+        return n;
+
+    return from + scanSpace(strContent(s) + from, n - from, 0);
+}
+
+// Number of whitespace characters at the end. These are usually few, so this
+// isn't vectorized
+uint64_t strTrailingSpace(String* s)
+{
+    ShortString shortString;
+    s = unpackStr(s, &shortString);
+
+    size_t n = strLength(s);
+    const char* content = strContent(s);
+
+    size_t i = 0;
+    while (i < n && isStringSpace(content[n - 1 - i]))
+        ++i;
+
+    return i;
 }
 
 
@@ -98,6 +342,9 @@ FILE* getStderr()
 
 char* toCString(String* s)
 {
+    ShortString shortString;
+    s = unpackStr(s, &shortString);
+
     size_t n = strLength(s);
     char* buffer = malloc(n + 1);
     memcpy(buffer, strContent(s), n);
@@ -119,380 +366,3265 @@ FILE* fopenWrapper(String* filename, String* mode)
     return result;
 }
 
-void panic(String* s)
+// Standard output is collected here and written out with a single write(2)
+// when the buffer fills, at exit, or on flushOutput. Like stdio, output to a
+// terminal is flushed at the end of each line instead
+#define OUTPUT_BUFFER_SIZE  (64 << 10)
+
+char outputBuffer[OUTPUT_BUFFER_SIZE];
+size_t outputCount;
+int outputLineBuffered;
+
+static void writeAll(const char* data, size_t n)
 {
-    char* buffer = toCString(s);
+    while (n > 0)
+    {
+        ssize_t result = write(STDOUT_FILENO, data, n);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
 
-    fprintf(stderr, "*** Exception: %s\n", buffer);
+            // Nowhere to report it, so drop the output
+            return;
+        }
 
-    free(buffer);
-    exit(1);
+        data += result;
+        n -= result;
+    }
 }
 
-//// Garbage collector /////////////////////////////////////////////////////////
+void flushOutput()
+{
+    writeAll(outputBuffer, outputCount);
+    outputCount = 0;
+}
 
-// Cheney-style copying collector
-uint64_t* heapStart;
-uint64_t* heapPointer;
-uint64_t* heapEnd;
+void initializeOutput()
+{
+    outputLineBuffered = isatty(STDOUT_FILENO);
+    atexit(flushOutput);
+}
 
-uint64_t* otherStart;
-uint64_t* otherEnd;
+static inline void writeBytes(const char* data, size_t n)
+{
+    if (outputCount + n > OUTPUT_BUFFER_SIZE)
+    {
+        flushOutput();
 
-void initializeHeap() asm("initializeHeap");
+        // Too big to be worth buffering
+        if (n > OUTPUT_BUFFER_SIZE)
+        {
+            writeAll(data, n);
+            return;
+        }
+    }
 
-void initializeHeap()
+    memcpy(outputBuffer + outputCount, data, n);
+    outputCount += n;
+
+    if (outputLineBuffered && memchr(data, '\n', n))
+    {
+        flushOutput();
+    }
+}
+
+void writeString(String* s)
 {
-    size_t size = 4 << 20;
+    ShortString shortString;
+    s = unpackStr(s, &shortString);
 
-    heapStart = mmap(0, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-    if (heapStart == MAP_FAILED)
+    writeBytes(strContent(s), strLength(s));
+}
+
+void writeChar(char c)
+{
+    if (outputCount == OUTPUT_BUFFER_SIZE)
     {
-        fail("*** Exception: Cannot initialize heap");
+        flushOutput();
     }
-    heapPointer = heapStart;
-    heapEnd = heapStart + size / sizeof(uint64_t);
 
-    otherStart = mmap(0, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-    if (otherStart == MAP_FAILED)
+    outputBuffer[outputCount++] = c;
+
+    if (outputLineBuffered && c == '\n')
     {
-        fail("*** Exception: Cannot initialize heap");
+        flushOutput();
     }
-    otherEnd = otherStart + size / sizeof(uint64_t);
 }
 
-// increment should be a power of 2
-size_t roundUp(size_t size, size_t increment)
+void writeUInt(uint64_t n)
 {
-    if (size % increment)
+    // Digits are produced last-first, from the end of the buffer
+    char digits[20];
+    char* p = digits + sizeof(digits);
+
+    do
     {
-        return (size - size % increment) + increment;
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+
+    writeBytes(p, digits + sizeof(digits) - p);
+}
+
+void writeInt(int64_t n)
+{
+    if (n < 0)
+    {
+        writeChar('-');
+        writeUInt(-(uint64_t)n);
     }
     else
     {
-        return size;
+        writeUInt(n);
     }
 }
 
-void expandHeap(size_t minimumSize)
+// Files are read in large chunks with read(2), instead of with a call to fgetc
+// for every character. Each file gets a reader the first time that it's read
+// from, and closeWrapper releases it
+#define INPUT_BUFFER_SIZE   (64 << 10)
+
+typedef struct Reader
 {
-    size_t currentSize = (otherEnd - otherStart) * sizeof(uint64_t);
-    munmap(otherStart, currentSize);
+    int fd;
+    int eof;
+    size_t pos;
+    size_t end;
+    char buffer[INPUT_BUFFER_SIZE];
+} Reader;
+
+// Indexed by file descriptor
+Reader** readers;
+size_t readerCapacity;
+
+Reader* getReader(FILE* file)
+{
+    int fd = fileno(file);
+    assert(fd >= 0);
 
-    currentSize *= 2;
-    if (currentSize < minimumSize)
+    if ((size_t)fd >= readerCapacity)
     {
-        currentSize = roundUp(minimumSize, 4096);
+        size_t newCapacity = readerCapacity ? 2 * readerCapacity : 16;
+        while (newCapacity <= (size_t)fd)
+            newCapacity *= 2;
+
+        readers = realloc(readers, newCapacity * sizeof(Reader*));
+        if (!readers)
+        {
+            fail("*** Exception: Cannot allocate file reader");
+        }
+
+        memset(readers + readerCapacity, 0, (newCapacity - readerCapacity) * sizeof(Reader*));
+        readerCapacity = newCapacity;
     }
 
-    otherStart = mmap(0, currentSize, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-    if (otherStart == MAP_FAILED)
+    Reader* reader = readers[fd];
+    if (!reader)
     {
-        fail("*** Exception: Cannot expand heap");
+        reader = malloc(sizeof(Reader));
+        if (!reader)
+        {
+            fail("*** Exception: Cannot allocate file reader");
+        }
+
+        reader->fd = fd;
+        reader->eof = 0;
+        reader->pos = reader->end = 0;
+        readers[fd] = reader;
     }
 
-    otherEnd = otherStart + (currentSize / sizeof(uint64_t));
+    return reader;
 }
 
-// Make sure that the other heap has at least the same capacity as
-// the current heap
-void equalizeHeaps()
+// Refill an empty buffer. Returns 0 at the end of the file
+static int fillReader(Reader* reader)
 {
-    size_t otherSize = (otherEnd - otherStart) * sizeof(uint64_t);
-    size_t currentSize = (heapEnd - heapStart) * sizeof(uint64_t);
-    if (otherSize >= currentSize) return;
+    if (reader->eof)
+        return 0;
 
-    munmap(otherStart, otherSize);
+    // Show any prompt before waiting for input at a terminal
+    if (outputLineBuffered)
+    {
+        flushOutput();
+    }
 
-    otherSize = currentSize;
+    ssize_t result;
+    do
+    {
+        result = read(reader->fd, reader->buffer, INPUT_BUFFER_SIZE);
+    } while (result < 0 && errno == EINTR);
 
-    otherStart = mmap(otherStart, otherSize, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-    if (otherStart == MAP_FAILED)
+    if (result <= 0)
     {
-        fail("*** Exception: Cannot expand heap");
+        reader->eof = 1;
+        return 0;
     }
 
-    otherEnd = otherStart + (otherSize / sizeof(uint64_t));
+    reader->pos = 0;
+    reader->end = result;
+    return 1;
 }
 
-void* try_mymalloc(size_t) asm("try_mymalloc");
+static inline int isSpace(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
 
-// Try to allocate memory from the current heap
-void* try_mymalloc(size_t sizeInBytes)
+// Skip any whitespace. Returns 0 if that reaches the end of the file
+static int skipSpace(Reader* reader)
 {
-    // Allocate in units of 8 bytes
-    size_t sizeInWords = (sizeInBytes + 7) / 8;
+    for (;;)
+    {
+        while (reader->pos < reader->end)
+        {
+            if (!isSpace(reader->buffer[reader->pos]))
+                return 1;
 
-    // New allocation is at the current heapPointer
-    uint64_t* p = heapPointer;
-    heapPointer += (sizeInWords + 1);
+            ++reader->pos;
+        }
 
-    // Bump the pointer and check whether we jumped the end of the heap
-    if (heapPointer >= heapEnd)
-    {
-        return NULL;
+        if (!fillReader(reader))
+            return 0;
     }
+}
 
-    // The first word of the allocated block contains the size in words
-    // (tagged so that we can distinguish it from a forwarding pointer)
-    *p++ = ((sizeInWords << 1) | 1);
+// Lines and tokens which cross the end of the buffer are put together here
+char* scratch;
+size_t scratchCapacity;
 
-    return p;
-}
+static void appendScratch(size_t* length, const char* data, size_t n)
+{
+    if (*length + n > scratchCapacity)
+    {
+        size_t newCapacity = scratchCapacity ? 2 * scratchCapacity : INPUT_BUFFER_SIZE;
+        while (newCapacity < *length + n)
+            newCapacity *= 2;
 
-uint64_t* allocPtr;
-uint64_t* scanPtr;
+        scratch = realloc(scratch, newCapacity);
+        if (!scratch)
+        {
+            fail("*** Exception: Cannot allocate input buffer");
+        }
 
-void* gcCopy(void* object)
+        scratchCapacity = newCapacity;
+    }
+
+    memcpy(scratch + *length, data, n);
+    *length += n;
+}
+
+// Returns -1 at the end of the file
+int64_t readerChar(FILE* file)
 {
-    if (!object) return NULL;
+    Reader* reader = getReader(file);
+    if (reader->pos == reader->end && !fillReader(reader))
+        return -1;
 
-    assert((otherEnd - otherStart) >= (heapEnd - heapStart));
+    return (unsigned char)reader->buffer[reader->pos++];
+}
 
-    // Back up one word to the beginning of the allocated block
-    uint64_t* block = (uint64_t*)object - 1;
+// The next line, including the newline, or null (None) at the end of the file
+String* readerLine(FILE* file)
+{
+    Reader* reader = getReader(file);
 
-    // It's possible for heap objects to contain references to non-heap memory,
-    // like static strings
-    if (block < heapStart || block >= heapEnd)
+    size_t length = 0;
+    while (reader->pos < reader->end || fillReader(reader))
     {
-        // For testing purposes: this will segfault if we accidently treat
-        // a small integer as a pointer
-        //printf("object: %p\n", object);
-        volatile uint64_t x = *(uint64_t*)object;
+        char* start = reader->buffer + reader->pos;
+        size_t available = reader->end - reader->pos;
 
-        return object;
-    }
+        char* newline = memchr(start, '\n', available);
+        size_t n = newline ? (size_t)(newline - start + 1) : available;
+        reader->pos += n;
 
-    uint64_t header = *block;
-    if (!(header & 1))
-    {
-        // No tag => this is a forwarding pointer. Don't copy
-        return (void*)header;
+        // Usually, the whole line is already in the buffer
+        if (newline && length == 0)
+            return makeStrWithLength(start, n);
+
+        appendScratch(&length, start, n);
+        if (newline)
+            break;
     }
 
-    size_t sizeInWords = header >> 1;
+    return length ? makeStrWithLength(scratch, length) : NULL;
+}
 
-    // Copy to the "to" space
-    memcpy(allocPtr, block, (sizeInWords + 1) * sizeof(uint64_t));
+// The next whitespace-delimited token, or null (None) at the end of the file
+String* readerToken(FILE* file)
+{
+    Reader* reader = getReader(file);
+    if (!skipSpace(reader))
+        return NULL;
 
-    // Leave a forwarding address (to the object, not the block header)
-    void* newLocation = allocPtr + 1;
-    *block = (uint64_t)newLocation;
+    size_t length = 0;
+    do
+    {
+        char* start = reader->buffer + reader->pos;
+        char* p = start;
+        char* end = reader->buffer + reader->end;
+        while (p < end && !isSpace(*p))
+            ++p;
 
-    allocPtr += (sizeInWords + 1);
+        reader->pos += p - start;
+        if (p < end && length == 0)
+            return makeStrWithLength(start, p - start);
 
-    return newLocation;
+        appendScratch(&length, start, p - start);
+        if (p < end)
+            break;
+    } while (fillReader(reader));
+
+    return makeStrWithLength(scratch, length);
 }
 
-void gcScan()
+// Everything up to the end of the file
+String* readerAll(FILE* file)
 {
-    while (scanPtr < allocPtr)
-    {
-        // Skip the size word to get to the next object on the scan list
-        SplObject* object = (SplObject*)(scanPtr + 1);
+    Reader* reader = getReader(file);
 
-        // Iterate over the children, and copy them to the new heap
-        SplObject** p = (SplObject**)(object + 1);
-        if (object->constructorTag == BOXED_ARRAY_TAG)
-        {
-            SplObject** pend = p + object->refMask;
-            while (p < pend)
-            {
-                void* newLocation = gcCopy(*p);
-                *p++ = (SplObject*)newLocation;
-            }
-        }
-        else if (object->constructorTag != UNBOXED_ARRAY_TAG)
-        {
-            uint64_t refMask = object->refMask;
-            while (refMask != 0)
-            {
-                if (refMask & 1)
-                {
-                    void* newLocation = gcCopy(*p);
-                    *p = (SplObject*)newLocation;
-                }
-
-                ++p;
-                refMask >>= 1;
-            }
-        }
-
-        size_t sizeInWords = *scanPtr >> 1;
-        scanPtr += (sizeInWords + 1);
+    size_t length = 0;
+    while (reader->pos < reader->end || fillReader(reader))
+    {
+        appendScratch(&length, reader->buffer + reader->pos, reader->end - reader->pos);
+        reader->pos = reader->end;
     }
-}
 
-extern uint64_t __stackMap;
+    return makeStrWithLength(scratch, length);
+}
 
-uint64_t* findInStackMap(void* returnAddress)
+// Whether there's anything but whitespace left in the file
+int64_t readerHasToken(FILE* file)
 {
-    uint64_t* p = &__stackMap;
-
-    // First word gives number of entries
-    size_t entries = *p++;
+    return skipSpace(getReader(file));
+}
 
-    for (size_t i = 0; i < entries; ++i)
+// The digits of a number, which must start at the current position
+static uint64_t parseDigits(Reader* reader)
+{
+    uint64_t result = 0;
+    size_t digits = 0;
+    do
     {
-        // Format: return address, count, (offset)*
-        if (returnAddress == (void*)*p++)
-        {
-            return p;
-        }
-        else
+        while (reader->pos < reader->end)
         {
-            uint64_t elements = *p++;
-            p += elements;
+            unsigned digit = (unsigned char)reader->buffer[reader->pos] - '0';
+            if (digit > 9)
+                goto done;
+
+            result = 10 * result + digit;
+            ++digits;
+            ++reader->pos;
         }
-    }
+    } while (fillReader(reader));
 
-    return NULL;
+done:
+    if (digits == 0)
+        fail("*** Exception: Expected a number");
+
+    return result;
 }
 
-void gcCopyRoots(uint64_t* stackTop, uint64_t* stackBottom, uint64_t* additionalRoots)
+// Parse a decimal number after any whitespace, without allocating
+uint64_t readerUInt(FILE* file)
 {
-    uint64_t* rbp = stackTop;
+    Reader* reader = getReader(file);
+    if (!skipSpace(reader))
+        fail("*** Exception: Expected a number at the end of the input");
 
-    // Skip the gcAllocate stack frame
+    return parseDigits(reader);
+}
 
-    // mov rsp, rbp
-    // pop rbp
-    // ret
-    uint64_t* rsp = rbp;
-    rbp = (uint64_t*)*rsp++;
-    void* callSite = (void*)*rsp++;
+// Like readerUInt, with an optional sign
+int64_t readerInt(FILE* file)
+{
+    Reader* reader = getReader(file);
+    if (!skipSpace(reader))
+        fail("*** Exception: Expected a number at the end of the input");
 
-    while (1)
+    char sign = reader->buffer[reader->pos];
+    if (sign == '-' || sign == '+')
     {
-        // printf("Stack frame:\n");
-        // printf("\trbp=%p, rsp=%p\n", rbp, rsp);
-        // printf("\tcallSite=%p\n", callSite);
+        ++reader->pos;
+    }
 
-        uint64_t* stackMapEntry = findInStackMap(callSite);
-        assert(stackMapEntry);
+    uint64_t magnitude = parseDigits(reader);
+    return sign == '-' ? -(int64_t)magnitude : (int64_t)magnitude;
+}
 
-        // printf("\tstackMapEntry=%p\n", stackMapEntry);
+void closeWrapper(FILE* file)
+{
+    int fd = fileno(file);
+    if (fd >= 0 && (size_t)fd < readerCapacity)
+    {
+        free(readers[fd]);
+        readers[fd] = NULL;
+    }
 
-        uint64_t n = *stackMapEntry;
+    fclose(file);
+}
 
-        // printf("\tn=%ld\n", n);
-        for (size_t i = 0; i < n; ++i)
-        {
-            int64_t offset = (int64_t)stackMapEntry[i + 1];
+// Maps a whole file as an unboxed array (String or Array<UInt8>) without
+// reading it. The file's pages follow a page which ends with the header and
+// length of the array, so the object is contiguous, and like a static string,
+// it lies outside of the heap, and is never copied or scanned. The mapping is
+// private, so it shares the page cache until something writes to it. Mappings
+// last until the program exits. Returns null (None) if the file can't be opened
+static Array* mapFile(String* filename, int allowShort)
+{
+    char* cfilename = toCString(filename);
+    int fd = open(cfilename, O_RDONLY);
+    free(cfilename);
+
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    Array* result;
+
+    if (size <= SHORT_STRING_MAX && (allowShort || size == 0))
+    {
+        // Not worth a mapping
+        char data[SHORT_STRING_MAX];
+        size_t n = 0;
+        while (n < size)
+        {
+            ssize_t count = read(fd, data + n, size - n);
+            if (count < 0 && errno == EINTR)
+                continue;
+
+            if (count <= 0)
+                break;
+
+            n += count;
+        }
+
+        if (allowShort)
+        {
+            result = makeStrWithLength(data, n);
+        }
+        else
+        {
+            result = gcAllocate(sizeof(Array));
+            result->numElements = 0;
+        }
+    }
+    else
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t mappedSize = (size + page - 1) / page * page;
+
+        char* start = mmap(0, page + mappedSize, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (start == MAP_FAILED)
+        {
+            close(fd);
+            return NULL;
+        }
+
+        if (mmap(start + page, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+        {
+            munmap(start, page + mappedSize);
+            close(fd);
+            return NULL;
+        }
+
+        uint64_t* block = (uint64_t*)(start + page) - 2;
+        block[0] = MAKE_HEADER(1 + (size + 7) / 8) | HEADER_UNBOXED_ARRAY;
+        block[1] = size;
+
+        result = (Array*)(block + 1);
+    }
+
+    close(fd);
+    return result;
+}
+
+String* mmapFile(String* filename)
+{
+    return mapFile(filename, 1);
+}
+
+// Array<UInt8> has no short representation
+Array* mmapBytes(String* filename)
+{
+    return mapFile(filename, 0);
+}
+
+// Called by compiled code which tries to modify a short string. Programs which
+// store into strings don't have any, so this means that a string the library
+// packed was handed back to it as a buffer
+void shortStringModified()
+{
+    fail("*** Exception: can't modify a short string");
+}
+
+void panic(String* s)
+{
+    char* buffer = toCString(s);
+
+    fprintf(stderr, "*** Exception: %s\n", buffer);
+
+    free(buffer);
+    exit(1);
+}
+
+//// Garbage collector /////////////////////////////////////////////////////////
+
+// Generational copying collector. New objects are bump-allocated in a
+// fixed-size nursery. A minor collection copies the live nursery objects into
+// the old generation, and a major collection copies everything live into the
+// other half of the old generation (Cheney-style semispaces). Alternatively,
+// the old generation can be managed by a mark-region collector, which needs no
+// to-space (see Mark-region collection below)
+
+#define NURSERY_SIZE        (4 << 20)
+#define INITIAL_OLD_SIZE    (4 << 20)
+#define HUGE_PAGE_SIZE      (2 << 20)
+
+// Number of consecutive under-occupied major collections before we shrink
+#define SHRINK_DELAY        3
+
+// Heap sizing policy. Each setting can be given by an environment variable or
+// by a leading command-line option (which takes precedence):
+//
+//   ENC_GC_INITIAL_HEAP / --gc-initial-heap=SIZE   Initial size of each old semispace
+//   ENC_GC_MAX_HEAP / --gc-max-heap=SIZE           Cap on the total size of all spaces
+//   ENC_GC_TARGET_OCCUPANCY / --gc-target-occupancy=FRACTION
+//                                                  Desired fraction of the old
+//                                                  generation in use after a
+//                                                  major collection
+//   ENC_GC_HUGE_PAGES / --gc-huge-pages            Back the heap with huge pages
+//   ENC_GC_THREADS / --gc-threads=N                Collect with N threads
+//   ENC_GC_COPY_ORDER / --gc-copy-order=ORDER      Copy objects in depth-first
+//                                                  (the default) or breadth-first
+//                                                  order
+//   ENC_GC_COLLECTOR / --gc-collector=NAME         Manage the old generation
+//                                                  with the copying (the default)
+//                                                  or mark-region collector
+//
+// Sizes are in bytes, with an optional K, M or G suffix
+struct
+{
+    size_t initialSize;
+    size_t maxSize;                 // 0 means unlimited
+    double targetOccupancy;
+    int hugePages;
+    size_t threads;
+    int depthFirst;
+    int markRegion;
+} heapSettings = { INITIAL_OLD_SIZE, 0, 0.5, 0, 1, 1, 0 };
+
+#define MAX_GC_THREADS      64
+
+// Current and largest allowed capacity of the old generation, in bytes
+size_t oldCapacity;
+size_t maxOldCapacity;
+
+// How many major collections in a row have left the old generation well below
+// the target occupancy
+int underOccupiedCount;
+
+// Nursery
+uint64_t* heapStart;
+uint64_t* heapPointer;
+uint64_t* heapEnd;
+
+// Old generation. Each semispace is mapped with room for the old generation's
+// capacity plus a full nursery, so that a major collection can never overflow
+// the to-space. Promotion stops at oldEnd, before the end of the mapping
+uint64_t* oldStart;
+uint64_t* oldPointer;
+uint64_t* oldEnd;
+uint64_t* oldMapEnd;
+
+// To-space for the next major collection (always empty between collections)
+uint64_t* otherStart;
+uint64_t* otherEnd;
+
+// Large-object space. Each large object has its own mapping, starting with a
+// LargeObject descriptor followed by the usual header word. Large objects are
+// never moved: a major collection marks the live ones and unmaps the rest
+typedef struct LargeObject
+{
+    struct LargeObject* next;
+    struct LargeObject* nextGray;   // Marked, but children not yet scanned
+    size_t mappedSize;
+    uint64_t marked;
+} LargeObject;
+
+LargeObject* largeObjects;
+LargeObject* grayLargeObjects;
+size_t largeObjectBytes;            // Total mapped size of all large objects
+size_t largeObjectLimit;            // Collect before exceeding this
+
+// Mark-region old generation (see Mark-region collection below). Blocks are
+// carved out of a single reserved range starting at oldStart, and oldPointer is
+// the end of the blocks in use so far
+#define REGION_BLOCK_SIZE   (256 << 10)     // Larger than any non-large object
+#define REGION_LINE_SIZE    256
+#define LINES_PER_BLOCK     (REGION_BLOCK_SIZE / REGION_LINE_SIZE)
+#define BLOCK_WORDS         (REGION_BLOCK_SIZE / sizeof(uint64_t))
+#define LINE_WORDS          (REGION_LINE_SIZE / sizeof(uint64_t))
+
+// Address space reserved for the old generation when the heap size is unlimited
+#define REGION_RESERVE      (64ULL << 30)
+
+typedef struct RegionBlock
+{
+    uint8_t lineMarks[LINES_PER_BLOCK];
+    uint64_t markBits[BLOCK_WORDS / 64];    // One bit per word: marked objects
+    uint32_t liveLines;                     // As of the last major collection
+    uint8_t inUse;
+    uint8_t resident;                       // Backed by memory
+    uint8_t evacuate;                       // Evacuation candidate
+} RegionBlock;
+
+RegionBlock* regionBlocks;
+size_t regionBlockCapacity;
+size_t regionBlockCount;                    // Blocks mapped so far
+size_t regionReservedBlocks;
+size_t regionUsedBlocks;
+size_t regionResidentBlocks;
+
+// Partly-free blocks left by the last major collection, in address order, and
+// entirely free blocks (a stack, with the lowest address on top)
+uint32_t* recyclableBlocks;
+size_t recyclableCount;
+size_t nextRecyclable;
+size_t recyclableFreeWords;                 // Free lines left in those blocks
+uint32_t* freeBlocks;
+size_t freeBlockCount;
+
+// Old objects which may contain pointers into the nursery
+SplObject** rememberedSet;
+size_t rememberedCount;
+size_t rememberedCapacity;
+
+// Collector statistics. Always gathered, but only reported at exit when the
+// ENC_GC_STATS environment variable is set (see GC statistics below)
+#define PAUSE_BUCKETS 24
+
+struct
+{
+    uint64_t minorCollections;
+    uint64_t majorCollections;
+    uint64_t bytesAllocated;        // Excluding the current contents of the nursery
+    uint64_t bytesCopied;
+    uint64_t heapGrowths;
+    uint64_t heapShrinks;
+    uint64_t totalPause;            // In nanoseconds
+    uint64_t maxPause;
+
+    // Bucket i counts the pauses shorter than 2^i microseconds (the last
+    // bucket counts everything longer)
+    uint64_t pauseHistogram[PAUSE_BUCKETS];
+} gcStatistics;
+
+void initializeStatistics();
+void initializeAllocationProfile();
+uint64_t totalHeapSize();
+uint64_t monotonicNanoseconds();
+void recordPause(uint64_t startTime);
+
+// Set when the program was compiled with --profile-alloc
+int allocationProfiling;
+void profileAllocation(uint64_t* block);
+void recordSurvivor(uint64_t header);
+
+void initializeHeap() asm("initializeHeap");
+
+void outOfMemory()
+{
+    fail("*** Exception: Out of memory");
+}
+
+uint64_t* mapSpace(size_t size)
+{
+    uint64_t* result = mmap(0, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (result == MAP_FAILED)
+    {
+        outOfMemory();
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (heapSettings.hugePages)
+    {
+        madvise(result, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    return result;
+}
+
+// increment should be a power of 2
+size_t roundUp(size_t size, size_t increment)
+{
+    if (size % increment)
+    {
+        return (size - size % increment) + increment;
+    }
+    else
+    {
+        return size;
+    }
+}
+
+size_t roundDown(size_t size, size_t increment)
+{
+    return size - size % increment;
+}
+
+size_t pageSize()
+{
+    return heapSettings.hugePages ? HUGE_PAGE_SIZE : 4096;
+}
+
+// Parses a size like 4096, 512K, 64M or 2G. Returns 0 on error
+size_t parseSize(const char* str)
+{
+    char* end;
+    unsigned long long result = strtoull(str, &end, 10);
+
+    switch (*end)
+    {
+        case 'k': case 'K': result <<= 10; ++end; break;
+        case 'm': case 'M': result <<= 20; ++end; break;
+        case 'g': case 'G': result <<= 30; ++end; break;
+    }
+
+    if (*end != '\0' || end == str)
+        return 0;
+
+    return result;
+}
+
+void setHeapOption(const char* name, const char* value)
+{
+    if (strcmp(name, "initial-heap") == 0)
+    {
+        heapSettings.initialSize = parseSize(value);
+        if (heapSettings.initialSize == 0)
+            fail("*** Exception: Invalid initial heap size");
+    }
+    else if (strcmp(name, "max-heap") == 0)
+    {
+        heapSettings.maxSize = parseSize(value);
+        if (heapSettings.maxSize == 0)
+            fail("*** Exception: Invalid maximum heap size");
+    }
+    else if (strcmp(name, "target-occupancy") == 0)
+    {
+        char* end;
+        heapSettings.targetOccupancy = strtod(value, &end);
+        if (*end != '\0' || !(heapSettings.targetOccupancy > 0 && heapSettings.targetOccupancy <= 1))
+            fail("*** Exception: Target occupancy must be between 0 and 1");
+    }
+    else if (strcmp(name, "threads") == 0)
+    {
+        char* end;
+        heapSettings.threads = strtoul(value, &end, 10);
+        if (*end != '\0' || heapSettings.threads < 1 || heapSettings.threads > MAX_GC_THREADS)
+            fail("*** Exception: Invalid number of GC threads");
+    }
+    else if (strcmp(name, "copy-order") == 0)
+    {
+        if (strcmp(value, "depth") == 0)
+            heapSettings.depthFirst = 1;
+        else if (strcmp(value, "breadth") == 0)
+            heapSettings.depthFirst = 0;
+        else
+            fail("*** Exception: GC copy order must be depth or breadth");
+    }
+    else if (strcmp(name, "collector") == 0)
+    {
+        if (strcmp(value, "copying") == 0)
+            heapSettings.markRegion = 0;
+        else if (strcmp(value, "mark-region") == 0)
+            heapSettings.markRegion = 1;
+        else
+            fail("*** Exception: GC collector must be copying or mark-region");
+    }
+    else if (strcmp(name, "huge-pages") == 0)
+    {
+        heapSettings.hugePages = (strcmp(value, "0") != 0);
+    }
+    else
+    {
+        fprintf(stderr, "*** Exception: Unknown GC option --gc-%s\n", name);
+        exit(1);
+    }
+}
+
+void readHeapSettings()
+{
+    const char* value;
+    if ((value = getenv("ENC_GC_INITIAL_HEAP")))
+        setHeapOption("initial-heap", value);
+    if ((value = getenv("ENC_GC_MAX_HEAP")))
+        setHeapOption("max-heap", value);
+    if ((value = getenv("ENC_GC_TARGET_OCCUPANCY")))
+        setHeapOption("target-occupancy", value);
+    if ((value = getenv("ENC_GC_HUGE_PAGES")))
+        setHeapOption("huge-pages", value);
+    if ((value = getenv("ENC_GC_THREADS")))
+        setHeapOption("threads", value);
+    if ((value = getenv("ENC_GC_COPY_ORDER")))
+        setHeapOption("copy-order", value);
+    if ((value = getenv("ENC_GC_COLLECTOR")))
+        setHeapOption("collector", value);
+
+    // Runtime options precede the program's own arguments, and are hidden from
+    // it. Flags without a value are treated as "=1"
+    int consumed = 0;
+    while (1 + consumed < argc && strncmp(argv[1 + consumed], "--gc-", 5) == 0)
+    {
+        char name[64];
+        const char* option = argv[1 + consumed] + 5;
+        const char* equals = strchr(option, '=');
+        size_t length = equals ? (size_t)(equals - option) : strlen(option);
+        if (length >= sizeof(name))
+            length = sizeof(name) - 1;
+
+        memcpy(name, option, length);
+        name[length] = '\0';
+        setHeapOption(name, equals ? equals + 1 : "1");
+
+        ++consumed;
+    }
+
+    if (consumed)
+    {
+        argv[consumed] = argv[0];
+        argv += consumed;
+        argc -= consumed;
+    }
+}
+
+// Parallel collections copy into thread-local chunks of the to-space
+#define GC_CHUNK_WORDS      8192
+
+// Extra room needed in the to-space to copy the given number of words, because
+// parallel copying leaves gaps at the ends of thread-local chunks. Objects
+// which are large compared to a chunk are allocated separately, so the gaps
+// amount to at most 1/32 of each chunk
+size_t copyReserve(size_t sizeInWords)
+{
+    if (heapSettings.threads == 1)
+        return 0;
+
+    return sizeInWords / 16 + heapSettings.threads * GC_CHUNK_WORDS;
+}
+
+// Mapped size of each semispace, given the capacity of the old generation.
+// There must be room for the entire old generation plus a full nursery
+size_t semispaceSize(size_t capacity)
+{
+    size_t size = capacity + (heapEnd - heapStart) * sizeof(uint64_t);
+    return roundUp(size + copyReserve(size / sizeof(uint64_t)) * sizeof(uint64_t), 4096);
+}
+
+// Largest old generation capacity for which the nursery and both semispaces fit
+// under the maximum heap size
+size_t maxSemispaceCapacity(size_t nurserySize)
+{
+    // Leave room for the parallel copying reserve (see semispaceSize)
+    size_t maxSemispaceSize = roundDown((heapSettings.maxSize - nurserySize) / 2, 4096);
+    if (heapSettings.threads > 1)
+    {
+        size_t reserved = heapSettings.threads * GC_CHUNK_WORDS * sizeof(uint64_t) + 4096;
+        if (maxSemispaceSize < reserved + 2 * nurserySize)
+            fail("*** Exception: Maximum heap size is too small");
+
+        maxSemispaceSize = (maxSemispaceSize - reserved) / 17 * 16;
+    }
+
+    return roundDown(maxSemispaceSize - nurserySize, 4096);
+}
+
+void startCollectorThreads();
+void initializeRegion();
+size_t regionUsedSize();
+uint64_t* regionAllocate(size_t sizeInWords, size_t blockLimit);
+size_t regionCapacityBlocks();
+size_t regionFreeWords();
+void* regionCopy(void* object);
+void regionCollectMajor(uint64_t* stackTop, uint64_t* stackBottom, uint64_t* additionalRoots);
+
+void initializeHeap()
+{
+    readHeapSettings();
+
+    if (heapSettings.markRegion && heapSettings.threads > 1)
+        fail("*** Exception: The mark-region collector doesn't support --gc-threads");
+
+    size_t nurserySize = NURSERY_SIZE;
+    oldCapacity = roundUp(heapSettings.initialSize, pageSize());
+
+    if (heapSettings.maxSize)
+    {
+        // The nursery and both semispaces must fit under the cap, and the old
+        // generation must at least be able to hold a full nursery
+        if (nurserySize > heapSettings.maxSize / 8)
+            nurserySize = roundUp(heapSettings.maxSize / 8, 4096);
+
+        if (heapSettings.maxSize < 5 * nurserySize)
+            fail("*** Exception: Maximum heap size is too small");
+
+        // Without a to-space, the old generation can have everything else
+        if (heapSettings.markRegion)
+        {
+            maxOldCapacity = roundDown(heapSettings.maxSize - nurserySize, REGION_BLOCK_SIZE);
+        }
+        else
+        {
+            maxOldCapacity = maxSemispaceCapacity(nurserySize);
+        }
+
+        if (maxOldCapacity < nurserySize)
+            fail("*** Exception: Maximum heap size is too small");
+
+        if (oldCapacity > maxOldCapacity)
+            oldCapacity = maxOldCapacity;
+    }
+    else
+    {
+        maxOldCapacity = SIZE_MAX / 2;
+    }
+
+    heapStart = mapSpace(nurserySize);
+    heapPointer = heapStart;
+    heapEnd = heapStart + nurserySize / sizeof(uint64_t);
+
+    if (heapSettings.markRegion)
+    {
+        initializeRegion();
+    }
+    else
+    {
+        size_t spaceSize = semispaceSize(oldCapacity);
+
+        oldStart = mapSpace(spaceSize);
+        oldPointer = oldStart;
+        oldEnd = oldStart + oldCapacity / sizeof(uint64_t);
+        oldMapEnd = oldStart + spaceSize / sizeof(uint64_t);
+
+        otherStart = mapSpace(spaceSize);
+        otherEnd = otherStart + spaceSize / sizeof(uint64_t);
+    }
+
+    largeObjectLimit = oldCapacity;
+
+    if (heapSettings.threads > 1)
+    {
+        startCollectorThreads();
+    }
+
+    initializeOutput();
+    initializeStringKernels();
+    initializeStatistics();
+    initializeAllocationProfile();
+}
+
+// Replace the (empty) other space with one of the given size
+void remapOtherSpace(size_t size)
+{
+    munmap(otherStart, (otherEnd - otherStart) * sizeof(uint64_t));
+
+    otherStart = mapSpace(size);
+    otherEnd = otherStart + size / sizeof(uint64_t);
+}
+
+// Give the memory at the end of a space back to the OS
+void shrinkSpace(uint64_t* start, uint64_t** end, size_t newSize)
+{
+    uint64_t* newEnd = start + newSize / sizeof(uint64_t);
+    if (newEnd >= *end) return;
+
+    munmap(newEnd, (*end - newEnd) * sizeof(uint64_t));
+    *end = newEnd;
+}
+
+// Make sure that the next major collection leaves room for an extra
+// allocation of the given size in the old generation
+void reserveOldSpace(size_t sizeInBytes)
+{
+    size_t usedSize = heapSettings.markRegion ? regionUsedSize() : (oldPointer - oldStart) * sizeof(uint64_t);
+    size_t neededCapacity = roundUp(usedSize + sizeInBytes, pageSize());
+    if (neededCapacity > maxOldCapacity)
+    {
+        outOfMemory();
+    }
+
+    if (neededCapacity > oldCapacity)
+    {
+        oldCapacity = neededCapacity;
+        ++gcStatistics.heapGrowths;
+    }
+
+    // Don't let the next collection shrink the heap right back
+    underOccupiedCount = 0;
+
+    // Mark-region blocks are mapped as they're needed
+    if (heapSettings.markRegion)
+        return;
+
+    size_t spaceSize = semispaceSize(oldCapacity);
+    if ((otherEnd - otherStart) * sizeof(uint64_t) < spaceSize)
+    {
+        remapOtherSpace(spaceSize);
+    }
+}
+
+// Choose the capacity of the old generation after a major collection, given
+// the size of the surviving data. It grows as soon as the old generation is
+// too full, but only shrinks once occupancy has stayed low for a few
+// collections, to avoid thrashing. Returns whether the capacity shrank
+int chooseOldCapacity(size_t usedSize)
+{
+    size_t nurserySize = (heapEnd - heapStart) * sizeof(uint64_t);
+    double occupancy = (double)usedSize / oldCapacity;
+
+    // Enough room to reach the target occupancy, with room to promote a full
+    // nursery
+    double target = heapSettings.targetOccupancy;
+    size_t desiredCapacity = roundUp(usedSize / target + nurserySize, pageSize());
+    if (desiredCapacity < heapSettings.initialSize)
+        desiredCapacity = roundUp(heapSettings.initialSize, pageSize());
+    if (desiredCapacity > maxOldCapacity)
+        desiredCapacity = maxOldCapacity;
+
+    int shrinking = 0;
+    if (usedSize + nurserySize > oldCapacity || occupancy > (1 + target) / 2)
+    {
+        underOccupiedCount = 0;
+
+        if (desiredCapacity > oldCapacity)
+        {
+            oldCapacity = desiredCapacity;
+            ++gcStatistics.heapGrowths;
+        }
+    }
+    else if (occupancy < target / 2 && desiredCapacity < oldCapacity)
+    {
+        if (++underOccupiedCount >= SHRINK_DELAY)
+        {
+            underOccupiedCount = 0;
+            oldCapacity = desiredCapacity;
+            shrinking = 1;
+            ++gcStatistics.heapShrinks;
+        }
+    }
+    else
+    {
+        underOccupiedCount = 0;
+    }
+
+    return shrinking;
+}
+
+void resizeHeap()
+{
+    int shrinking = chooseOldCapacity((oldPointer - oldStart) * sizeof(uint64_t));
+
+    size_t spaceSize = semispaceSize(oldCapacity);
+
+    // The other space is empty, so it can simply be replaced or truncated
+    if ((otherEnd - otherStart) * sizeof(uint64_t) < spaceSize)
+    {
+        remapOtherSpace(spaceSize);
+    }
+    else
+    {
+        shrinkSpace(otherStart, &otherEnd, spaceSize);
+    }
+
+    // The current space can't move, so a larger capacity only takes effect
+    // after the next major collection. When shrinking, also release the
+    // physical memory behind its free part, which is dirty from earlier
+    // collections
+    if (shrinking)
+    {
+        shrinkSpace(oldStart, &oldMapEnd, spaceSize);
+
+        uint64_t* freeStart = (uint64_t*)roundUp((uint64_t)oldPointer, 4096);
+        if (freeStart < oldMapEnd)
+        {
+            madvise(freeStart, (oldMapEnd - freeStart) * sizeof(uint64_t), MADV_DONTNEED);
+        }
+    }
+
+    oldEnd = oldStart + oldCapacity / sizeof(uint64_t);
+    if (oldEnd > oldMapEnd)
+    {
+        oldEnd = oldMapEnd;
+    }
+}
+
+void* try_mymalloc(size_t) asm("try_mymalloc");
+
+// Try to allocate memory from the nursery
+void* try_mymalloc(size_t sizeInBytes)
+{
+    // Large objects never go in the nursery
+    if (sizeInBytes >= LARGE_OBJECT_SIZE)
+    {
+        return NULL;
+    }
+
+    // Allocate in units of 8 bytes
+    size_t sizeInWords = (sizeInBytes + 7) / 8;
+
+    // New allocation is at the current heapPointer. Check whether bumping the
+    // pointer would jump the end of the heap
+    uint64_t* p = heapPointer;
+    if (p + sizeInWords + 1 >= heapEnd)
+    {
+        return NULL;
+    }
+
+    heapPointer += (sizeInWords + 1);
+
+    // The first word of the allocated block contains the size in words
+    // (tagged so that we can distinguish it from a forwarding pointer)
+    *p = MAKE_HEADER(sizeInWords);
+
+    if (allocationProfiling)
+    {
+        profileAllocation(p);
+    }
+
+    return p + 1;
+}
+
+// Objects which would take up a large fraction of the nursery are allocated
+// directly in the old generation
+void* tryAllocateOld(size_t sizeInBytes)
+{
+    size_t sizeInWords = (sizeInBytes + 7) / 8;
+
+    uint64_t* p;
+    if (heapSettings.markRegion)
+    {
+        p = regionAllocate(sizeInWords + 1, regionCapacityBlocks());
+        if (!p) return NULL;
+    }
+    else
+    {
+        p = oldPointer;
+        if (p + sizeInWords + 1 > oldEnd)
+        {
+            return NULL;
+        }
+
+        oldPointer += (sizeInWords + 1);
+    }
+
+    *p = MAKE_HEADER(sizeInWords);
+
+    gcStatistics.bytesAllocated += (sizeInWords + 1) * sizeof(uint64_t);
+
+    if (allocationProfiling)
+    {
+        profileAllocation(p);
+    }
+
+    return p + 1;
+}
+
+size_t largeObjectMappedSize(size_t sizeInBytes)
+{
+    size_t sizeInWords = (sizeInBytes + 7) / 8;
+    return roundUp(sizeof(LargeObject) + (sizeInWords + 1) * sizeof(uint64_t), 4096);
+}
+
+void* allocateLarge(size_t sizeInBytes)
+{
+    size_t sizeInWords = (sizeInBytes + 7) / 8;
+    size_t mappedSize = largeObjectMappedSize(sizeInBytes);
+
+    LargeObject* largeObject = (LargeObject*)mapSpace(mappedSize);
+    largeObject->next = largeObjects;
+    largeObject->nextGray = NULL;
+    largeObject->mappedSize = mappedSize;
+    largeObject->marked = 0;
+    largeObjects = largeObject;
+    largeObjectBytes += mappedSize;
+
+    uint64_t* p = (uint64_t*)(largeObject + 1);
+    *p = MAKE_HEADER(sizeInWords) | HEADER_LARGE;
+
+    gcStatistics.bytesAllocated += (sizeInWords + 1) * sizeof(uint64_t);
+
+    if (allocationProfiling)
+    {
+        profileAllocation(p);
+    }
+
+    return p + 1;
+}
+
+// Called by gcCopy during a major collection instead of copying
+void markLarge(void* object)
+{
+    LargeObject* largeObject = (LargeObject*)((uint64_t*)object - 1) - 1;
+    if (largeObject->marked)
+        return;
+
+    largeObject->marked = 1;
+    largeObject->nextGray = grayLargeObjects;
+    grayLargeObjects = largeObject;
+
+    if (allocationProfiling)
+    {
+        recordSurvivor(*((uint64_t*)object - 1));
+    }
+}
+
+// Unmap every large object not marked by the last major collection
+void sweepLargeObjects()
+{
+    LargeObject** p = &largeObjects;
+    while (*p)
+    {
+        LargeObject* largeObject = *p;
+        if (largeObject->marked)
+        {
+            // The remembered set is empty after a major collection
+            uint64_t* block = (uint64_t*)(largeObject + 1);
+            *block &= ~(uint64_t)HEADER_REMEMBERED;
+
+            largeObject->marked = 0;
+            p = &largeObject->next;
+        }
+        else
+        {
+            *p = largeObject->next;
+            largeObjectBytes -= largeObject->mappedSize;
+            munmap(largeObject, largeObject->mappedSize);
+        }
+    }
+
+    // Like the old generation, aim for the target occupancy, but allow at
+    // least as much large-object allocation as the old generation could absorb
+    largeObjectLimit = largeObjectBytes / heapSettings.targetOccupancy;
+    if (largeObjectLimit < oldCapacity)
+    {
+        largeObjectLimit = oldCapacity;
+    }
+}
+
+// Called by compiled code after storing a pointer to a nursery object into an
+// object outside of the nursery
+void gcWriteBarrier(SplObject* object)
+{
+    uint64_t* block = (uint64_t*)object - 1;
+    if ((block < oldStart || block >= oldPointer) && !(*block & HEADER_LARGE))
+        return;
+
+    if (*block & HEADER_REMEMBERED)
+        return;
+
+    if (rememberedCount == rememberedCapacity)
+    {
+        rememberedCapacity = rememberedCapacity ? 2 * rememberedCapacity : 1024;
+        rememberedSet = realloc(rememberedSet, rememberedCapacity * sizeof(SplObject*));
+        if (!rememberedSet)
+        {
+            fail("*** Exception: Cannot expand remembered set");
+        }
+    }
+
+    *block |= HEADER_REMEMBERED;
+    rememberedSet[rememberedCount++] = object;
+}
+
+uint64_t* allocPtr;
+uint64_t* allocEnd;
+uint64_t* scanPtr;
+
+// In depth-first mode, copied objects which may contain references wait to be
+// scanned on this stack, instead of being scanned in to-space order (Cheney).
+// Children then tend to be copied next to their parents, which keeps linked
+// structures together
+SplObject** copyStack;
+size_t copyStackCount;
+size_t copyStackCapacity;
+
+void pushCopy(SplObject* object)
+{
+    uint64_t header = ((uint64_t*)object)[-1];
+    if (HEADER_KIND(header) == HEADER_UNBOXED_ARRAY || (HEADER_KIND(header) == HEADER_STRUCT && HEADER_LAYOUT(header) == 0))
+        return;
+
+    if (copyStackCount == copyStackCapacity)
+    {
+        copyStackCapacity = copyStackCapacity ? 2 * copyStackCapacity : 4096;
+        copyStack = realloc(copyStack, copyStackCapacity * sizeof(SplObject*));
+        if (!copyStack)
+        {
+            fail("*** Exception: Cannot expand GC copy stack");
+        }
+    }
+
+    copyStack[copyStackCount++] = object;
+}
+
+// Whether the old generation is being evacuated along with the nursery
+int majorCollection;
+
+// Whether p lies in [start, end), with a single comparison
+#define IN_SPACE(p, start, end) \
+    ((uintptr_t)(p) - (uintptr_t)(start) < (uintptr_t)(end) - (uintptr_t)(start))
+
+// How many elements ahead of the scan to prefetch the referents of a boxed array
+#define PREFETCH_DISTANCE   8
+
+// Copy the words of an object (not including its header). Most objects are only
+// a few words long, and for those a call to memcpy costs more than the copy
+static inline void copyObject(uint64_t* dest, const uint64_t* src, size_t sizeInWords)
+{
+    switch (sizeInWords)
+    {
+        case 8: dest[7] = src[7]; // fall through
+        case 7: dest[6] = src[6]; // fall through
+        case 6: dest[5] = src[5]; // fall through
+        case 5: dest[4] = src[4]; // fall through
+        case 4: dest[3] = src[3]; // fall through
+        case 3: dest[2] = src[2]; // fall through
+        case 2: dest[1] = src[1];
+                dest[0] = src[0];
+                break;
+
+        default:
+            memcpy(dest, src, sizeInWords * sizeof(uint64_t));
+            break;
+    }
+}
+
+// Start loading the header of a referenced object, which gcCopy will need soon
+static inline void prefetchObject(void* object)
+{
+    __builtin_prefetch((uint64_t*)object - 1, 1);
+}
+
+static inline void* gcCopyObject(void* object)
+{
+    if (heapSettings.markRegion) return regionCopy(object);
+
+    // Back up one word to the beginning of the allocated block
+    uint64_t* block = (uint64_t*)object - 1;
+
+    // It's possible for heap objects to contain references to non-heap memory,
+    // like static strings, and null pointers. During a minor collection, those
+    // and old objects stay put, and are never dereferenced
+    if (!IN_SPACE(block, heapStart, heapEnd))
+    {
+        if (!majorCollection)
+            return object;
+
+        if (!IN_SPACE(block, oldStart, oldEnd))
+        {
+            // Large objects are marked in place. Everything else outside of the
+            // nursery and the old generation (static strings) has a header too
+            if (object && (*block & HEADER_LARGE))
+            {
+                markLarge(object);
+            }
+
+            return object;
+        }
+    }
+
+    uint64_t header = *block;
+    if (!(header & HEADER_TAG))
+    {
+        // No tag => this is a forwarding pointer. Don't copy
+        return (void*)header;
+    }
+
+    size_t sizeInWords = HEADER_SIZE(header);
+
+    // The to-space can only be too small when it's been capped by the maximum
+    // heap size
+    uint64_t* copy = allocPtr;
+    if (copy + sizeInWords + 1 > allocEnd)
+    {
+        outOfMemory();
+    }
+
+    allocPtr += (sizeInWords + 1);
+
+    // Copy to the "to" space. Copies are never in the remembered set
+    *copy = header & ~(uint64_t)HEADER_REMEMBERED;
+    copyObject(copy + 1, block + 1, sizeInWords);
+
+    // Leave a forwarding address (to the object, not the block header)
+    void* newLocation = copy + 1;
+    *block = (uint64_t)newLocation;
+
+    if (allocationProfiling)
+    {
+        recordSurvivor(header);
+    }
+
+    if (heapSettings.depthFirst)
+    {
+        pushCopy((SplObject*)newLocation);
+    }
+
+    return newLocation;
+}
+
+// References may carry a constructor tag in their low bits (see
+// POINTER_TAG_MASK), which is kept on the copy. Short strings aren't pointers
+// at all
+void* gcCopy(void* object)
+{
+    if (IS_SHORT_STRING(object))
+        return object;
+
+    uintptr_t tag = (uintptr_t)object & POINTER_TAG_MASK;
+    return (char*)gcCopyObject((char*)object - tag) + tag;
+}
+
+// Reference bitmaps of the structures whose bitmap doesn't fit in the header,
+// emitted by the compiler (see AsmPrinter::printProgram)
+extern uint64_t __typeDescriptors[];
+
+// Reference bitmap of a structure, from its header
+static inline uint64_t structRefMask(uint64_t header)
+{
+    if (HEADER_KIND(header) == HEADER_DESCRIBED_STRUCT)
+    {
+        return __typeDescriptors[HEADER_LAYOUT(header)];
+    }
+
+    return HEADER_LAYOUT(header);
+}
+
+// Copy all of the children of this object, and update its references
+void gcScanObject(SplObject* object)
+{
+    uint64_t header = ((uint64_t*)object)[-1];
+    if (HEADER_KIND(header) == HEADER_BOXED_ARRAY)
+    {
+        size_t n = ((Array*)object)->numElements;
+        SplObject** p = (SplObject**)((Array*)object + 1);
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (i + PREFETCH_DISTANCE < n)
+            {
+                prefetchObject(p[i + PREFETCH_DISTANCE]);
+            }
+
+            p[i] = (SplObject*)gcCopy(p[i]);
+        }
+    }
+    else if (HEADER_KIND(header) == HEADER_FLAT_ARRAY)
+    {
+        // Only the first few words of each element are references
+        FlatArray* array = (FlatArray*)object;
+        size_t n = array->numElements;
+        size_t size = ELEMENT_SIZE(array->elementLayout);
+        size_t refs = ELEMENT_REFS(array->elementLayout);
+        SplObject** p = (SplObject**)(array + 1);
+        for (size_t i = 0; i < n; ++i, p += size)
+        {
+            if (i + PREFETCH_DISTANCE < n)
+            {
+                prefetchObject(p[PREFETCH_DISTANCE * size]);
+            }
+
+            for (size_t j = 0; j < refs; ++j)
+            {
+                p[j] = (SplObject*)gcCopy(p[j]);
+            }
+        }
+    }
+    else if (header & HEADER_STRUCT)
+    {
+        // Visit the set bits of the mask from lowest to highest. The children
+        // are all prefetched before the first one is copied
+        SplObject** p = (SplObject**)object;
+        uint64_t refMask = structRefMask(header);
+        for (uint64_t mask = refMask; mask != 0; mask &= mask - 1)
+        {
+            prefetchObject(p[__builtin_ctzll(mask)]);
+        }
+
+        for (uint64_t mask = refMask; mask != 0; mask &= mask - 1)
+        {
+            int i = __builtin_ctzll(mask);
+            p[i] = (SplObject*)gcCopy(p[i]);
+        }
+    }
+}
+
+void gcScan()
+{
+    while (1)
+    {
+        while (copyStackCount)
+        {
+            SplObject* object = copyStack[--copyStackCount];
+
+            size_t first = copyStackCount;
+            gcScanObject(object);
+
+            // The children were pushed in field order. Reverse them, so that
+            // the subtree of the first child is copied first
+            size_t last = copyStackCount;
+            while (last > first + 1)
+            {
+                SplObject* tmp = copyStack[first];
+                copyStack[first++] = copyStack[--last];
+                copyStack[last] = tmp;
+            }
+        }
+
+        while (scanPtr < allocPtr && !heapSettings.depthFirst)
+        {
+            // Skip the size word to get to the next object on the scan list
+            SplObject* object = (SplObject*)(scanPtr + 1);
+            gcScanObject(object);
+
+            size_t sizeInWords = HEADER_SIZE(*scanPtr);
+            scanPtr += (sizeInWords + 1);
+        }
+
+        // Marked large objects aren't in the to-space, so they have their own
+        // list of objects waiting to be scanned
+        if (!grayLargeObjects)
+            break;
+
+        LargeObject* largeObject = grayLargeObjects;
+        grayLargeObjects = largeObject->nextGray;
+        gcScanObject((SplObject*)((uint64_t*)(largeObject + 1) + 1));
+    }
+
+    scanPtr = allocPtr;
+}
+
+// Stack map emitted by the compiler (see AsmPrinter::printProgram). Both
+// tables are sorted by address
+typedef struct StackMapFunction
+{
+    uint64_t address;
+    uint64_t firstCallSite;
+} StackMapFunction;
+
+typedef struct StackMapCallSite
+{
+    uint32_t offset;        // Return address, relative to the function start
+    uint32_t descriptor;    // Offset into __stackMapDescriptors
+} StackMapCallSite;
+
+extern uint64_t __stackMap[];
+extern StackMapCallSite __stackMapCallSites[];
+extern int32_t __stackMapDescriptors[];
+
+// Recursive code puts the same return address in many frames, so remember
+// recent lookups
+#define STACK_MAP_CACHE_SIZE 1024
+
+struct
+{
+    void* returnAddress;
+    int32_t* descriptor;
+} stackMapCache[STACK_MAP_CACHE_SIZE];
+
+// Returns the live stack variables at a call site: a count, followed by the
+// rbp offsets of the variables
+int32_t* findInStackMap(void* returnAddress)
+{
+    size_t slot = ((uintptr_t)returnAddress >> 2) % STACK_MAP_CACHE_SIZE;
+    if (stackMapCache[slot].returnAddress == returnAddress)
+    {
+        return stackMapCache[slot].descriptor;
+    }
+
+    // First word gives number of functions. The function entries are followed
+    // by a sentinel, so entry i + 1 always exists
+    size_t numFunctions = __stackMap[0];
+    StackMapFunction* functions = (StackMapFunction*)&__stackMap[1];
+    if (numFunctions == 0) return NULL;
+
+    // Find the last function starting at or before the return address
+    size_t low = 0, high = numFunctions;
+    while (high - low > 1)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (functions[mid].address <= (uint64_t)returnAddress)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    uint64_t offset = (uint64_t)returnAddress - functions[low].address;
+
+    // Then the call site within that function
+    size_t first = functions[low].firstCallSite;
+    size_t last = functions[low + 1].firstCallSite;
+    while (first < last)
+    {
+        size_t mid = first + (last - first) / 2;
+        StackMapCallSite* callSite = &__stackMapCallSites[mid];
+
+        if (callSite->offset == offset)
+        {
+            int32_t* descriptor = &__stackMapDescriptors[callSite->descriptor];
+
+            stackMapCache[slot].returnAddress = returnAddress;
+            stackMapCache[slot].descriptor = descriptor;
+
+            return descriptor;
+        }
+        else if (callSite->offset < offset)
+        {
+            first = mid + 1;
+        }
+        else
+        {
+            last = mid;
+        }
+    }
+
+    return NULL;
+}
+
+// Copy the object referred to by a root, and update the root
+void copyRoot(uint64_t* root)
+{
+    *root = (uint64_t)gcCopy((void*)*root);
+}
+
+// Call visit on the address of each root: live stack slots and the additional
+// roots
+void gcVisitRoots(uint64_t* stackTop, uint64_t* stackBottom, uint64_t* additionalRoots, void (*visit)(uint64_t*))
+{
+    uint64_t* rbp = stackTop;
+
+    // Skip the gcAllocate stack frame
+
+    // mov rsp, rbp
+    // pop rbp
+    // ret
+    uint64_t* rsp = rbp;
+    rbp = (uint64_t*)*rsp++;
+    void* callSite = (void*)*rsp++;
+
+    while (1)
+    {
+        // printf("Stack frame:\n");
+        // printf("\trbp=%p, rsp=%p\n", rbp, rsp);
+        // printf("\tcallSite=%p\n", callSite);
+
+        int32_t* stackMapEntry = findInStackMap(callSite);
+        assert(stackMapEntry);
+
+        // printf("\tstackMapEntry=%p\n", stackMapEntry);
+
+        int32_t n = *stackMapEntry;
+
+        // printf("\tn=%ld\n", n);
+        for (int32_t i = 0; i < n; ++i)
+        {
+            int64_t offset = stackMapEntry[i + 1];
             uint64_t* p = rbp + offset / 8;
 
-            // printf("\toffset=%ld, p=%p\n", offset, p);
+            // printf("\toffset=%ld, p=%p\n", offset, p);
+
+            // printf("\tobject=%p\n", (void*)*p);
+            visit(p);
+        }
+
+        if (rbp == stackBottom)
+            break;
+
+        // mov rsp, rbp
+        // pop rbp
+        // ret
+        rsp = rbp;
+        rbp = (uint64_t*)*rsp++;
+        callSite = (void*)*rsp++;
+    }
+
+    // printf("\n");
+    // printf("Finished with stack roots\n");
+
+    while (additionalRoots)
+    {
+        uint64_t numGlobals = *additionalRoots;
+        uint64_t** p = (uint64_t**)(additionalRoots + 1);
+        for (size_t i = 0; i < numGlobals; ++i)
+        {
+            visit(*p);
+            ++p;
+        }
+
+        additionalRoots = *p;
+    }
+
+    // printf("Finished with additional roots\n");
+}
+
+//// Parallel collection ///////////////////////////////////////////////////////
+
+// With more than one GC thread, each collection is shared between the thread
+// which triggered it and heapSettings.threads - 1 workers started along with
+// the heap. The roots are gathered into an array and claimed in batches.
+// Objects are copied into thread-local chunks of the to-space, with forwarding
+// pointers installed in the header word by compare-and-swap, and copied
+// objects wait to be scanned in per-thread work-stealing deques
+
+#define GC_DEQUE_SIZE       (1 << 15)   // Must be a power of 2
+#define GC_ROOT_BATCH       64
+
+// Chase-Lev deque: the owner pushes and pops at the bottom, and other threads
+// steal from the top
+typedef struct WorkDeque
+{
+    int64_t top;
+    char padding[56];                   // Keep top and bottom on separate cache lines
+    int64_t bottom;
+    SplObject** items;
+} WorkDeque;
+
+typedef struct GCWorker
+{
+    size_t index;
+    WorkDeque deque;
+
+    // Thread-local part of the to-space
+    uint64_t* chunkPointer;
+    uint64_t* chunkEnd;
+} GCWorker;
+
+GCWorker* gcWorkers;
+
+typedef struct GCBarrier
+{
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+    size_t waiting;
+    uint64_t generation;
+} GCBarrier;
+
+GCBarrier startBarrier = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+GCBarrier endBarrier = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+// Shared state of the current parallel collection
+uint64_t** rootSlots;
+size_t rootCount;
+size_t rootCapacity;
+size_t nextRoot;
+
+size_t parallelRememberedCount;
+size_t nextRemembered;
+
+uint64_t parallelCursor;                // Next unclaimed address in the to-space
+size_t idleThreads;
+
+// Work which didn't fit in a full deque
+SplObject** overflowStack;
+size_t overflowCount;
+size_t overflowCapacity;
+pthread_mutex_t overflowLock = PTHREAD_MUTEX_INITIALIZER;
+
+void barrierWait(GCBarrier* barrier)
+{
+    pthread_mutex_lock(&barrier->lock);
+
+    uint64_t generation = barrier->generation;
+    if (++barrier->waiting == heapSettings.threads)
+    {
+        barrier->waiting = 0;
+        ++barrier->generation;
+        pthread_cond_broadcast(&barrier->condition);
+    }
+    else
+    {
+        while (generation == barrier->generation)
+        {
+            pthread_cond_wait(&barrier->condition, &barrier->lock);
+        }
+    }
+
+    pthread_mutex_unlock(&barrier->lock);
+}
+
+void pushWork(GCWorker* worker, SplObject* object)
+{
+    WorkDeque* deque = &worker->deque;
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if (bottom - top >= GC_DEQUE_SIZE)
+    {
+        pthread_mutex_lock(&overflowLock);
+
+        if (overflowCount == overflowCapacity)
+        {
+            overflowCapacity = overflowCapacity ? 2 * overflowCapacity : GC_DEQUE_SIZE;
+            overflowStack = realloc(overflowStack, overflowCapacity * sizeof(SplObject*));
+            if (!overflowStack)
+            {
+                fail("*** Exception: Cannot expand GC work queue");
+            }
+        }
+
+        overflowStack[overflowCount] = object;
+        __atomic_store_n(&overflowCount, overflowCount + 1, __ATOMIC_RELEASE);
+
+        pthread_mutex_unlock(&overflowLock);
+        return;
+    }
+
+    __atomic_store_n(&deque->items[bottom & (GC_DEQUE_SIZE - 1)], object, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+SplObject* popWork(GCWorker* worker)
+{
+    WorkDeque* deque = &worker->deque;
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+
+    if (top > bottom)
+    {
+        // Empty
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    SplObject* object = __atomic_load_n(&deque->items[bottom & (GC_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom)
+    {
+        // Last item: race against thieves for it
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            object = NULL;
+        }
+
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    return object;
+}
+
+SplObject* stealWork(GCWorker* victim)
+{
+    WorkDeque* deque = &victim->deque;
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+    if (top >= bottom)
+        return NULL;
+
+    SplObject* object = __atomic_load_n(&deque->items[top & (GC_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+
+    return object;
+}
+
+SplObject* findWork(GCWorker* worker)
+{
+    if (__atomic_load_n(&overflowCount, __ATOMIC_ACQUIRE))
+    {
+        SplObject* object = NULL;
+
+        pthread_mutex_lock(&overflowLock);
+        if (overflowCount)
+        {
+            object = overflowStack[--overflowCount];
+        }
+        pthread_mutex_unlock(&overflowLock);
+
+        if (object) return object;
+    }
+
+    for (size_t i = 1; i < heapSettings.threads; ++i)
+    {
+        GCWorker* victim = &gcWorkers[(worker->index + i) % heapSettings.threads];
+
+        SplObject* object = stealWork(victim);
+        if (object) return object;
+    }
+
+    return NULL;
+}
+
+int workAvailable()
+{
+    if (__atomic_load_n(&overflowCount, __ATOMIC_ACQUIRE))
+        return 1;
+
+    for (size_t i = 0; i < heapSettings.threads; ++i)
+    {
+        WorkDeque* deque = &gcWorkers[i].deque;
+        if (__atomic_load_n(&deque->top, __ATOMIC_SEQ_CST) < __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST))
+            return 1;
+    }
+
+    return 0;
+}
+
+// Make an unused part of the to-space look like an unboxed array, so that the
+// space can still be walked object by object
+void fillGap(uint64_t* start, uint64_t* end)
+{
+    if (start >= end)
+        return;
+
+    size_t sizeInWords = end - start - 1;
+    start[0] = MAKE_HEADER(sizeInWords);
+    if (sizeInWords >= 1) start[1] = (sizeInWords - 1) * sizeof(uint64_t);
+}
+
+// Claim part of the shared to-space. Fails if the to-space is exhausted
+uint64_t* claimToSpace(size_t sizeInWords)
+{
+    uint64_t* result = (uint64_t*)__atomic_fetch_add(&parallelCursor, sizeInWords * sizeof(uint64_t), __ATOMIC_RELAXED);
+    if (result + sizeInWords > allocEnd)
+    {
+        outOfMemory();
+    }
+
+    return result;
+}
+
+// Allocate a block of the given size (including the header) in the to-space
+uint64_t* parallelAllocate(GCWorker* worker, size_t sizeInWords)
+{
+    if (worker->chunkPointer + sizeInWords <= worker->chunkEnd)
+    {
+        uint64_t* result = worker->chunkPointer;
+        worker->chunkPointer += sizeInWords;
+        return result;
+    }
+
+    // Objects which are large relative to a chunk are allocated on their own
+    if (sizeInWords > GC_CHUNK_WORDS / 32)
+    {
+        return claimToSpace(sizeInWords);
+    }
+
+    fillGap(worker->chunkPointer, worker->chunkEnd);
+
+    worker->chunkPointer = claimToSpace(GC_CHUNK_WORDS);
+    worker->chunkEnd = worker->chunkPointer + GC_CHUNK_WORDS;
+
+    uint64_t* result = worker->chunkPointer;
+    worker->chunkPointer += sizeInWords;
+    return result;
+}
+
+void parallelMarkLarge(GCWorker* worker, void* object)
+{
+    LargeObject* largeObject = (LargeObject*)((uint64_t*)object - 1) - 1;
+
+    uint64_t expected = 0;
+    if (__atomic_compare_exchange_n(&largeObject->marked, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        if (allocationProfiling)
+        {
+            recordSurvivor(*((uint64_t*)object - 1));
+        }
+
+        pushWork(worker, (SplObject*)object);
+    }
+}
+
+static inline void* parallelCopyObject(GCWorker* worker, void* object)
+{
+    uint64_t* block = (uint64_t*)object - 1;
+
+    if (!IN_SPACE(block, heapStart, heapEnd))
+    {
+        if (!majorCollection)
+            return object;
+
+        if (!IN_SPACE(block, oldStart, oldEnd))
+        {
+            if (object && (*block & HEADER_LARGE))
+            {
+                parallelMarkLarge(worker, object);
+            }
+
+            return object;
+        }
+    }
+
+    uint64_t header = __atomic_load_n(block, __ATOMIC_ACQUIRE);
+    if (!(header & HEADER_TAG))
+    {
+        return (void*)header;
+    }
+
+    // Copy speculatively, and then try to install the forwarding pointer. The
+    // header is rewritten because another thread may have already replaced it
+    size_t sizeInWords = HEADER_SIZE(header) + 1;
+    uint64_t* copy = parallelAllocate(worker, sizeInWords);
+    copyObject(copy + 1, block + 1, sizeInWords - 1);
+    copy[0] = header & ~(uint64_t)HEADER_REMEMBERED;
+
+    void* newLocation = copy + 1;
+    if (__atomic_compare_exchange_n(block, &header, (uint64_t)newLocation, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        if (allocationProfiling)
+        {
+            recordSurvivor(copy[0]);
+        }
+
+        pushWork(worker, (SplObject*)newLocation);
+        return newLocation;
+    }
+
+    // Another thread won the race, and header now holds its forwarding pointer
+    if (copy + sizeInWords == worker->chunkPointer)
+    {
+        worker->chunkPointer = copy;
+    }
+    else
+    {
+        fillGap(copy, copy + sizeInWords);
+    }
+
+    return (void*)header;
+}
+
+// Thread-safe version of gcCopy
+void* parallelCopy(GCWorker* worker, void* object)
+{
+    if (IS_SHORT_STRING(object))
+        return object;
+
+    uintptr_t tag = (uintptr_t)object & POINTER_TAG_MASK;
+    return (char*)parallelCopyObject(worker, (char*)object - tag) + tag;
+}
+
+// Thread-safe version of gcScanObject
+void parallelScanObject(GCWorker* worker, SplObject* object)
+{
+    uint64_t header = ((uint64_t*)object)[-1];
+    if (HEADER_KIND(header) == HEADER_BOXED_ARRAY)
+    {
+        size_t n = ((Array*)object)->numElements;
+        SplObject** p = (SplObject**)((Array*)object + 1);
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (i + PREFETCH_DISTANCE < n)
+            {
+                prefetchObject(p[i + PREFETCH_DISTANCE]);
+            }
+
+            p[i] = (SplObject*)parallelCopy(worker, p[i]);
+        }
+    }
+    else if (HEADER_KIND(header) == HEADER_FLAT_ARRAY)
+    {
+        // Only the first few words of each element are references
+        FlatArray* array = (FlatArray*)object;
+        size_t n = array->numElements;
+        size_t size = ELEMENT_SIZE(array->elementLayout);
+        size_t refs = ELEMENT_REFS(array->elementLayout);
+        SplObject** p = (SplObject**)(array + 1);
+        for (size_t i = 0; i < n; ++i, p += size)
+        {
+            if (i + PREFETCH_DISTANCE < n)
+            {
+                prefetchObject(p[PREFETCH_DISTANCE * size]);
+            }
+
+            for (size_t j = 0; j < refs; ++j)
+            {
+                p[j] = (SplObject*)parallelCopy(worker, p[j]);
+            }
+        }
+    }
+    else if (header & HEADER_STRUCT)
+    {
+        SplObject** p = (SplObject**)object;
+        uint64_t refMask = structRefMask(header);
+        for (uint64_t mask = refMask; mask != 0; mask &= mask - 1)
+        {
+            prefetchObject(p[__builtin_ctzll(mask)]);
+        }
+
+        for (uint64_t mask = refMask; mask != 0; mask &= mask - 1)
+        {
+            int i = __builtin_ctzll(mask);
+            p[i] = (SplObject*)parallelCopy(worker, p[i]);
+        }
+    }
+}
+
+// The part of a parallel collection performed by each thread
+void parallelTrace(GCWorker* worker)
+{
+    // Claim roots in batches
+    while (1)
+    {
+        size_t first = __atomic_fetch_add(&nextRoot, GC_ROOT_BATCH, __ATOMIC_RELAXED);
+        if (first >= rootCount) break;
+
+        size_t last = first + GC_ROOT_BATCH < rootCount ? first + GC_ROOT_BATCH : rootCount;
+        for (size_t i = first; i < last; ++i)
+        {
+            uint64_t* root = rootSlots[i];
+            *root = (uint64_t)parallelCopy(worker, (void*)*root);
+        }
+    }
+
+    while (1)
+    {
+        size_t first = __atomic_fetch_add(&nextRemembered, GC_ROOT_BATCH, __ATOMIC_RELAXED);
+        if (first >= parallelRememberedCount) break;
+
+        size_t last = first + GC_ROOT_BATCH < parallelRememberedCount ? first + GC_ROOT_BATCH : parallelRememberedCount;
+        for (size_t i = first; i < last; ++i)
+        {
+            SplObject* object = rememberedSet[i];
+            *((uint64_t*)object - 1) &= ~(uint64_t)HEADER_REMEMBERED;
+            parallelScanObject(worker, object);
+        }
+    }
+
+    // Scan copied objects until every thread runs out of work
+    while (1)
+    {
+        SplObject* object;
+        while ((object = popWork(worker)))
+        {
+            parallelScanObject(worker, object);
+        }
+
+        object = findWork(worker);
+        if (object)
+        {
+            parallelScanObject(worker, object);
+            continue;
+        }
+
+        // Once every thread is idle, there's no thread left to create work
+        __atomic_add_fetch(&idleThreads, 1, __ATOMIC_SEQ_CST);
+        while (1)
+        {
+            if (__atomic_load_n(&idleThreads, __ATOMIC_SEQ_CST) == heapSettings.threads)
+                return;
+
+            if (workAvailable())
+            {
+                __atomic_sub_fetch(&idleThreads, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+
+            sched_yield();
+        }
+    }
+}
+
+void* collectorThread(void* argument)
+{
+    GCWorker* worker = argument;
+
+    while (1)
+    {
+        barrierWait(&startBarrier);
+        parallelTrace(worker);
+        barrierWait(&endBarrier);
+    }
+
+    return NULL;
+}
+
+void startCollectorThreads()
+{
+    gcWorkers = calloc(heapSettings.threads, sizeof(GCWorker));
+    if (!gcWorkers)
+    {
+        fail("*** Exception: Cannot start GC threads");
+    }
+
+    for (size_t i = 0; i < heapSettings.threads; ++i)
+    {
+        gcWorkers[i].index = i;
+        gcWorkers[i].deque.items = malloc(GC_DEQUE_SIZE * sizeof(SplObject*));
+        if (!gcWorkers[i].deque.items)
+        {
+            fail("*** Exception: Cannot start GC threads");
+        }
+    }
+
+    // The thread which triggers a collection acts as worker 0
+    for (size_t i = 1; i < heapSettings.threads; ++i)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, collectorThread, &gcWorkers[i]) != 0)
+        {
+            fail("*** Exception: Cannot start GC threads");
+        }
+
+        pthread_detach(thread);
+    }
+}
+
+void recordRoot(uint64_t* root)
+{
+    if (rootCount == rootCapacity)
+    {
+        rootCapacity = rootCapacity ? 2 * rootCapacity : 1024;
+        rootSlots = realloc(rootSlots, rootCapacity * sizeof(uint64_t*));
+        if (!rootSlots)
+        {
+            fail("*** Exception: Cannot expand GC root list");
+        }
+    }
+
+    rootSlots[rootCount++] = root;
+}
+
+// Parallel equivalent of copying the roots (and in a minor collection, the
+// remembered set) and then running gcScan. Copies into [allocPtr, allocEnd),
+// and advances allocPtr
+void gcParallelTrace(uint64_t* stackTop, uint64_t* stackBottom, uint64_t* additionalRoots)
+{
+    rootCount = 0;
+    gcVisitRoots(stackTop, stackBottom, additionalRoots, recordRoot);
+
+    nextRoot = 0;
+    nextRemembered = 0;
+    parallelRememberedCount = majorCollection ? 0 : rememberedCount;
+    parallelCursor = (uint64_t)allocPtr;
+    idleThreads = 0;
+
+    for (size_t i = 0; i < heapSettings.threads; ++i)
+    {
+        gcWorkers[i].chunkPointer = gcWorkers[i].chunkEnd = NULL;
+        gcWorkers[i].deque.top = gcWorkers[i].deque.bottom = 0;
+    }
+
+    barrierWait(&startBarrier);
+    parallelTrace(&gcWorkers[0]);
+    barrierWait(&endBarrier);
+
+    for (size_t i = 0; i < heapSettings.threads; ++i)
+    {
+        fillGap(gcWorkers[i].chunkPointer, gcWorkers[i].chunkEnd);
+    }
+
+    allocPtr = (uint64_t*)parallelCursor;
+    scanPtr = allocPtr;
+}
+
+//// Mark-region collection ////////////////////////////////////////////////////
+
+// With --gc-collector=mark-region, the old generation is divided into blocks
+// of lines, in the style of Immix. Objects are bump-allocated into runs of free
+// lines, and a major collection marks the live objects in place, along with the
+// lines they occupy, instead of copying them into a to-space. The heap then
+// needs about half as much memory. To limit fragmentation, objects in blocks
+// which were mostly free after the previous major collection are evacuated
+// into free blocks, as long as there is room. Minor collections promote the
+// live nursery objects into free lines as usual
+
+#define NO_BLOCK            ((size_t)-1)
+
+// Evacuate blocks in which fewer than 1/EVACUATE_FRACTION of the lines were
+// live after the previous major collection
+#define EVACUATE_FRACTION   4
+
+// Evacuation may use up to 1/EVACUATION_HEADROOM of the capacity beyond it
+#define EVACUATION_HEADROOM 32
+
+// Current run of free lines, and where to look for the next one
+uint64_t* holeCursor;
+uint64_t* holeLimit;
+size_t holeBlock = NO_BLOCK;
+size_t holeNextLine;
+
+// Objects bigger than a line which don't fit in the current hole go in a
+// separate block, rather than wasting the rest of the hole
+uint64_t* overflowCursor;
+uint64_t* overflowLimit;
+size_t overflowBlock = NO_BLOCK;
+
+// Set during a major collection, while the line marks are being rebuilt. Only
+// entirely free blocks can be allocated into until the sweep
+int regionCollecting;
+
+// Lines marked by the last major collection
+size_t regionLiveLines;
+
+void initializeRegion()
+{
+    size_t reservedSize = heapSettings.maxSize ? roundUp(maxOldCapacity, REGION_BLOCK_SIZE) : REGION_RESERVE;
+
+    // Reserve address space only. Blocks are made accessible as they're needed
+    oldStart = mmap(0, reservedSize, PROT_NONE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (oldStart == MAP_FAILED)
+    {
+        outOfMemory();
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (heapSettings.hugePages)
+    {
+        madvise(oldStart, reservedSize, MADV_HUGEPAGE);
+    }
+#endif
+
+    oldPointer = oldStart;
+    oldEnd = oldStart + reservedSize / sizeof(uint64_t);
+    regionReservedBlocks = reservedSize / REGION_BLOCK_SIZE;
+}
+
+uint64_t* blockAddress(size_t block)
+{
+    return oldStart + block * BLOCK_WORDS;
+}
+
+size_t regionCapacityBlocks()
+{
+    return oldCapacity / REGION_BLOCK_SIZE;
+}
+
+size_t regionUsedSize()
+{
+    return regionUsedBlocks * REGION_BLOCK_SIZE;
+}
+
+// Free space in the old generation, in words, not counting growth beyond the
+// capacity
+size_t regionFreeWords()
+{
+    size_t capacity = regionCapacityBlocks();
+    size_t freeWords = recyclableFreeWords + (holeLimit - holeCursor) + (overflowLimit - overflowCursor);
+    if (capacity > regionUsedBlocks)
+    {
+        freeWords += (capacity - regionUsedBlocks) * BLOCK_WORDS;
+    }
+
+    return freeWords;
+}
+
+// Make the next reserved block accessible
+void mapRegionBlock()
+{
+    if (regionBlockCount == regionBlockCapacity)
+    {
+        regionBlockCapacity = regionBlockCapacity ? 2 * regionBlockCapacity : 64;
+        regionBlocks = realloc(regionBlocks, regionBlockCapacity * sizeof(RegionBlock));
+        recyclableBlocks = realloc(recyclableBlocks, regionBlockCapacity * sizeof(uint32_t));
+        freeBlocks = realloc(freeBlocks, regionBlockCapacity * sizeof(uint32_t));
+        if (!regionBlocks || !recyclableBlocks || !freeBlocks)
+        {
+            fail("*** Exception: Cannot expand block table");
+        }
+    }
+
+    uint64_t* start = blockAddress(regionBlockCount);
+    if (mprotect(start, REGION_BLOCK_SIZE, PROT_READ | PROT_WRITE) != 0)
+    {
+        outOfMemory();
+    }
+
+    memset(&regionBlocks[regionBlockCount], 0, sizeof(RegionBlock));
+    ++regionBlockCount;
+    oldPointer = start + BLOCK_WORDS;
+}
+
+// Take an entirely free block, as long as fewer than limit blocks are in use
+size_t regionTakeBlock(size_t limit)
+{
+    if (regionUsedBlocks >= limit)
+        return NO_BLOCK;
+
+    size_t block = freeBlockCount ? freeBlocks[freeBlockCount - 1] : regionBlockCount;
+    if (block == regionReservedBlocks)
+        return NO_BLOCK;
+
+    int resident = (block < regionBlockCount && regionBlocks[block].resident);
+    if (!resident && heapSettings.maxSize && totalHeapSize() + REGION_BLOCK_SIZE > heapSettings.maxSize)
+        return NO_BLOCK;
+
+    if (freeBlockCount)
+    {
+        --freeBlockCount;
+    }
+    else
+    {
+        mapRegionBlock();
+    }
+
+    RegionBlock* info = &regionBlocks[block];
+    if (!info->resident)
+    {
+        info->resident = 1;
+        ++regionResidentBlocks;
+    }
+
+    info->inUse = 1;
+    info->liveLines = 0;
+    info->evacuate = 0;
+    ++regionUsedBlocks;
+
+    return block;
+}
+
+// Find the next run of free lines in the hole block, starting at holeNextLine
+int regionFindHole()
+{
+    RegionBlock* info = &regionBlocks[holeBlock];
+
+    size_t line = holeNextLine;
+    while (line < LINES_PER_BLOCK && info->lineMarks[line])
+        ++line;
+
+    if (line == LINES_PER_BLOCK)
+    {
+        holeNextLine = line;
+        return 0;
+    }
+
+    size_t end = line + 1;
+    while (end < LINES_PER_BLOCK && !info->lineMarks[end])
+        ++end;
+
+    holeCursor = blockAddress(holeBlock) + line * LINE_WORDS;
+    holeLimit = blockAddress(holeBlock) + end * LINE_WORDS;
+    holeNextLine = end;
+
+    return 1;
+}
+
+// Move on to the next hole: in the current block, then in the recyclable
+// blocks, and finally a free block
+int regionNextHole(size_t blockLimit)
+{
+    if (!regionCollecting)
+    {
+        if (holeBlock != NO_BLOCK && regionFindHole())
+            return 1;
+
+        while (nextRecyclable < recyclableCount)
+        {
+            holeBlock = recyclableBlocks[nextRecyclable++];
+            holeNextLine = 0;
+            recyclableFreeWords -= (LINES_PER_BLOCK - regionBlocks[holeBlock].liveLines) * LINE_WORDS;
+
+            if (regionFindHole())
+                return 1;
+        }
+    }
+
+    size_t block = regionTakeBlock(blockLimit);
+    if (block == NO_BLOCK)
+        return 0;
+
+    holeBlock = block;
+    holeNextLine = LINES_PER_BLOCK;
+    holeCursor = blockAddress(block);
+    holeLimit = holeCursor + BLOCK_WORDS;
+
+    return 1;
+}
+
+// Allocate a block of the given size (including the header) in the old
+// generation, taking new blocks only while fewer than blockLimit are in use.
+// Returns NULL if there's no room
+uint64_t* regionAllocate(size_t sizeInWords, size_t blockLimit)
+{
+    uint64_t* p = holeCursor;
+    if (p + sizeInWords <= holeLimit)
+    {
+        holeCursor += sizeInWords;
+        return p;
+    }
+
+    if (sizeInWords > LINE_WORDS)
+    {
+        if (overflowCursor + sizeInWords > overflowLimit)
+        {
+            size_t block = regionTakeBlock(blockLimit);
+            if (block == NO_BLOCK)
+                return NULL;
+
+            overflowBlock = block;
+            overflowCursor = blockAddress(block);
+            overflowLimit = overflowCursor + BLOCK_WORDS;
+        }
+
+        p = overflowCursor;
+        overflowCursor += sizeInWords;
+        return p;
+    }
+
+    // Every hole is at least a line long
+    if (!regionNextHole(blockLimit))
+        return NULL;
+
+    p = holeCursor;
+    holeCursor += sizeInWords;
+    return p;
+}
+
+// Mark an old object in place, along with the lines it occupies
+void regionMark(uint64_t* block)
+{
+    size_t offset = block - oldStart;
+    RegionBlock* info = &regionBlocks[offset / BLOCK_WORDS];
+    size_t word = offset % BLOCK_WORDS;
+
+    info->markBits[word / 64] |= (uint64_t)1 << (word % 64);
+
+    size_t lastLine = (word + HEADER_SIZE(*block)) / LINE_WORDS;
+    for (size_t line = word / LINE_WORDS; line <= lastLine; ++line)
+    {
+        info->lineMarks[line] = 1;
+    }
+}
+
+// Move an object into the old generation, and leave a forwarding pointer.
+// Returns NULL if there's no room
+void* regionEvacuate(uint64_t* block, size_t blockLimit)
+{
+    size_t sizeInWords = HEADER_SIZE(*block) + 1;
+    uint64_t* p = regionAllocate(sizeInWords, blockLimit);
+    if (!p)
+        return NULL;
+
+    // Copies are never in the remembered set
+    *p = *block & ~(uint64_t)HEADER_REMEMBERED;
+    copyObject(p + 1, block + 1, sizeInWords - 1);
+
+    void* newLocation = p + 1;
+    *block = (uint64_t)newLocation;
+
+    gcStatistics.bytesCopied += sizeInWords * sizeof(uint64_t);
+
+    if (allocationProfiling)
+    {
+        recordSurvivor(*p);
+    }
+
+    // Objects moved during a major collection are live, so their lines must
+    // survive the sweep
+    if (majorCollection)
+    {
+        regionMark(p);
+    }
+
+    pushCopy((SplObject*)newLocation);
+
+    return newLocation;
+}
+
+// Mark-region version of gcCopy: nursery objects are promoted, and during a
+// major collection, old objects are marked or evacuated
+void* regionCopy(void* object)
+{
+    uint64_t* block = (uint64_t*)object - 1;
+
+    int inNursery = IN_SPACE(block, heapStart, heapEnd);
+    if (!inNursery)
+    {
+        if (!majorCollection)
+            return object;
+
+        if (!IN_SPACE(block, oldStart, oldPointer))
+        {
+            if (object && (*block & HEADER_LARGE))
+            {
+                markLarge(object);
+            }
+
+            return object;
+        }
+    }
+
+    uint64_t header = *block;
+    if (!(header & HEADER_TAG))
+    {
+        return (void*)header;
+    }
+
+    if (inNursery)
+    {
+        // Promotion may go beyond the capacity, up to the end of the reserved
+        // space
+        void* newLocation = regionEvacuate(block, regionReservedBlocks);
+        if (!newLocation)
+        {
+            outOfMemory();
+        }
+
+        return newLocation;
+    }
+
+    size_t offset = block - oldStart;
+    RegionBlock* info = &regionBlocks[offset / BLOCK_WORDS];
+    size_t word = offset % BLOCK_WORDS;
+    if (info->markBits[word / 64] & ((uint64_t)1 << (word % 64)))
+    {
+        return object;
+    }
 
-            SplObject* object = (SplObject*)*p;
-            // printf("\tobject=%p\n", object);
-            void* newLocation = gcCopy(object);
-            *p = (uint64_t)newLocation;
+    if (info->evacuate)
+    {
+        size_t capacity = regionCapacityBlocks();
+        void* newLocation = regionEvacuate(block, capacity + capacity / EVACUATION_HEADROOM + 1);
+        if (newLocation)
+        {
+            return newLocation;
         }
+    }
 
-        if (rbp == stackBottom)
-            break;
+    // The remembered set is emptied by a major collection
+    *block &= ~(uint64_t)HEADER_REMEMBERED;
+    regionMark(block);
 
-        // mov rsp, rbp
-        // pop rbp
-        // ret
-        rsp = rbp;
-        rbp = (uint64_t*)*rsp++;
-        callSite = (void*)*rsp++;
+    if (allocationProfiling)
+    {
+        recordSurvivor(*block);
     }
 
-    // printf("\n");
-    // printf("Finished with stack roots\n");
+    pushCopy((SplObject*)object);
 
-    while (additionalRoots)
+    return object;
+}
+
+// Clear the marks, and choose the blocks to evacuate
+void regionStartMarking()
+{
+    for (size_t i = 0; i < regionBlockCount; ++i)
     {
-        uint64_t numGlobals = *additionalRoots;
-        uint64_t** p = (uint64_t**)(additionalRoots + 1);
-        for (size_t i = 0; i < numGlobals; ++i)
+        RegionBlock* info = &regionBlocks[i];
+        if (!info->inUse)
+            continue;
+
+        memset(info->lineMarks, 0, sizeof(info->lineMarks));
+        memset(info->markBits, 0, sizeof(info->markBits));
+
+        // Blocks taken since the last sweep have no live lines recorded
+        info->evacuate =
+            info->liveLines > 0 &&
+            info->liveLines < LINES_PER_BLOCK / EVACUATE_FRACTION &&
+            i != holeBlock &&
+            i != overflowBlock;
+    }
+
+    regionCollecting = 1;
+}
+
+// Rebuild the lists of free and recyclable blocks from the line marks
+void regionSweep()
+{
+    recyclableCount = 0;
+    nextRecyclable = 0;
+    recyclableFreeWords = 0;
+    freeBlockCount = 0;
+    regionLiveLines = 0;
+
+    // In reverse, so that the lowest free block ends up on top of the stack
+    for (size_t i = regionBlockCount; i-- > 0;)
+    {
+        RegionBlock* info = &regionBlocks[i];
+        info->evacuate = 0;
+
+        if (info->inUse)
         {
-            SplObject* object = (SplObject*)**p;
-            void* newLocation = gcCopy(object);
-            **p = (uint64_t)newLocation;
+            size_t liveLines = 0;
+            for (size_t line = 0; line < LINES_PER_BLOCK; ++line)
+            {
+                liveLines += info->lineMarks[line];
+            }
 
-            ++p;
+            info->liveLines = liveLines;
+            regionLiveLines += liveLines;
+
+            if (liveLines == 0)
+            {
+                info->inUse = 0;
+                --regionUsedBlocks;
+            }
+            else if (liveLines < LINES_PER_BLOCK)
+            {
+                recyclableBlocks[recyclableCount++] = i;
+                recyclableFreeWords += (LINES_PER_BLOCK - liveLines) * LINE_WORDS;
+            }
         }
 
-        additionalRoots = *p;
+        if (!info->inUse)
+        {
+            freeBlocks[freeBlockCount++] = i;
+        }
     }
 
-    // printf("Finished with additional roots\n");
+    for (size_t i = 0, j = recyclableCount; i + 1 < j; ++i, --j)
+    {
+        uint32_t tmp = recyclableBlocks[i];
+        recyclableBlocks[i] = recyclableBlocks[j - 1];
+        recyclableBlocks[j - 1] = tmp;
+    }
+
+    // The rest of the current hole and overflow block are now ordinary free
+    // lines
+    holeCursor = holeLimit = NULL;
+    holeBlock = NO_BLOCK;
+    overflowCursor = overflowLimit = NULL;
+    overflowBlock = NO_BLOCK;
+
+    regionCollecting = 0;
 }
 
-void gcCollect(uint64_t* stackTop, uint64_t* stackBottom, uint64_t* additionalRoots)
+// When the heap shrinks, give the memory behind free blocks back to the OS,
+// except for those which could be used without going over the new capacity
+void regionReleaseFreeBlocks()
+{
+    size_t capacity = regionCapacityBlocks();
+    size_t keep = capacity > regionUsedBlocks ? capacity - regionUsedBlocks : 0;
+
+    // The stack has the lowest blocks on top, so release from the bottom
+    for (size_t i = 0; i + keep < freeBlockCount; ++i)
+    {
+        RegionBlock* info = &regionBlocks[freeBlocks[i]];
+        if (info->resident)
+        {
+            madvise(blockAddress(freeBlocks[i]), REGION_BLOCK_SIZE, MADV_DONTNEED);
+            info->resident = 0;
+            --regionResidentBlocks;
+        }
+    }
+}
+
+// Mark everything live in place (evacuating some objects), then sweep
+void regionCollectMajor(uint64_t* stackTop, uint64_t* stackBottom, uint64_t* additionalRoots)
 {
+    majorCollection = 1;
+    regionStartMarking();
+
+    gcVisitRoots(stackTop, stackBottom, additionalRoots, copyRoot);
+    gcScan();
+
+    ++gcStatistics.majorCollections;
+    gcStatistics.bytesAllocated += (heapPointer - heapStart) * sizeof(uint64_t);
+
+    heapPointer = heapStart;
+
+    rememberedCount = 0;
+    majorCollection = 0;
+
+    regionSweep();
+    if (chooseOldCapacity(regionLiveLines * REGION_LINE_SIZE))
+    {
+        regionReleaseFreeBlocks();
+    }
+
+    sweepLargeObjects();
+}
+
+// Copy the live nursery objects into the old generation. The caller must
+// ensure that the old generation has room for the entire nursery
+void gcCollectMinor(uint64_t* stackTop, uint64_t* stackBottom, uint64_t* additionalRoots)
+{
+    majorCollection = 0;
+    allocPtr = oldPointer;
+    allocEnd = oldEnd;
+    scanPtr = oldPointer;
+
+    if (heapSettings.threads > 1)
+    {
+        gcParallelTrace(stackTop, stackBottom, additionalRoots);
+    }
+    else
+    {
+        gcVisitRoots(stackTop, stackBottom, additionalRoots, copyRoot);
+
+        // Old objects which have been written to since the last collection are
+        // roots as well
+        for (size_t i = 0; i < rememberedCount; ++i)
+        {
+            SplObject* object = rememberedSet[i];
+            *((uint64_t*)object - 1) &= ~(uint64_t)HEADER_REMEMBERED;
+            gcScanObject(object);
+        }
+
+        gcScan();
+    }
+
+    rememberedCount = 0;
+
+    ++gcStatistics.minorCollections;
+    gcStatistics.bytesAllocated += (heapPointer - heapStart) * sizeof(uint64_t);
+
+    // The mark-region allocator keeps its own statistics and position
+    if (!heapSettings.markRegion)
+    {
+        gcStatistics.bytesCopied += (allocPtr - oldPointer) * sizeof(uint64_t);
+        oldPointer = allocPtr;
+    }
+
+    heapPointer = heapStart;
+}
+
+// Copy all live objects (from both generations) into the other space, which
+// becomes the new old generation
+void gcCollectMajor(uint64_t* stackTop, uint64_t* stackBottom, uint64_t* additionalRoots)
+{
+    if (heapSettings.markRegion)
+    {
+        regionCollectMajor(stackTop, stackBottom, additionalRoots);
+        return;
+    }
+
+    // The other space always has room for the entire old generation plus a
+    // full nursery, so everything fits even if nothing is garbage
+    majorCollection = 1;
     allocPtr = otherStart;
+    allocEnd = otherEnd;
     scanPtr = otherStart;
 
-    gcCopyRoots(stackTop, stackBottom, additionalRoots);
-    gcScan();
+    if (heapSettings.threads > 1)
+    {
+        gcParallelTrace(stackTop, stackBottom, additionalRoots);
+    }
+    else
+    {
+        gcVisitRoots(stackTop, stackBottom, additionalRoots, copyRoot);
+        gcScan();
+    }
 
     //printf("Finished scanning\n");
 
-    // Swap the heaps
-    uint64_t* tmpStart = heapStart;
-    uint64_t* tmpEnd = heapEnd;
+    ++gcStatistics.majorCollections;
+    gcStatistics.bytesAllocated += (heapPointer - heapStart) * sizeof(uint64_t);
+    gcStatistics.bytesCopied += (allocPtr - otherStart) * sizeof(uint64_t);
 
-    heapStart = otherStart;
-    heapPointer = allocPtr;
-    heapEnd = otherEnd;
+    // Swap the spaces
+    uint64_t* tmpStart = oldStart;
+    uint64_t* tmpEnd = oldMapEnd;
+
+    oldStart = otherStart;
+    oldPointer = allocPtr;
+    oldMapEnd = otherEnd;
 
     otherStart = tmpStart;
     otherEnd = tmpEnd;
+
+    heapPointer = heapStart;
+
+    // Every surviving old object was copied, and the copies are unmarked
+    rememberedCount = 0;
+    majorCollection = 0;
+
+    resizeHeap();
+    sweepLargeObjects();
+}
+
+void gcCollect(uint64_t* stackTop, uint64_t* stackBottom, uint64_t* additionalRoots)
+{
+    // A minor collection is possible only if the old generation could absorb
+    // every object in the nursery
+    size_t nurseryUsed = heapPointer - heapStart;
+    size_t oldFree = heapSettings.markRegion ? regionFreeWords() : (size_t)(oldEnd - oldPointer);
+
+    if (oldFree >= nurseryUsed + copyReserve(nurseryUsed))
+    {
+        gcCollectMinor(stackTop, stackBottom, additionalRoots);
+    }
+    else
+    {
+        gcCollectMajor(stackTop, stackBottom, additionalRoots);
+    }
 }
 
 extern void* gcCollectAndAllocate(size_t, uint64_t*, uint64_t*, uint64_t*) asm("gcCollectAndAllocate");
 
 void* gcCollectAndAllocate(size_t sizeInBytes, uint64_t* stackTop, uint64_t* stackBottom, uint64_t* additionalRoots)
 {
-    assert(otherEnd - otherStart >= heapEnd - heapStart);
-
-    // This is minimum free size we need to satisfy this allocation
+    // Size of the block, including the header
     size_t bytesNeeded = roundUp(sizeInBytes, 8) + 8;
 
-    gcCollect(stackTop, stackBottom, additionalRoots);
+    void* result;
+    if (sizeInBytes >= LARGE_OBJECT_SIZE)
+    {
+        // Large objects get their own mapping. Collect first if the large
+        // object space has grown too much since the last major collection
+        size_t mappedSize = largeObjectMappedSize(sizeInBytes);
+        if (largeObjectBytes + mappedSize > largeObjectLimit ||
+            (heapSettings.maxSize && totalHeapSize() + mappedSize > heapSettings.maxSize))
+        {
+            uint64_t startTime = monotonicNanoseconds();
+
+            gcCollectMajor(stackTop, stackBottom, additionalRoots);
+
+            recordPause(startTime);
 
-    //printf("Finished collection\n");
+            if (heapSettings.maxSize && totalHeapSize() + mappedSize > heapSettings.maxSize)
+            {
+                outOfMemory();
+            }
+        }
 
-    // If there's not much free space even after collection, increase the size
-    // of the heap
-    size_t totalSize = heapEnd - heapStart;
-    size_t usedSize = heapPointer - heapStart;
-    size_t freeSize = totalSize - usedSize;
-    if (freeSize < 0.20 * totalSize || freeSize < bytesNeeded / 8)
+        result = allocateLarge(sizeInBytes);
+    }
+    else if (bytesNeeded > (heapEnd - heapStart) * sizeof(uint64_t) / 4)
     {
-        // Always allocate enough so that the new heap will be at most half full
-        size_t minimumSize = (usedSize * 8 + bytesNeeded) * 2;
-        expandHeap(minimumSize);
+        // Large objects bypass the nursery
+        result = tryAllocateOld(sizeInBytes);
+        if (result) return result;
+
+        uint64_t startTime = monotonicNanoseconds();
+
+        gcCollectMajor(stackTop, stackBottom, additionalRoots);
+        result = tryAllocateOld(sizeInBytes);
+
+        if (!result)
+        {
+            // In the unhappy case where the old generation doesn't have enough
+            // space for this allocation, we have to copy again into the
+            // newly-enlarged other space. A mark-region heap can simply grow
+            reserveOldSpace(bytesNeeded);
+            if (!heapSettings.markRegion)
+                gcCollectMajor(stackTop, stackBottom, additionalRoots);
+
+            result = tryAllocateOld(sizeInBytes);
+        }
+
+        recordPause(startTime);
+
+        if (!result)
+        {
+            outOfMemory();
+        }
     }
     else
     {
-        equalizeHeaps();
+        uint64_t startTime = monotonicNanoseconds();
+
+        gcCollect(stackTop, stackBottom, additionalRoots);
+
+        recordPause(startTime);
+
+        //printf("Finished collection\n");
+
+        // The nursery is now empty, so this can't fail
+        result = try_mymalloc(sizeInBytes);
     }
 
-    //printf("Finished equalizing heaps\n");
+    assert(result);
+    return result;
+}
+
+
+//// GC statistics /////////////////////////////////////////////////////////////
+
+uint64_t monotonicNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-    void* result = try_mymalloc(sizeInBytes);
+void recordPause(uint64_t startTime)
+{
+    uint64_t pause = monotonicNanoseconds() - startTime;
 
-    //printf("result: %p\n", result);
-    if (!result)
+    gcStatistics.totalPause += pause;
+    if (pause > gcStatistics.maxPause)
     {
-        // In the unhappy case where the current heap doesn't have enough space
-        // for the current allocation, we have to copy again into the
-        // newly-enlarged other heap
-        gcCollect(stackTop, stackBottom, additionalRoots);
-        result = try_mymalloc(sizeInBytes);
+        gcStatistics.maxPause = pause;
+    }
+
+    size_t bucket = 0;
+    uint64_t microseconds = pause / 1000;
+    while (microseconds >= (1ULL << bucket) && bucket < PAUSE_BUCKETS - 1)
+    {
+        ++bucket;
+    }
+
+    ++gcStatistics.pauseHistogram[bucket];
+}
+
+uint64_t totalBytesAllocated()
+{
+    return gcStatistics.bytesAllocated + (heapPointer - heapStart) * sizeof(uint64_t);
+}
+
+uint64_t totalHeapSize()
+{
+    if (heapSettings.markRegion)
+    {
+        return (heapEnd - heapStart) * sizeof(uint64_t) + regionResidentBlocks * REGION_BLOCK_SIZE +
+            largeObjectBytes;
+    }
+
+    return ((heapEnd - heapStart) + (oldMapEnd - oldStart) + (otherEnd - otherStart)) * sizeof(uint64_t) +
+        largeObjectBytes;
+}
+
+void printStatistics(FILE* out)
+{
+    fprintf(out, "GC statistics:\n");
+    fprintf(out, "  collections:     %" PRIu64 " (%" PRIu64 " minor, %" PRIu64 " major)\n",
+        gcStatistics.minorCollections + gcStatistics.majorCollections,
+        gcStatistics.minorCollections,
+        gcStatistics.majorCollections);
+    fprintf(out, "  bytes allocated: %" PRIu64 "\n", totalBytesAllocated());
+    fprintf(out, "  bytes copied:    %" PRIu64 "\n", gcStatistics.bytesCopied);
+    fprintf(out, "  heap growths:    %" PRIu64 "\n", gcStatistics.heapGrowths);
+    fprintf(out, "  heap shrinks:    %" PRIu64 "\n", gcStatistics.heapShrinks);
+    fprintf(out, "  heap size:       %" PRIu64 " bytes (%zu in large objects)\n", totalHeapSize(), largeObjectBytes);
+    fprintf(out, "  total pause:     %.3f ms (max %.3f ms)\n",
+        gcStatistics.totalPause / 1e6,
+        gcStatistics.maxPause / 1e6);
+
+    fprintf(out, "  pause histogram:\n");
+    for (size_t i = 0; i < PAUSE_BUCKETS; ++i)
+    {
+        if (gcStatistics.pauseHistogram[i] == 0)
+            continue;
+
+        if (i < PAUSE_BUCKETS - 1)
+        {
+            fprintf(out, "    < %" PRIu64 " us: %" PRIu64 "\n", (uint64_t)1 << i, gcStatistics.pauseHistogram[i]);
+        }
+        else
+        {
+            fprintf(out, "    >= %" PRIu64 " us: %" PRIu64 "\n", (uint64_t)1 << (i - 1), gcStatistics.pauseHistogram[i]);
+        }
+    }
+}
+
+void writeStatisticsJson(FILE* out)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"minorCollections\": %" PRIu64 ",\n", gcStatistics.minorCollections);
+    fprintf(out, "  \"majorCollections\": %" PRIu64 ",\n", gcStatistics.majorCollections);
+    fprintf(out, "  \"bytesAllocated\": %" PRIu64 ",\n", totalBytesAllocated());
+    fprintf(out, "  \"bytesCopied\": %" PRIu64 ",\n", gcStatistics.bytesCopied);
+    fprintf(out, "  \"heapGrowths\": %" PRIu64 ",\n", gcStatistics.heapGrowths);
+    fprintf(out, "  \"heapShrinks\": %" PRIu64 ",\n", gcStatistics.heapShrinks);
+    fprintf(out, "  \"heapSize\": %" PRIu64 ",\n", totalHeapSize());
+    fprintf(out, "  \"largeObjectSize\": %zu,\n", largeObjectBytes);
+    fprintf(out, "  \"totalPauseNs\": %" PRIu64 ",\n", gcStatistics.totalPause);
+    fprintf(out, "  \"maxPauseNs\": %" PRIu64 ",\n", gcStatistics.maxPause);
+
+    // Bucket i counts pauses shorter than 2^i microseconds
+    fprintf(out, "  \"pauseHistogram\": [");
+    for (size_t i = 0; i < PAUSE_BUCKETS; ++i)
+    {
+        fprintf(out, "%s%" PRIu64, i ? ", " : "", gcStatistics.pauseHistogram[i]);
+    }
+    fprintf(out, "]\n");
+    fprintf(out, "}\n");
+}
+
+const char* statisticsOutput;
+
+void reportStatistics()
+{
+    if (strcmp(statisticsOutput, "1") == 0 || strcmp(statisticsOutput, "stderr") == 0)
+    {
+        printStatistics(stderr);
+    }
+    else
+    {
+        FILE* out = fopen(statisticsOutput, "w");
+        if (!out)
+        {
+            fprintf(stderr, "*** Warning: cannot write GC statistics to %s\n", statisticsOutput);
+            return;
+        }
 
-        // The heap-expansion above should have guaranteed that we have enough
-        // space to make this allocation
-        assert(result);
+        writeStatisticsJson(out);
+        fclose(out);
+    }
+}
 
-        equalizeHeaps();
+// ENC_GC_STATS=1 (or stderr) prints a summary to stderr at exit, and any other
+// value is the name of a file to receive the statistics as JSON
+void initializeStatistics()
+{
+    statisticsOutput = getenv("ENC_GC_STATS");
+    if (statisticsOutput && *statisticsOutput && strcmp(statisticsOutput, "0") != 0)
+    {
+        atexit(reportStatistics);
     }
+}
+
+// Backs gcStats() in lib/GC.enc
+Array* gcStatsArray()
+{
+    size_t count = 10;
+
+    // Allocate first, because this may itself trigger a collection
+    Array* result = gcAllocate(sizeof(Array) + count * sizeof(uint64_t));
+    result->numElements = count;
+
+    uint64_t* p = (uint64_t*)(result + 1);
+    p[0] = gcStatistics.minorCollections + gcStatistics.majorCollections;
+    p[1] = gcStatistics.minorCollections;
+    p[2] = gcStatistics.majorCollections;
+    p[3] = totalBytesAllocated();
+    p[4] = gcStatistics.bytesCopied;
+    p[5] = gcStatistics.heapGrowths;
+    p[6] = gcStatistics.heapShrinks;
+    p[7] = totalHeapSize();
+    p[8] = gcStatistics.totalPause;
+    p[9] = gcStatistics.maxPause;
 
     return result;
 }
+
+
+//// Allocation profiling //////////////////////////////////////////////////////
+
+// Programs compiled with --profile-alloc store the index of the current
+// allocation site in allocationSite before each allocation (see
+// TACCodeGen::setAllocationSite). The site is recorded in the header of the
+// new object, so that the collector can attribute survivors to it. Site 0
+// covers allocations made by the runtime library itself
+//
+// The profile is printed to stderr at exit, or written to the file named by
+// the ENC_ALLOC_PROFILE environment variable
+
+uint64_t allocationSite;
+
+// Emitted by the compiler: the number of sites, then a description of each
+extern uint64_t __allocationSites;
+
+typedef struct AllocationSiteStats
+{
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t survivingBytes;    // Summed over all collections
+} AllocationSiteStats;
+
+AllocationSiteStats* allocationSiteStats;
+size_t allocationSiteCount;
+
+const char* allocationSiteName(size_t site)
+{
+    if (site == 0)
+        return "(runtime)";
+
+    return ((const char**)(&__allocationSites + 1))[site - 1];
+}
+
+// Called with the block of each new object
+void profileAllocation(uint64_t* block)
+{
+    uint64_t site = allocationSite;
+    allocationSite = 0;
+
+    if (site >= allocationSiteCount)
+        site = 0;
+
+    *block |= site << HEADER_SITE_SHIFT;
+
+    ++allocationSiteStats[site].count;
+    allocationSiteStats[site].bytes += (HEADER_SIZE(*block) + 1) * sizeof(uint64_t);
+}
+
+// Called with the header of each object which survives a collection. May be
+// called by several collector threads at once
+void recordSurvivor(uint64_t header)
+{
+    uint64_t site = HEADER_SITE(header);
+    uint64_t bytes = (HEADER_SIZE(header) + 1) * sizeof(uint64_t);
+
+    __atomic_fetch_add(&allocationSiteStats[site].survivingBytes, bytes, __ATOMIC_RELAXED);
+}
+
+int compareAllocationSites(const void* lhs, const void* rhs)
+{
+    const AllocationSiteStats* a = &allocationSiteStats[*(const size_t*)lhs];
+    const AllocationSiteStats* b = &allocationSiteStats[*(const size_t*)rhs];
+
+    if (a->bytes != b->bytes)
+        return a->bytes < b->bytes ? 1 : -1;
+
+    return a->count < b->count ? 1 : (a->count > b->count ? -1 : 0);
+}
+
+// Sites which allocated anything, ordered by the number of bytes allocated
+void printAllocationProfile(FILE* out)
+{
+    size_t* order = malloc(allocationSiteCount * sizeof(size_t));
+    size_t count = 0;
+    for (size_t site = 0; site < allocationSiteCount; ++site)
+    {
+        if (allocationSiteStats[site].count)
+            order[count++] = site;
+    }
+
+    qsort(order, count, sizeof(size_t), compareAllocationSites);
+
+    fprintf(out, "Allocation profile:\n");
+    fprintf(out, "%14s %16s %16s  %s\n", "objects", "bytes", "survived", "site");
+    for (size_t i = 0; i < count; ++i)
+    {
+        AllocationSiteStats* stats = &allocationSiteStats[order[i]];
+        fprintf(out, "%14" PRIu64 " %16" PRIu64 " %16" PRIu64 "  %s\n",
+            stats->count,
+            stats->bytes,
+            stats->survivingBytes,
+            allocationSiteName(order[i]));
+    }
+
+    free(order);
+}
+
+void reportAllocationProfile()
+{
+    const char* path = getenv("ENC_ALLOC_PROFILE");
+    if (!path || !*path)
+    {
+        printAllocationProfile(stderr);
+        return;
+    }
+
+    FILE* out = fopen(path, "w");
+    if (!out)
+    {
+        fprintf(stderr, "*** Warning: cannot write allocation profile to %s\n", path);
+        return;
+    }
+
+    printAllocationProfile(out);
+    fclose(out);
+}
+
+void initializeAllocationProfile()
+{
+    if (__allocationSites == 0)
+        return;
+
+    allocationSiteCount = __allocationSites + 1;
+    allocationSiteStats = calloc(allocationSiteCount, sizeof(AllocationSiteStats));
+    if (!allocationSiteStats)
+    {
+        fail("*** Exception: Cannot allocate the allocation profile");
+    }
+
+    allocationProfiling = 1;
+    atexit(reportAllocationProfile);
+}
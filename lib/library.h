@@ -4,34 +4,120 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-#define MAX_STRUCTURED_TAG      ((1L << 32) - 1)
-#define UNBOXED_ARRAY_TAG       (MAX_STRUCTURED_TAG + 1)
-#define BOXED_ARRAY_TAG         (MAX_STRUCTURED_TAG + 2)
+// Every heap object is preceded by a one-word header, which is all of the
+// overhead of an object:
+//
+//   bits 0-2      flags (below). Bit 0 is always set, to distinguish a header
+//                 from a forwarding pointer
+//   bits 3-5      kind of object
+//   bits 6-40     size of the object in words, not counting the header
+//   bits 41-63    allocation site, with --profile-alloc
+//
+// A structure has at most 64 members, so only bits 6-12 give its size, and the
+// rest describe its layout instead:
+//
+//   bits 13-20    constructor tag
+//   bits 21-40    bitmap of the members which are references, or for
+//                 HEADER_DESCRIBED_STRUCT, an index into __typeDescriptors
+//
+// The runtime allocates blocks as unboxed arrays (a kind of 0), and the
+// compiler adds in the layout of the object afterwards
+#define HEADER_TAG              1
+#define HEADER_REMEMBERED       2   // Old object already in the remembered set
+#define HEADER_LARGE            4   // Lives in the large-object space
 
-#define SplObject_HEAD \
-    uint64_t constructorTag; \
-    uint64_t refMask;
+#define HEADER_KIND_MASK        (7 << 3)
+#define HEADER_UNBOXED_ARRAY    (0 << 3)    // No references (also strings and filler)
+#define HEADER_STRUCT           (1 << 3)    // Set for both kinds of structure
+#define HEADER_BOXED_ARRAY      (2 << 3)    // Every element is a reference
+#define HEADER_DESCRIBED_STRUCT (3 << 3)    // Reference bitmap in __typeDescriptors
+#define HEADER_FLAT_ARRAY       (4 << 3)    // Elements with references, see FlatArray
 
-typedef struct SplObject
-{
-    SplObject_HEAD
-} SplObject;
+#define HEADER_SIZE_SHIFT       6
+#define HEADER_SITE_SHIFT       41
 
-typedef struct List
-{
-    SplObject_HEAD
-    struct List* next;
-    uint8_t value;
-} List;
+#define HEADER_STRUCT_SIZE_MASK     127
+#define HEADER_CONSTRUCTOR_SHIFT    13
+#define HEADER_CONSTRUCTOR_MASK     255
+#define HEADER_LAYOUT_SHIFT         21
+#define HEADER_LAYOUT_MASK          ((1UL << (HEADER_SITE_SHIFT - HEADER_LAYOUT_SHIFT)) - 1)
+
+#define MAKE_HEADER(sizeInWords)    (((uint64_t)(sizeInWords) << HEADER_SIZE_SHIFT) | HEADER_TAG)
+#define MAKE_STRUCT_LAYOUT(kind, constructorTag, layout) \
+    ((kind) | ((uint64_t)(constructorTag) << HEADER_CONSTRUCTOR_SHIFT) | ((uint64_t)(layout) << HEADER_LAYOUT_SHIFT))
+
+#define HEADER_KIND(header)         ((header) & HEADER_KIND_MASK)
+#define HEADER_SIZE(header) \
+    ((((header) & ((1UL << HEADER_SITE_SHIFT) - 1)) >> HEADER_SIZE_SHIFT) & \
+     (((header) & HEADER_STRUCT) ? HEADER_STRUCT_SIZE_MASK : ~0UL))
+#define HEADER_LAYOUT(header)       (((header) >> HEADER_LAYOUT_SHIFT) & HEADER_LAYOUT_MASK)
+#define HEADER_SITE(header)         ((header) >> HEADER_SITE_SHIFT)
+
+// Objects at least this large (in bytes) are allocated in the large-object
+// space, where they are never moved
+#define LARGE_OBJECT_SIZE           (128 << 10)
+
+// Objects are 8-byte aligned, so the low bits of a pointer to one are free. A
+// value of an enum with few constructors keeps the constructor tag there (and
+// constructors without members are just the tag, with no object), so the
+// collector must strip these bits before following a reference
+#define POINTER_TAG_BITS            3
+#define POINTER_TAG_MASK            ((1 << POINTER_TAG_BITS) - 1)
+
+// A structure is just its members, packed by size with the references first
+// (the header says which are references)
+typedef struct SplObject SplObject;
 
 typedef struct Array
 {
-    uint64_t constructorTag;    // Either BOXED_ARRAY_TAG or UNBOXED_ARRAY_TAG
-    uint64_t numElements;       // Number of elements in the array (instead of refMask)
+    uint64_t numElements;       // Number of elements in the array, which follow
 } Array;
 
+// An array of a small value struct holds the members of each element inline,
+// laid out as in a structure and padded to a whole number of words, instead of
+// pointers to separate objects. The references of an element come first, so
+// the layout only has to give how many there are. Without any references, the
+// array is a HEADER_UNBOXED_ARRAY, and otherwise a HEADER_FLAT_ARRAY
+typedef struct FlatArray
+{
+    uint64_t numElements;
+    uint64_t elementLayout;     // MAKE_ELEMENT_LAYOUT
+} FlatArray;
+
+#define MAKE_ELEMENT_LAYOUT(sizeInWords, refs)  ((uint64_t)(sizeInWords) | ((uint64_t)(refs) << 32))
+#define ELEMENT_SIZE(layout)                    ((layout) & 0xffffffff)
+#define ELEMENT_REFS(layout)                    ((layout) >> 32)
+
 typedef Array String;
 
+// A string of at most SHORT_STRING_MAX bytes may be packed into the reference
+// itself instead of pointing to an array. Bit 63 is never set in a user-space
+// pointer, so it marks a short string, bits 56-58 hold the length, and the
+// bytes are stored from the low end (the first in bits 0-7). Unused bytes are
+// zero. Storing into a short string couldn't be seen through other references
+// to it, so programs which store into strings don't pack any (see
+// checkStringStores in the compiler)
+#define SHORT_STRING_MAX            7
+#define SHORT_STRING_TAG_BIT        63
+#define SHORT_STRING_LENGTH_SHIFT   56
+#define SHORT_STRING_LENGTH_MASK    7
+#define SHORT_STRING_BYTES_MASK     ((1UL << SHORT_STRING_LENGTH_SHIFT) - 1)
+
+#define IS_SHORT_STRING(s)          (((uintptr_t)(s) >> SHORT_STRING_TAG_BIT) != 0)
+#define SHORT_STRING_LENGTH(s)      (((uintptr_t)(s) >> SHORT_STRING_LENGTH_SHIFT) & SHORT_STRING_LENGTH_MASK)
+#define MAKE_SHORT_STRING(bytes, n) \
+    ((String*)((1UL << SHORT_STRING_TAG_BIT) | ((uint64_t)(n) << SHORT_STRING_LENGTH_SHIFT) | (bytes)))
+
+// A short string laid out like an array, so that C code can read either kind
+// through the same pointer (see unpackStr). The length is written through an
+// Array, which is how it's read back, so the compiler can't assume that the
+// two don't alias
+typedef struct ShortString
+{
+    Array array;
+    uint64_t bytes;
+} ShortString;
+
 extern void* enccall0(void* f) asm("enccall0");
 extern void* enccall1(void* f, void* p1) asm("enccall1");
 extern void* enccall2(void* f, void* p1, void* p2) asm("enccall2");
@@ -1,14 +1,18 @@
 #!/usr/bin/env python
 import re
+import os
 import sys
+import json
 import time
 import subprocess
 
 
 class TestCase(object):
-    def __init__(self, name, input_file=None):
+    def __init__(self, name, input_file=None, command=None, gc_stats=False):
         self.name = name
         self.input_file = input_file
+        self.command = command
+        self.gc_stats = gc_stats
 
 
     def build(self):
@@ -23,15 +27,25 @@ class TestCase(object):
         else:
             run_cmd = 'build/{}'.format(self.name)
 
-        run_proc = subprocess.Popen(run_cmd, shell=True, stderr=subprocess.PIPE, stdout=subprocess.PIPE)
+        if self.command:
+            run_cmd += ' ' + self.command
+
+        env = None
+        if self.gc_stats:
+            env = dict(os.environ, ENC_GC_STATS=self.stats_file())
+
+        run_proc = subprocess.Popen(run_cmd, shell=True, stderr=subprocess.PIPE, stdout=subprocess.PIPE, env=env)
 
         assert run_proc.wait() == 0
 
+    def stats_file(self):
+        return 'build/{}.gcstats.json'.format(self.name)
+
 
 tests = []
 
-def add(name, input_file=None):
-    test = TestCase(name, input_file)
+def add(name, input_file=None, command=None, gc_stats=False):
+    test = TestCase(name, input_file, command, gc_stats)
     test.build()
     tests.append(test)
 
@@ -51,13 +65,49 @@ add('profile_euler3')
 add('profile_euler4')
 add('profile_euler5')
 
+# GC root scanning vs. stack depth: reports the collection pauses as well
+for depth in [10, 1000, 10000, 100000]:
+    add('profile_deepStack', command=str(depth), gc_stats=True)
+
+# Long-lived large array (large-object space)
+add('profile_largeArray')
+
+# Serial vs. parallel collection, with 10MB to 1GB of live data
+for megabytes in [10, 100, 1000]:
+    add('profile_parallelGC', command='--gc-threads=1 {}'.format(megabytes))
+    add('profile_parallelGC', command='--gc-threads=4 {}'.format(megabytes))
+
+# Breadth-first (Cheney) vs. depth-first copy order
+add('profile_locality', command='--gc-copy-order=breadth')
+add('profile_locality', command='--gc-copy-order=depth')
+
+# Semispace copying vs. mark-region old generation
+for megabytes in [10, 100]:
+    add('profile_parallelGC', command='--gc-collector=copying {}'.format(megabytes))
+    add('profile_parallelGC', command='--gc-collector=mark-region {}'.format(megabytes))
+
 
 def get_time(test):
     time1 = time.time()
     test.run()
     time2 = time.time()
 
-    print '{}: {:0.3f}s'.format(test.name, time2 - time1)
+    name = test.name
+    if test.command:
+        name += ' ' + test.command
+
+    print '{}: {:0.3f}s'.format(name, time2 - time1)
+
+    if test.gc_stats:
+        with open(test.stats_file()) as f:
+            stats = json.load(f)
+
+        collections = stats['minorCollections'] + stats['majorCollections']
+        print '    {} collections, pause {:0.3f}ms total, {:0.3f}ms mean, {:0.3f}ms max'.format(
+            collections,
+            stats['totalPauseNs'] / 1e6,
+            stats['totalPauseNs'] / 1e6 / max(collections, 1),
+            stats['maxPauseNs'] / 1e6)
 
 
 start = time.time()
@@ -522,6 +522,8 @@ public:
 	Symbol* symbol = nullptr;
 	std::vector<Symbol*> parameterSymbols;
 	FunctionType* functionType;
+	bool returnsConstructed = true;  // every return statement returns a constructor call
+	bool isClosure = false;          // the function is used as a value
 };
 
 class MethodDefNode : public FunctionDefNode
@@ -746,8 +748,8 @@ public:
 class StructDefNode : public StatementNode
 {
 public:
-	StructDefNode(AstContext* context, const YYLTYPE& location, const std::string& name, std::vector<StructVarNode*>&& members, std::vector<TypeParam>&& typeParams, std::vector<TypeParam>&& whereClause)
-	: StatementNode(context, location), name(name), members(members), typeParams(typeParams), whereClause(whereClause)
+	StructDefNode(AstContext* context, const YYLTYPE& location, const std::string& name, std::vector<StructVarNode*>&& members, std::vector<TypeParam>&& typeParams, std::vector<TypeParam>&& whereClause, bool isValue)
+	: StatementNode(context, location), name(name), members(members), typeParams(typeParams), whereClause(whereClause), isValue(isValue)
 	{}
 
 	AST_VISITABLE();
@@ -756,6 +758,7 @@ public:
 	std::vector<StructVarNode*> members;
 	std::vector<TypeParam> typeParams;
 	std::vector<TypeParam> whereClause;
+	bool isValue;
 
 	// Annotations
 	Type* structType;
@@ -781,6 +784,7 @@ public:
 	ConstructorSymbol* constructorSymbol;
 	size_t memberIndex;
 	TypeAssignment typeAssignment;
+	bool isAssigned = false;
 };
 
 
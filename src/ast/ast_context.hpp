@@ -23,8 +23,14 @@ public:
     TypeTable* typeTable() { return &_typeTable; }
     SymbolTable* symbolTable() { return &_symbolTable; }
 
+    // Short strings are packed into the reference, so they can only be used if
+    // the program never stores into a string (see checkStringStores)
+    void setPackShortStrings(bool value) { _packShortStrings = value; }
+    bool packShortStrings() const { return _packShortStrings; }
+
 private:
     ProgramNode* _root = nullptr;
+    bool _packShortStrings = true;
     std::vector<std::unique_ptr<AstNode>> _nodes;
     TypeTable _typeTable;
     SymbolTable _symbolTable;
@@ -1,6 +1,8 @@
 #include "codegen/asm_printer.hpp"
 #include "lib/library.h"
 
+#include <map>
+
 #ifdef __APPLE__
     // On OSX, C functions are prefixed with an underscore
     #define EXTERN(s) (std::string("_") + (s))
@@ -36,26 +38,96 @@ void AsmPrinter::printProgram(MachineContext* context)
         const std::string& name = item.first;
         const std::string& content = item.second;
 
+        // Static strings have a header word like heap objects, so that the
+        // collector can safely inspect any object it finds
+        size_t sizeInWords = (sizeof(Array) + content.size() + 7) / 8;
+        _out << "\talign 8" << std::endl;
+        _out << "\tdq " << MAKE_HEADER(sizeInWords) << std::endl;
         _out << "$" << name << ":" << std::endl;
-        _out << "\tdq " << UNBOXED_ARRAY_TAG << ", " << content.size() << std::endl;
+        _out << "\tdq " << content.size() << std::endl;
         _out << "\tdb \"" << content << "\"" << std::endl;
     }
 
-    // Stack map (for the GC)
+    for (auto& item : context->staticObjects)
+    {
+        const std::string& name = item.first;
+        const std::vector<MachineOperand*>& contents = item.second;
+
+        // The first word is the header, which the label follows
+        _out << "\talign 8" << std::endl;
+        for (size_t i = 0; i < contents.size(); ++i)
+        {
+            _out << "\tdq ";
+            printSimpleOperand(contents[i], false, 64);
+            _out << std::endl;
+
+            if (i == 0)
+            {
+                _out << "$" << name << ":" << std::endl;
+            }
+        }
+    }
+
+    // Stack map (for the GC). Functions and call sites are listed in the order
+    // in which they appear in the text section, so both tables are sorted by
+    // address and can be binary-searched by the collector
+    //
+    // __stackMap: the number of functions, then (start address, index of the
+    // first call site) for each function containing a call, followed by a
+    // sentinel entry giving the total number of call sites
+    std::vector<std::pair<MachineFunction*, size_t>> functionIndex;
+    for (size_t i = 0; i < _stackMap.size(); ++i)
+    {
+        if (functionIndex.empty() || functionIndex.back().first != _stackMap[i].function)
+        {
+            functionIndex.emplace_back(_stackMap[i].function, i);
+        }
+    }
+
     _out << "global " << EXTERN("__stackMap") << std::endl;
     _out << EXTERN("__stackMap") << ":" << std::endl;
-    _out << "\tdq " << _stackMap.size() << std::endl;
+    _out << "\tdq " << functionIndex.size() << std::endl;
+    for (auto& item : functionIndex)
+    {
+        _out << "\tdq $" << item.first->name << ", " << item.second << std::endl;
+    }
+    _out << "\tdq 0, " << _stackMap.size() << std::endl;
+
+    // __stackMapCallSites: (return address relative to the start of the
+    // function, offset of the descriptor) for each call site, as 32-bit values
+    std::map<std::set<int64_t>, size_t> descriptors;
+    std::vector<const std::set<int64_t>*> descriptorOrder;
+    size_t descriptorSize = 0;
+
+    _out << "global " << EXTERN("__stackMapCallSites") << std::endl;
+    _out << EXTERN("__stackMapCallSites") << ":" << std::endl;
     for (size_t i = 0; i < _stackMap.size(); ++i)
     {
         MachineFunction* function = _stackMap[i].function;
         size_t counter = _stackMap[i].counter;
         std::set<int64_t>& variables = _stackMap[i].variables;
 
-        _out << "\t" << "dq "
-             << function->name << ".CS" << counter
-             << ", " << variables.size();
+        auto result = descriptors.emplace(variables, descriptorSize);
+        if (result.second)
+        {
+            descriptorOrder.push_back(&result.first->first);
+            descriptorSize += 1 + variables.size();
+        }
+
+        _out << "\tdd "
+             << "$" << function->name << ".CS" << counter << " - $" << function->name
+             << ", " << result.first->second << std::endl;
+    }
 
-        for (int64_t offset : variables)
+    // __stackMapDescriptors: each distinct set of live stack variables, given
+    // as a count followed by the rbp offsets. Most call sites share one
+    _out << "global " << EXTERN("__stackMapDescriptors") << std::endl;
+    _out << EXTERN("__stackMapDescriptors") << ":" << std::endl;
+    for (const std::set<int64_t>* variables : descriptorOrder)
+    {
+        _out << "\tdd " << variables->size();
+
+        for (int64_t offset : *variables)
         {
             _out << ", " << offset;
         }
@@ -63,6 +135,36 @@ void AsmPrinter::printProgram(MachineContext* context)
         _out << std::endl;
     }
 
+    // Allocation sites (with --profile-alloc): the number of sites, then the
+    // address of a description of each one
+    _out << "global " << EXTERN("__allocationSites") << std::endl;
+    _out << EXTERN("__allocationSites") << ":" << std::endl;
+    _out << "\tdq " << context->allocationSites.size() << std::endl;
+    for (size_t i = 0; i < context->allocationSites.size(); ++i)
+    {
+        _out << "\tdq __allocationSite" << i << std::endl;
+    }
+
+    for (size_t i = 0; i < context->allocationSites.size(); ++i)
+    {
+        _out << "__allocationSite" << i << ":" << std::endl;
+        _out << "\tdb \"" << context->allocationSites[i] << "\", 0" << std::endl;
+    }
+
+    // Whether the runtime may return short strings (see SHORT_STRING_MAX)
+    _out << "global " << EXTERN("__packShortStrings") << std::endl;
+    _out << EXTERN("__packShortStrings") << ":" << std::endl;
+    _out << "\tdq " << (context->packShortStrings ? 1 : 0) << std::endl;
+
+    // Reference bitmaps of structures which are too wide for the object
+    // header, indexed by the header (see lib/library.h)
+    _out << "global " << EXTERN("__typeDescriptors") << std::endl;
+    _out << EXTERN("__typeDescriptors") << ":" << std::endl;
+    for (uint64_t refMask : context->typeDescriptors)
+    {
+        _out << "\tdq " << refMask << std::endl;
+    }
+
     // Global variable table (for the GC)
     std::vector<std::string> globalReferences;
     for (auto& global : context->globals)
@@ -342,6 +444,14 @@ void AsmPrinter::printInstruction(MachineInst* inst)
             printBinary("sar", inst->outputs[0], inst->inputs[1]);
             break;
 
+        case Opcode::SHR:
+            assert(inst->outputs.size() == 1);
+            assert(inst->inputs.size() == 2);
+            assert(inst->outputs[0]->isRegister() && inst->inputs[0]->isRegister());
+            assert(getAssignment(inst->outputs[0]) == getAssignment(inst->inputs[0]));
+            printBinary("shr", inst->outputs[0], inst->inputs[1]);
+            break;
+
         case Opcode::SUB:
             assert(inst->outputs.size() == 1);
             assert(inst->inputs.size() == 2);
@@ -551,7 +661,7 @@ void AsmPrinter::printInstruction(MachineInst* inst)
 
         case Opcode::CALL:
         {
-            assert(inst->outputs.size() == 1);
+            assert(inst->outputs.size() >= 1);
             assert(inst->inputs.size() >= 1);
             assert(getAssignment(inst->outputs[0]) == _context->rax);
 
@@ -681,7 +791,7 @@ void AsmPrinter::printInstruction(MachineInst* inst)
 
         case Opcode::RET:
             assert(inst->outputs.size() == 0);
-            assert(inst->inputs.size() <= 1);
+            assert(inst->inputs.size() <= 4);
             assert(inst->inputs.empty() || getAssignment(inst->inputs[0]) == _context->rax);
             printSimpleInstruction("ret", {});
             break;
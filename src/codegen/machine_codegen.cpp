@@ -50,7 +50,7 @@ MachineOperand* MachineCodeGen::getOperand(Value* value)
     }
     else if (GlobalValue* global = dynamic_cast<GlobalValue*>(value))
     {
-        bool clinkage = global->tag == GlobalTag::ExternFunction;
+        bool clinkage = global->tag == GlobalTag::ExternFunction || global->tag == GlobalTag::ExternVariable;
         return _context->createGlobal(global->name, global->type, clinkage);
     }
     else if (dynamic_cast<LocalValue*>(value))
@@ -238,29 +238,34 @@ void MachineCodeGen::visit(BinaryOperationInst* inst)
         emitMovrd(dest, lhs);
         emit(Opcode::AND, {dest}, {dest, rhs});
     }
-    else if (inst->op == BinaryOperation::SHL)
+    else if (inst->op == BinaryOperation::SHL || inst->op == BinaryOperation::SHR)
     {
         assert(dest->size() == lhs->size());
-        assert(rhs->isImmediate());
 
-        int64_t value = dynamic_cast<Immediate*>(rhs)->value;
-        assert(value < 32);
-
-        emitMovrd(dest, lhs);
-        emit(Opcode::SAL, {dest}, {dest, rhs});
-    }
-    else if (inst->op == BinaryOperation::SHR)
-    {
-        // TODO: Add support for unsigned right shift
-        assert(!isSigned(lhs->type));
-        assert(dest->size() == lhs->size());
+        // A variable shift count has to be in CL
+        if (rhs->isImmediate())
+        {
+            assert(dynamic_cast<Immediate*>(rhs)->value < 64);
+        }
+        else
+        {
+            VirtualRegister* cl = _function->createPrecoloredReg(_context->rcx, ValueType::U8);
+            emitMovrd(cl, rhs);
+            rhs = cl;
+        }
 
-        assert(rhs->isImmediate());
-        int64_t value = dynamic_cast<Immediate*>(rhs)->value;
-        assert(value < 32);
+        Opcode opcode;
+        if (inst->op == BinaryOperation::SHL)
+        {
+            opcode = Opcode::SAL;
+        }
+        else
+        {
+            opcode = isSigned(lhs->type) ? Opcode::SAR : Opcode::SHR;
+        }
 
         emitMovrd(dest, lhs);
-        emit(Opcode::SAR, {dest}, {dest, rhs});
+        emit(opcode, {dest}, {dest, rhs});
     }
     else if (inst->op == BinaryOperation::DIV || inst->op == BinaryOperation::MOD)
     {
@@ -348,6 +353,15 @@ void MachineCodeGen::visit(BinaryOperationInst* inst)
     }
 }
 
+// A result of more than one word is returned in rax, rdx, rcx and rsi
+HardwareRegister* MachineCodeGen::getReturnRegister(size_t index)
+{
+    HardwareRegister* returnRegisters[] = {hrax, hrdx, _context->rcx, _context->rsi};
+
+    assert(index < 4);
+    return returnRegisters[index];
+}
+
 void MachineCodeGen::visit(CallInst* inst)
 {
     MachineOperand* dest = getOperand(inst->dest);
@@ -444,9 +458,22 @@ void MachineCodeGen::visit(CallInst* inst)
             }
         }
 
-        emit(Opcode::CALL, {vrax}, {target});
+        // A small value may come back in several registers
+        std::vector<MachineOperand*> outputs = {vrax};
+        for (size_t i = 0; i < inst->extraDests.size(); ++i)
+        {
+            MachineOperand* extraDest = getOperand(inst->extraDests[i]);
+            outputs.push_back(_function->createPrecoloredReg(getReturnRegister(i + 1), extraDest->type));
+        }
+
+        emit(Opcode::CALL, std::move(outputs), {target});
         emitMovrd(dest, vrax);
 
+        for (size_t i = 0; i < inst->extraDests.size(); ++i)
+        {
+            emitMovrd(getOperand(inst->extraDests[i]), outputs[i + 1]);
+        }
+
         // Remove the function parameters from the stack
         if (paramsOnStack > 0)
         {
@@ -470,10 +497,23 @@ void MachineCodeGen::visit(ConditionalJumpInst* inst)
         lhs = newLhs;
     }
 
-    // Immediates are at most 32-bit
+    // Immediates are at most 32-bit, and can only be the second operand, so
+    // the comparison is reversed along with the operands
+    std::string op = inst->op;
     if (lhs->isImmediate())
+    {
         std::swap(lhs, rhs);
 
+        if (op == "<")
+            op = ">";
+        else if (op == ">")
+            op = "<";
+        else if (op == "<=")
+            op = ">=";
+        else if (op == ">=")
+            op = "<=";
+    }
+
     if (rhs->isImmediate() && rhs->size() == 64 && !is32Bit(dynamic_cast<Immediate*>(rhs)->value))
     {
         VirtualRegister* newRhs = _function->createVreg(rhs->type);
@@ -487,10 +527,11 @@ void MachineCodeGen::visit(ConditionalJumpInst* inst)
     MachineOperand* ifFalse = getOperand(inst->ifFalse);
     assert(ifTrue->isLabel() && ifFalse->isLabel());
 
-    bool sign = isSigned(inst->lhs->type);
+    // Pointers (null checks) compare as unsigned
+    bool sign = isInteger(inst->lhs->type) && isSigned(inst->lhs->type);
 
     Opcode opcode;
-    if (inst->op == ">")
+    if (op == ">")
     {
         if (sign)
         {
@@ -501,7 +542,7 @@ void MachineCodeGen::visit(ConditionalJumpInst* inst)
             opcode = Opcode::JA;
         }
     }
-    else if (inst->op == "<")
+    else if (op == "<")
     {
         if (sign)
         {
@@ -512,15 +553,15 @@ void MachineCodeGen::visit(ConditionalJumpInst* inst)
             opcode = Opcode::JB;
         }
     }
-    else if (inst->op == "==")
+    else if (op == "==")
     {
         opcode = Opcode::JE;
     }
-    else if (inst->op == "!=")
+    else if (op == "!=")
     {
         opcode = Opcode::JNE;
     }
-    else if (inst->op == ">=")
+    else if (op == ">=")
     {
         if (sign)
         {
@@ -531,7 +572,7 @@ void MachineCodeGen::visit(ConditionalJumpInst* inst)
             opcode = Opcode::JAE;
         }
     }
-    else if (inst->op == "<=")
+    else if (op == "<=")
     {
         if (sign)
         {
@@ -649,15 +690,20 @@ void MachineCodeGen::visit(ReturnInst* inst)
 {
     if (inst->value)
     {
-        VirtualRegister* vrax = _function->createPrecoloredReg(hrax, inst->value->type);
+        std::vector<MachineOperand*> results;
+        for (size_t i = 0; i <= inst->extraValues.size(); ++i)
+        {
+            MachineOperand* value = getOperand(i == 0 ? inst->value : inst->extraValues[i - 1]);
+            assert(value->isRegister() || value->isImmediate() || value->isAddress());
 
-        MachineOperand* value = getOperand(inst->value);
-        assert(value->isRegister() || value->isImmediate() || value->isAddress());
+            VirtualRegister* result = _function->createPrecoloredReg(getReturnRegister(i), value->type);
+            emitMovrd(result, value);
+            results.push_back(result);
+        }
 
-        emitMovrd(vrax, value);
         emitMovrd(vrsp, vrbp);
         emit(Opcode::POP, {vrbp}, {});
-        emit(Opcode::RET, {}, {vrax});
+        emit(Opcode::RET, {}, std::move(results));
     }
     else
     {
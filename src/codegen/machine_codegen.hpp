@@ -64,6 +64,8 @@ private:
     // Maps IR function arguments to machine arguments
     std::unordered_map<Argument*, StackParameter*> _params;
 
+    HardwareRegister* getReturnRegister(size_t index);
+
     // For convenient access
     VirtualRegister* vrsp;
     VirtualRegister* vrbp;
@@ -15,7 +15,11 @@ public:
     std::vector<MachineFunction*> functions;
     std::vector<std::string> externs;
     std::vector<std::pair<std::string, std::string>> staticStrings;
+    std::vector<std::pair<std::string, std::vector<MachineOperand*>>> staticObjects;
     std::vector<std::pair<std::string, ValueType>> globals;
+    std::vector<std::string> allocationSites;
+    std::vector<uint64_t> typeDescriptors;
+    bool packShortStrings = true;
 
     HardwareRegister* rax = new HardwareRegister("rax", "eax", "ax", "al");
     HardwareRegister* rbx = new HardwareRegister("rbx", "ebx", "bx", "bl");
@@ -36,6 +36,7 @@ const char* opcodeNames[] = {
     "RET",
     "SAL",
     "SAR",
+    "SHR",
     "SUB",
     "TEST",
 };
@@ -54,6 +54,7 @@ enum class Opcode {
     RET,
     SAL,
     SAR,
+    SHR,
     SUB,
     TEST,
 };
@@ -124,9 +124,16 @@ void RegAlloc::spillAroundCalls()
                         continue;
                     }
 
-                    // If the function has a return value, then rax is redefined by this instruction, so
-                    // we don't need to save it
-                    if (!inst->outputs.empty() && dynamic_cast<VirtualRegister*>(liveReg)->assignment == _context->rax)
+                    // If the function has a return value, then rax (and maybe rdx, rcx and rsi) are redefined
+                    // by this instruction, so we don't need to save them
+                    bool isResult = false;
+                    for (Reg* output : inst->outputs)
+                    {
+                        if (dynamic_cast<VirtualRegister*>(liveReg)->assignment == dynamic_cast<VirtualRegister*>(output)->assignment)
+                            isResult = true;
+                    }
+
+                    if (isResult)
                         continue;
 
                     ValueType type = dynamic_cast<VirtualRegister*>(liveReg)->type;
@@ -568,12 +575,14 @@ void RegAlloc::spillVariable(Reg* reg)
         for (auto i = block->instructions.begin(); i != block->instructions.end(); ++i)
         {
             MachineInst* inst = *i;
+            MachineOperand* loadedReg = nullptr;
 
             // Instruction uses the spilled register
             if (std::find(inst->inputs.begin(), inst->inputs.end(), reg) != inst->inputs.end())
             {
                 // Load from the stack into a fresh register
                 MachineOperand* newReg = _function->createVreg(vreg->type);
+                loadedReg = newReg;
                 MachineInst* loadInst = new MachineInst(Opcode::MOVrm, {newReg}, {spillLocation});
                 block->instructions.insert(i, loadInst);
 
@@ -588,8 +597,9 @@ void RegAlloc::spillVariable(Reg* reg)
             // Instruction defines the spilled register
             if (std::find(inst->outputs.begin(), inst->outputs.end(), reg) != inst->outputs.end())
             {
-                // Create a fresh register to store the result
-                MachineOperand* newReg = _function->createVreg(vreg->type);
+                // Create a fresh register to store the result. Two-address
+                // instructions (like ADD) need it to be the same as the input
+                MachineOperand* newReg = loadedReg ? loadedReg : _function->createVreg(vreg->type);
 
                 // Replace all uses of the spilled register with the new one
                 for (size_t j = 0; j < inst->outputs.size(); ++j)
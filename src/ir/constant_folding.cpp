@@ -69,13 +69,22 @@ void ConstantFolding::visit(BinaryOperationInst* inst)
     }
     else if (inst->op == BinaryOperation::SHL)
     {
-        assert(rhs < 32);
+        assert(rhs < 64);
         resultValue = lhs << rhs;
     }
     else if (inst->op == BinaryOperation::SHR)
     {
-        assert(rhs < 32);
-        resultValue = lhs >> rhs;
+        assert(rhs < 64);
+
+        // Matches the SAR / SHR choice in code generation
+        if (isSigned(type))
+        {
+            resultValue = int64_t(lhs) >> rhs;
+        }
+        else
+        {
+            resultValue = lhs >> rhs;
+        }
     }
     else if (inst->op == BinaryOperation::DIV)
     {
@@ -38,6 +38,14 @@ GlobalValue* TACContext::createExternFunction(const std::string& name)
     return result;
 }
 
+GlobalValue* TACContext::createExternVariable(ValueType type, const std::string& name)
+{
+    GlobalValue* result = new GlobalValue(this, type, name, GlobalTag::ExternVariable);
+    _values.push_back(result);
+    externs.push_back(result);
+    return result;
+}
+
 Function* TACContext::createFunction(const std::string& name)
 {
     Function* result = new Function(this, name);
@@ -62,6 +70,14 @@ GlobalValue* TACContext::createStaticString(const std::string& name, const std::
     return result;
 }
 
+GlobalValue* TACContext::createStaticObject(const std::string& name, const std::vector<Value*>& contents)
+{
+    GlobalValue* result = new GlobalValue(this, ValueType::Reference, name, GlobalTag::Static);
+    _values.push_back(result);
+    staticObjects.emplace_back(result, contents);
+    return result;
+}
+
 LocalValue* TACContext::createLocal(ValueType type, const std::string& name)
 {
     LocalValue* result = new LocalValue(this, type, name);
@@ -13,17 +13,35 @@ struct TACContext
     std::vector<Function*> functions;
     std::vector<Value*> globals;
     std::vector<std::pair<Value*, std::string>> staticStrings;
+
+    // Heap objects which are emitted in the data section instead of being
+    // allocated: the header, then the members. Each word is a constant or a
+    // function address
+    std::vector<std::pair<Value*, std::vector<Value*>>> staticObjects;
+
+    // Reference bitmaps of structures too wide for the object header
+    std::vector<uint64_t> typeDescriptors;
     std::vector<Value*> externs;
 
+    // Descriptions of allocation sites, with --profile-alloc. Site n is
+    // allocationSites[n - 1], and site 0 is the runtime library
+    std::vector<std::string> allocationSites;
+
+    // False if the program stores into strings, so that none may be packed
+    // into the reference (see __packShortStrings in library.c)
+    bool packShortStrings = true;
+
     TACContext();
     ~TACContext();
 
     Argument* createArgument(ValueType type, const std::string& name);
     ConstantInt* createConstantInt(ValueType type, int64_t value);
     GlobalValue* createExternFunction(const std::string& name);
+    GlobalValue* createExternVariable(ValueType type, const std::string& name);
     Function* createFunction(const std::string& name);
     GlobalValue* createGlobal(ValueType type, const std::string& name);
     GlobalValue* createStaticString(const std::string& name, const std::string& contents);
+    GlobalValue* createStaticObject(const std::string& name, const std::vector<Value*>& contents);
     LocalValue* createLocal(ValueType type, const std::string& name);
     Value* createTemp(ValueType type, int64_t number);
     Value* createTemp(ValueType type, const std::string& name);
@@ -10,15 +10,29 @@
 #include <limits>
 #include <iostream>
 
-TACCodeGen::TACCodeGen(TACContext* context)
-: _context(context), _conditionalCodeGen(this)
+TACCodeGen::TACCodeGen(TACContext* context, bool profileAllocations)
+: _context(context), _conditionalCodeGen(this), _profileAllocations(profileAllocations)
 {
     _gcAllocate = _context->createExternFunction("gcAllocate");
+    _gcWriteBarrier = _context->createExternFunction("gcWriteBarrier");
+    _shortStringModified = _context->createExternFunction("shortStringModified");
+    _nurseryStart = _context->createExternVariable(ValueType::U64, "heapStart");
+    _nurseryPointer = _context->createExternVariable(ValueType::U64, "heapPointer");
+    _nurseryEnd = _context->createExternVariable(ValueType::U64, "heapEnd");
+
+    if (_profileAllocations)
+    {
+        _allocationSite = _context->createExternVariable(ValueType::U64, "allocationSite");
+    }
 }
 
 void TACCodeGen::codeGen(AstContext* astContext)
 {
     _astContext = astContext;
+
+    _packShortStrings = astContext->packShortStrings();
+    _context->packShortStrings = _packShortStrings;
+
     _astContext->root()->accept(this);
 }
 
@@ -79,13 +93,19 @@ Value* TACCodeGen::load(const Symbol* symbol)
 
     Value* dest = createTemp(getValueType(symbol->type));
 
+    if (std::vector<Value*>* slots = getUnboxedSlots(symbol))
+    {
+        boxValue(dest, loadUnboxed(*slots), getConcreteType(symbol->type), nullptr);
+        return dest;
+    }
+
     if (symbol->kind == kCapture)
     {
         const CaptureSymbol* captureSymbol = dynamic_cast<const CaptureSymbol*>(symbol);
         assert(captureSymbol);
 
         Value* env = load(captureSymbol->envSymbol);
-        emit(new IndexedLoadInst(dest, env, constant(sizeof(SplObject) + 8 * captureSymbol->index)));
+        emit(new IndexedLoadInst(dest, env, constant(8 * captureSymbol->index)));
     }
     else
     {
@@ -96,17 +116,31 @@ Value* TACCodeGen::load(const Symbol* symbol)
     return dest;
 }
 
-void TACCodeGen::store(const Symbol* symbol, Value* src)
+void TACCodeGen::store(const Symbol* symbol, Value* src, AstNode* node)
 {
     assert(symbol);
 
+    if (std::vector<Value*>* slots = getUnboxedSlots(symbol))
+    {
+        std::vector<Value*> registers = getRegisters(src, getConcreteType(symbol->type));
+        for (size_t i = 0; i < slots->size(); ++i)
+        {
+            emit(new StoreInst(slots->at(i), registers[i]));
+        }
+
+        return;
+    }
+
+    src = box(src, node);
+
     if (symbol->kind == kCapture)
     {
         const CaptureSymbol* captureSymbol = dynamic_cast<const CaptureSymbol*>(symbol);
         assert(captureSymbol);
 
         Value* env = load(captureSymbol->envSymbol);
-        emit(new IndexedStoreInst(env, constant(sizeof(SplObject) + 8 * captureSymbol->index), src));
+        emit(new IndexedStoreInst(env, constant(8 * captureSymbol->index), src));
+        writeBarrier(env, src);
     }
     else
     {
@@ -115,6 +149,237 @@ void TACCodeGen::store(const Symbol* symbol, Value* src)
     }
 }
 
+size_t TACCodeGen::getAllocationSite(const std::string& name, AstNode* node)
+{
+    std::stringstream ss;
+    ss << name;
+
+    if (node)
+    {
+        YYLTYPE location = node->location;
+        ss << " (" << location.filename << ":" << location.first_line << ":" << location.first_column << ")";
+    }
+
+    std::string description = ss.str();
+
+    auto i = _allocationSiteIds.find(description);
+    if (i != _allocationSiteIds.end())
+    {
+        return i->second;
+    }
+
+    _context->allocationSites.push_back(description);
+    size_t site = _context->allocationSites.size();
+    _allocationSiteIds.emplace(description, site);
+
+    return site;
+}
+
+void TACCodeGen::setAllocationSite(const std::string& name, AstNode* node)
+{
+    if (!_profileAllocations)
+        return;
+
+    emit(new StoreInst(_allocationSite, constant(getAllocationSite(name, node))));
+}
+
+void TACCodeGen::setDefaultAllocationSite(const std::string& name, AstNode* node)
+{
+    if (!_profileAllocations)
+        return;
+
+    BasicBlock* setSite = createBlock();
+    BasicBlock* continueAt = createBlock();
+
+    Value* currentSite = createTemp(ValueType::U64);
+    emit(new LoadInst(currentSite, _allocationSite));
+    emit(new ConditionalJumpInst(currentSite, "==", _context->Zero, setSite, continueAt));
+
+    setBlock(setSite);
+    emit(new StoreInst(_allocationSite, constant(getAllocationSite(name, node))));
+    emit(new JumpInst(continueAt));
+
+    setBlock(continueAt);
+}
+
+void TACCodeGen::emitAllocatingCall(CallInst* inst, const FunctionSymbol* functionSymbol, AstNode* node)
+{
+    // Constructors and arrays are attributed to their caller. External
+    // functions are too, but only for their first allocation, and the site
+    // mustn't outlive the call
+    bool allocates = functionSymbol->isConstructor || functionSymbol->isBuiltin || functionSymbol->isExternal;
+    if (allocates)
+    {
+        setAllocationSite(functionSymbol->name, node);
+    }
+
+    emit(inst);
+
+    if (_profileAllocations && functionSymbol->isExternal)
+    {
+        emit(new StoreInst(_allocationSite, _context->Zero));
+    }
+}
+
+// The runtime gives each block the header of an unboxed array, so the layout
+// of the object (see library.h) is added to the header after a call
+void TACCodeGen::callAllocator(Value* dest, Value* size, uint64_t layout)
+{
+    CallInst* callInst = new CallInst(dest, _gcAllocate, {size});
+    callInst->regpass = true;
+    emit(callInst);
+
+    if (layout != 0)
+    {
+        Value* header = createTemp(ValueType::U64);
+        emit(new IndexedLoadInst(header, dest, _context->createConstantInt(ValueType::I64, -8)));
+        Value* newHeader = createTemp(ValueType::U64);
+        emit(new BinaryOperationInst(newHeader, header, BinaryOperation::ADD, constant(layout)));
+        emit(new IndexedStoreInst(dest, _context->createConstantInt(ValueType::I64, -8), newHeader));
+    }
+}
+
+void TACCodeGen::gcAllocate(Value* dest, Value* size, uint64_t layout)
+{
+    // Large objects are never allocated in the nursery, and when profiling,
+    // the runtime has to see every allocation
+    ConstantInt* constantSize = dynamic_cast<ConstantInt*>(size);
+    if ((constantSize && constantSize->value >= LARGE_OBJECT_SIZE) || _profileAllocations)
+    {
+        callAllocator(dest, size, layout);
+        return;
+    }
+
+    BasicBlock* fastPath = createBlock();
+    BasicBlock* slowPath = createBlock();
+    BasicBlock* continueAt = createBlock();
+
+    if (!constantSize)
+    {
+        BasicBlock* checkNursery = createBlock();
+        emit(new ConditionalJumpInst(size, ">=", constant(LARGE_OBJECT_SIZE), slowPath, checkNursery));
+        setBlock(checkNursery);
+    }
+
+    // Allocate in units of 8 bytes (this is folded when the size is constant)
+    Value* roundedSize = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(roundedSize, size, BinaryOperation::ADD, constant(7)));
+    Value* sizeInWords = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(sizeInWords, roundedSize, BinaryOperation::SHR, constant(3)));
+
+    // Bump the pointer past the header word and the object
+    Value* blockSize = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(blockSize, sizeInWords, BinaryOperation::ADD, constant(1)));
+    Value* blockBytes = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(blockBytes, blockSize, BinaryOperation::SHL, constant(3)));
+
+    Value* block = createTemp(ValueType::U64);
+    emit(new LoadInst(block, _nurseryPointer));
+    Value* newPointer = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(newPointer, block, BinaryOperation::ADD, blockBytes));
+
+    // Same test as try_mymalloc
+    Value* nurseryEnd = createTemp(ValueType::U64);
+    emit(new LoadInst(nurseryEnd, _nurseryEnd));
+    emit(new ConditionalJumpInst(newPointer, ">=", nurseryEnd, slowPath, fastPath));
+
+    // Fast path: no calls, so no safepoints. The untyped block pointer is dead
+    // before anything can trigger a collection
+    setBlock(fastPath);
+    emit(new StoreInst(_nurseryPointer, newPointer));
+
+    Value* shiftedSize = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(shiftedSize, sizeInWords, BinaryOperation::SHL, constant(HEADER_SIZE_SHIFT)));
+    Value* header = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(header, shiftedSize, BinaryOperation::ADD, constant(HEADER_TAG | layout)));
+    emit(new IndexedStoreInst(block, constant(0), header));
+
+    Value* objectAddress = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(objectAddress, block, BinaryOperation::ADD, constant(8)));
+    Value* fastResult = createTemp(ValueType::Reference);
+    emit(new CopyInst(fastResult, objectAddress));
+    emit(new JumpInst(continueAt));
+
+    // Slow path: collect garbage and try again (or expand the heap)
+    setBlock(slowPath);
+    Value* slowResult = createTemp(ValueType::Reference);
+    callAllocator(slowResult, size, layout);
+    BasicBlock* slowPathEnd = _currentBlock;
+    emit(new JumpInst(continueAt));
+
+    setBlock(continueAt);
+    PhiInst* phi = new PhiInst(dest);
+    phi->addSource(fastPath, fastResult);
+    phi->addSource(slowPathEnd, slowResult);
+    emit(phi);
+}
+
+void TACCodeGen::writeBarrier(Value* object, Value* value)
+{
+    // Only references to heap objects can point into the nursery
+    if (value->type != ValueType::Reference ||
+        dynamic_cast<ConstantInt*>(value) ||
+        dynamic_cast<GlobalValue*>(value))
+    {
+        return;
+    }
+
+    BasicBlock* checkObject = createBlock();
+    BasicBlock* slowPath = createBlock();
+    BasicBlock* continueAt = createBlock();
+
+    Value* nurseryStart = createTemp(ValueType::U64);
+    emit(new LoadInst(nurseryStart, _nurseryStart));
+    Value* nurseryEnd = createTemp(ValueType::U64);
+    emit(new LoadInst(nurseryEnd, _nurseryEnd));
+    Value* nurserySize = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(nurserySize, nurseryEnd, BinaryOperation::SUB, nurseryStart));
+
+    // Unsigned range checks: (x - start) < size iff start <= x < end
+
+    // Fast path #1: the stored value is not in the nursery (includes null)
+    Value* valueAddress = createTemp(ValueType::U64);
+    emit(new CopyInst(valueAddress, value));
+    Value* valueOffset = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(valueOffset, valueAddress, BinaryOperation::SUB, nurseryStart));
+    emit(new ConditionalJumpInst(valueOffset, "<", nurserySize, checkObject, continueAt));
+
+    // Fast path #2: the object being modified is itself in the nursery
+    setBlock(checkObject);
+    Value* objectAddress = createTemp(ValueType::U64);
+    emit(new CopyInst(objectAddress, object));
+    Value* objectOffset = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(objectOffset, objectAddress, BinaryOperation::SUB, nurseryStart));
+    emit(new ConditionalJumpInst(objectOffset, "<", nurserySize, continueAt, slowPath));
+
+    // Slow path: add the object to the remembered set
+    setBlock(slowPath);
+    Value* ignored = createTemp(ValueType::U64);
+    CallInst* callInst = new CallInst(ignored, _gcWriteBarrier, {object});
+    callInst->regpass = true;
+    emit(callInst);
+    emit(new JumpInst(continueAt));
+
+    setBlock(continueAt);
+}
+
+bool TACCodeGen::mayBeShortString(ConstructedType* arrayType)
+{
+    if (!_packShortStrings)
+        return false;
+
+    Type* elementType = getConcreteType(arrayType->typeParameters()[0]);
+    return elementType->equals(elementType->table()->Char);
+}
+
+// Short strings are exactly the references which are negative as integers
+void TACCodeGen::testShortString(Value* string, BasicBlock* ifShort, BasicBlock* ifArray)
+{
+    Value* signedValue = createTemp(ValueType::I64);
+    emit(new CopyInst(signedValue, string));
+    emit(new ConditionalJumpInst(signedValue, "<", _context->createConstantInt(ValueType::I64, 0), ifShort, ifArray));
+}
+
 Value* TACCodeGen::getValue(const Symbol* symbol)
 {
     if (!symbol)
@@ -309,6 +574,135 @@ static TypeAssignment compose(const TypeAssignment& typeContext, const TypeAssig
     return result;
 }
 
+// How the values of a type with value constructors (an enum or a struct) are
+// represented
+enum class EnumRepresentation
+{
+    // A pointer to an object, which holds the constructor tag
+    Boxed,
+
+    // A pointer to an object, with the constructor tag in the low bits of the
+    // pointer, so that matching needs no load. Constructors without members
+    // have no object: their values are just the tag
+    Tagged,
+
+    // No constructor has members, so the value is the constructor tag itself,
+    // and never lives on the heap
+    Immediate,
+
+    // One constructor without members and one with a single member which is
+    // a never-null reference (like Option<String>). The first is a null
+    // pointer, and the second is just its member, without a box
+    Nullable,
+};
+
+// The concrete type of a member of a (concrete) type's value constructor
+static Type* getMemberType(Type* type, ValueConstructor* constructor, size_t index)
+{
+    Type* memberType = constructor->members().at(index).type;
+
+    ConstructedType* constructedType = type->get<ConstructedType>();
+    if (constructedType && constructedType->prototype() != constructedType)
+    {
+        const ConstructedType* prototype = constructedType->prototype();
+
+        TypeAssignment typeAssignment;
+        for (size_t i = 0; i < prototype->typeParameters().size(); ++i)
+        {
+            TypeVariable* variable = prototype->typeParameters()[i]->get<TypeVariable>();
+            typeAssignment[variable] = constructedType->typeParameters()[i];
+        }
+
+        memberType = substitute(memberType, typeAssignment);
+    }
+
+    return memberType;
+}
+
+// The two constructors of a type which could be Nullable, ordered null-first
+static bool getNullableConstructors(Type* type, ValueConstructor*& null, ValueConstructor*& nonNull)
+{
+    const std::vector<ValueConstructor*>& constructors = type->valueConstructors();
+    if (constructors.size() != 2)
+        return false;
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        if (constructors[i]->members().empty() && constructors[1 - i]->members().size() == 1)
+        {
+            null = constructors[i];
+            nonNull = constructors[1 - i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static EnumRepresentation getEnumRepresentation(Type* type);
+
+// Whether every value of a concrete type is a non-null pointer
+static bool isNeverNull(Type* type)
+{
+    if (type->isVariable() || !type->isBoxed())
+        return false;
+
+    const std::vector<ValueConstructor*>& constructors = type->valueConstructors();
+    if (constructors.empty())
+        return true;
+
+    // Nullable-shaped enums are rejected without recursing into their members,
+    // which may have this very type (enum Chain = Link(Chain) | End)
+    ValueConstructor* null;
+    ValueConstructor* nonNull;
+    if (getNullableConstructors(type, null, nonNull))
+        return false;
+
+    switch (getEnumRepresentation(type))
+    {
+        case EnumRepresentation::Boxed:
+            return true;
+
+        case EnumRepresentation::Tagged:
+            return !constructors[0]->members().empty();
+
+        default:
+            return false;
+    }
+}
+
+static EnumRepresentation getEnumRepresentation(Type* type)
+{
+    const std::vector<ValueConstructor*>& constructors = type->valueConstructors();
+
+    bool anyMembers = false;
+    for (ValueConstructor* constructor : constructors)
+    {
+        if (!constructor->members().empty())
+            anyMembers = true;
+    }
+
+    ValueConstructor* null;
+    ValueConstructor* nonNull;
+
+    if (!constructors.empty() && !anyMembers)
+    {
+        return EnumRepresentation::Immediate;
+    }
+    else if (getNullableConstructors(type, null, nonNull) && isNeverNull(getMemberType(type, nonNull, 0)))
+    {
+        return EnumRepresentation::Nullable;
+    }
+    else if (constructors.size() >= 2 && constructors.size() <= POINTER_TAG_MASK + 1)
+    {
+        return EnumRepresentation::Tagged;
+    }
+    else
+    {
+        return EnumRepresentation::Boxed;
+    }
+}
+
 static ValueType getRealValueType(Type* type)
 {
     if (!isConcrete(type))
@@ -316,7 +710,11 @@ static ValueType getRealValueType(Type* type)
         throw MonomorphizationError();
     }
 
-    if (type->isBoxed())
+    if (getEnumRepresentation(type) == EnumRepresentation::Immediate)
+    {
+        return ValueType::U64;
+    }
+    else if (type->isBoxed())
     {
         return ValueType::Reference;
     }
@@ -346,104 +744,439 @@ static ValueType getRealValueType(Type* type)
     }
 }
 
-Type* TACCodeGen::getConcreteType(Type* type, const TypeAssignment& typeAssignment)
+// The type of a member as stored in its object. Bools and enums without
+// members are kept in a single byte, and widened again when loaded
+static ValueType getStorageType(Type* type)
 {
-    TypeAssignment fullAssignment = compose(_typeContext, typeAssignment);
-    Type* concreteType = substitute(type, fullAssignment);
+    if (type->equals(type->table()->Bool))
+    {
+        return ValueType::U8;
+    }
+    else if (!type->isVariable() && type->isBoxed())
+    {
+        // Doesn't depend on the type parameters, which may not all be known
+        // from the type of the object (like the T of a member `f: |T| -> Bool`
+        // of struct Filter<I> where I: Iterator<T>)
+        if (getEnumRepresentation(type) == EnumRepresentation::Immediate)
+        {
+            return ValueType::U8;
+        }
 
-    return concreteType;
+        return ValueType::Reference;
+    }
+
+    return getRealValueType(type);
 }
 
-ValueType TACCodeGen::getValueType(Type* type, const TypeAssignment& typeAssignment)
+// Where each member of a value constructor lives within its object.
+// References come first, so that the reference bitmap is a dense run of low
+// bits, followed by the other word-sized members, and then the single bytes
+// packed together. The object is padded to a whole number of words
+struct MemberLayout
 {
-    return getRealValueType(getConcreteType(type, typeAssignment));
-}
+    std::vector<ValueType> storageTypes;
+    std::vector<int64_t> offsets;
+    size_t size = 0;
+    uint64_t refMask = 0;
+};
 
-uint64_t TACCodeGen::getConstructorLayout(const ConstructorSymbol* symbol, AstNode* node, const TypeAssignment& typeAssignment)
+static MemberLayout getMemberLayout(const std::vector<Type*>& memberTypes)
 {
-    Function* function = (Function*)getFunctionValue(symbol, node, typeAssignment);
-    auto i = _constructorLayouts.find(function);
-    if (i != _constructorLayouts.end())
+    MemberLayout layout;
+    for (Type* type : memberTypes)
     {
-        return i->second;
+        layout.storageTypes.push_back(getStorageType(type));
     }
 
-    TypeAssignment realAssignment = combine(_typeContext, typeAssignment);
+    layout.offsets.resize(memberTypes.size());
 
-    for (auto& assignment : realAssignment)
+    size_t references = 0;
+    for (size_t i = 0; i < memberTypes.size(); ++i)
     {
-        if (!isConcrete(assignment.second))
+        if (layout.storageTypes[i] == ValueType::Reference)
         {
-            assert(node);
-
-            YYLTYPE location = node->location;
-            std::stringstream ss;
-
-            ss << location.filename << ":" << location.first_line << ":" << location.first_column
-               << ": cannot infer concrete type of call to constructor " << symbol->name;
+            layout.refMask |= ((uint64_t)1 << references);
+            layout.offsets[i] = 8 * references++;
+        }
+    }
 
-            throw CodegenError(ss.str());
+    layout.size = 8 * references;
+    for (size_t width : {8, 4, 2, 1})
+    {
+        for (size_t i = 0; i < memberTypes.size(); ++i)
+        {
+            ValueType storageType = layout.storageTypes[i];
+            if (storageType != ValueType::Reference && getSize(storageType) / 8 == width)
+            {
+                layout.offsets[i] = layout.size;
+                layout.size += width;
+            }
         }
     }
 
-    ValueConstructor* constructor = symbol->constructor;
-    const std::vector<ValueConstructor::MemberDesc> members = constructor->members();
+    layout.size = (layout.size + 7) & ~(size_t)7;
+    return layout;
+}
 
-    if (members.size() > 64)
+// The layout of the members of a value constructor of a concrete type
+static MemberLayout getMemberLayout(Type* type, ValueConstructor* constructor)
+{
+    std::vector<Type*> memberTypes;
+    for (size_t i = 0; i < constructor->members().size(); ++i)
     {
-        YYLTYPE location = node->location;
-        std::stringstream ss;
+        memberTypes.push_back(getMemberType(type, constructor, i));
+    }
 
-        ss << location.filename << ":" << location.first_line << ":" << location.first_column
-           << ": constructor `" << symbol->name << "` cannot contain more than 64 members";
+    return getMemberLayout(memberTypes);
+}
 
-        throw CodegenError(ss.str());
-    }
+// Arrays of value structs at most this large hold their elements inline
+static const size_t MAX_FLAT_ELEMENT_SIZE = 32;
 
-    uint64_t refMask = 0;
-    for(size_t i = 0; i < members.size(); ++i)
-    {
-        auto& member = members[i];
+// Whether an array of this (concrete) element type is a FlatArray, and if so,
+// the constructor and layout of its elements
+static bool getFlatElement(Type* type, ValueConstructor*& constructor, MemberLayout& layout)
+{
+    if (type->isVariable())
+        return false;
 
-        Type* type = substitute(member.type, realAssignment);
-        assert(isConcrete(type));
+    const std::vector<ValueConstructor*>& constructors = type->valueConstructors();
+    if (constructors.size() != 1 || !constructors[0]->isValue())
+        return false;
 
-        if (type->isBoxed())
-        {
-            refMask |= (1 << i);
-        }
+    constructor = constructors[0];
+    layout = getMemberLayout(type, constructor);
+    return layout.size <= MAX_FLAT_ELEMENT_SIZE;
+}
+
+// Whether the values of a concrete type can be taken apart and built again
+// without changing the meaning of the program. The members of enums and value
+// structs can't be assigned to, but those of ordinary structs can
+static bool isCopyable(Type* type)
+{
+    for (ValueConstructor* constructor : type->valueConstructors())
+    {
+        // Only struct members have names
+        std::vector<ValueConstructor::MemberDesc>& members = constructor->members();
+        if (!constructor->isValue() && !members.empty() && !members[0].name.empty())
+            return false;
     }
 
-    _constructorLayouts.emplace(function, refMask);
-    return refMask;
+    return true;
 }
 
-Value* TACCodeGen::getFunctionValue(const Symbol* symbol, AstNode* node, const TypeAssignment& typeAssignment)
+// Functions return at most this many registers (see getReturnRegisters)
+static const size_t MAX_RETURN_REGISTERS = 4;
+
+// Whether a concrete type is a value struct small enough to be kept in
+// registers, one for each member, instead of a box
+static bool getValueStructRegisters(Type* type, std::vector<ValueType>& registers)
 {
-    auto& instantiations = _functionNames[symbol];
+    if (!isConcrete(type) || !type->isBoxed())
+        return false;
 
-    TypeAssignment realAssignment = combine(_typeContext, typeAssignment);
+    const std::vector<ValueConstructor*>& constructors = type->valueConstructors();
+    if (constructors.size() != 1 || !constructors[0]->isValue())
+        return false;
 
-    for (auto& assignment : realAssignment)
+    registers.clear();
+    for (size_t i = 0; i < constructors[0]->members().size(); ++i)
     {
-        if (!isConcrete(assignment.second))
-        {
-            assert(node);
+        Type* memberType = getMemberType(type, constructors[0], i);
+        if (!isConcrete(memberType))
+            return false;
 
-            YYLTYPE location = node->location;
-            std::stringstream ss;
+        registers.push_back(getRealValueType(memberType));
+    }
 
-            ss << location.filename << ":" << location.first_line << ":" << location.first_column
-               << ": cannot infer concrete type of call to function " << symbol->name;
+    return !registers.empty() && registers.size() <= MAX_RETURN_REGISTERS;
+}
 
-            throw CodegenError(ss.str());
-        }
-    }
+// Whether a member of an enum held in registers is a small value struct, which
+// takes a register for each of its own members
+static bool isUnboxedMember(Type* type, Type* memberType, std::vector<ValueType>& registers)
+{
+    return type->valueConstructors().size() > 1 && getValueStructRegisters(memberType, registers);
+}
 
-    for (auto& instantiation : instantiations)
+// A function which always builds a new enum or value struct, of a concrete
+// type which fits, returns it in registers instead of boxing it: the
+// constructor tag, if there's more than one constructor, and then the members.
+// The members at the same position in different constructors share a
+// register, so they must have the same type
+static bool getReturnRegisters(Type* type, std::vector<ValueType>& registers)
+{
+    if (!isConcrete(type) || !type->isBoxed() || !isCopyable(type))
+        return false;
+
+    // Immediate and Nullable values are already unboxed, except for a Nullable
+    // value struct (like Option<StrView>), whose Some would need a box
+    const std::vector<ValueConstructor*>& constructors = type->valueConstructors();
+    switch (getEnumRepresentation(type))
     {
-        if (sameAssignment(instantiation.first, realAssignment))
-        {
+        case EnumRepresentation::Tagged:
+            break;
+
+        case EnumRepresentation::Boxed:
+            if (constructors.size() != 1)
+                return false;
+
+            break;
+
+        case EnumRepresentation::Nullable:
+        {
+            ValueConstructor* null;
+            ValueConstructor* nonNull;
+            getNullableConstructors(type, null, nonNull);
+
+            std::vector<ValueType> memberRegisters;
+            if (!getValueStructRegisters(getMemberType(type, nonNull, 0), memberRegisters))
+                return false;
+
+            break;
+        }
+
+        default:
+            return false;
+    }
+
+    registers.clear();
+    if (constructors.size() > 1)
+    {
+        registers.push_back(ValueType::U64);
+    }
+
+    size_t firstMember = registers.size();
+    for (ValueConstructor* constructor : constructors)
+    {
+        size_t position = firstMember;
+        for (size_t i = 0; i < constructor->members().size(); ++i)
+        {
+            Type* memberType = getMemberType(type, constructor, i);
+            if (!isConcrete(memberType))
+                return false;
+
+            std::vector<ValueType> valueTypes;
+            if (!isUnboxedMember(type, memberType, valueTypes))
+            {
+                valueTypes = {getRealValueType(memberType)};
+            }
+
+            for (ValueType valueType : valueTypes)
+            {
+                if (position == registers.size())
+                {
+                    registers.push_back(valueType);
+                }
+                else if (registers[position] != valueType)
+                {
+                    return false;
+                }
+
+                ++position;
+            }
+        }
+    }
+
+    return registers.size() <= MAX_RETURN_REGISTERS;
+}
+
+// The first of the registers holding a member of a value held in registers,
+// and how many of them there are
+static size_t getMemberRegisters(Type* type, ValueConstructor* constructor, size_t index, size_t& count)
+{
+    size_t first = type->valueConstructors().size() > 1 ? 1 : 0;
+    for (size_t i = 0; ; ++i)
+    {
+        std::vector<ValueType> registers;
+        count = isUnboxedMember(type, getMemberType(type, constructor, i), registers) ? registers.size() : 1;
+
+        if (i == index)
+            return first;
+
+        first += count;
+    }
+}
+
+Type* TACCodeGen::getConcreteType(Type* type, const TypeAssignment& typeAssignment)
+{
+    TypeAssignment fullAssignment = compose(_typeContext, typeAssignment);
+    Type* concreteType = substitute(type, fullAssignment);
+
+    return concreteType;
+}
+
+ValueType TACCodeGen::getValueType(Type* type, const TypeAssignment& typeAssignment)
+{
+    return getRealValueType(getConcreteType(type, typeAssignment));
+}
+
+// The variables holding the members of a local value struct, or nullptr if the
+// symbol holds a reference as usual. Parameters are set up along with their
+// function (see chooseCallingConvention)
+std::vector<Value*>* TACCodeGen::getUnboxedSlots(const Symbol* symbol)
+{
+    auto i = _unboxedLocals.find(symbol);
+    if (i != _unboxedLocals.end())
+    {
+        return &i->second;
+    }
+
+    if (symbol->kind != kVariable || symbol->global)
+        return nullptr;
+
+    const VariableSymbol* varSymbol = dynamic_cast<const VariableSymbol*>(symbol);
+    if (varSymbol->isStatic || varSymbol->isParam)
+        return nullptr;
+
+    std::vector<ValueType> registers;
+    if (!getValueStructRegisters(getConcreteType(symbol->type), registers))
+        return nullptr;
+
+    std::vector<Value*>& slots = _unboxedLocals[symbol];
+    for (ValueType type : registers)
+    {
+        Value* slot = _context->createLocal(type, symbol->name);
+        _currentFunction->locals.push_back(slot);
+        slots.push_back(slot);
+    }
+
+    return &slots;
+}
+
+std::vector<Value*> TACCodeGen::loadUnboxed(const std::vector<Value*>& slots)
+{
+    std::vector<Value*> registers;
+    for (Value* slot : slots)
+    {
+        Value* value = createTemp(slot->type);
+        emit(new LoadInst(value, slot));
+        registers.push_back(value);
+    }
+
+    return registers;
+}
+
+uint64_t TACCodeGen::getConstructorLayout(const ConstructorSymbol* symbol, AstNode* node, const TypeAssignment& typeAssignment)
+{
+    Function* function = (Function*)getFunctionValue(symbol, node, typeAssignment);
+    auto i = _constructorLayouts.find(function);
+    if (i != _constructorLayouts.end())
+    {
+        return i->second;
+    }
+
+    TypeAssignment realAssignment = combine(_typeContext, typeAssignment);
+
+    for (auto& assignment : realAssignment)
+    {
+        if (!isConcrete(assignment.second))
+        {
+            assert(node);
+
+            YYLTYPE location = node->location;
+            std::stringstream ss;
+
+            ss << location.filename << ":" << location.first_line << ":" << location.first_column
+               << ": cannot infer concrete type of call to constructor " << symbol->name;
+
+            throw CodegenError(ss.str());
+        }
+    }
+
+    ValueConstructor* constructor = symbol->constructor;
+    const std::vector<ValueConstructor::MemberDesc> members = constructor->members();
+
+    if (members.size() > 64)
+    {
+        YYLTYPE location = node->location;
+        std::stringstream ss;
+
+        ss << location.filename << ":" << location.first_line << ":" << location.first_column
+           << ": constructor `" << symbol->name << "` cannot contain more than 64 members";
+
+        throw CodegenError(ss.str());
+    }
+
+    std::vector<Type*> memberTypes;
+    for (auto& member : members)
+    {
+        Type* type = substitute(member.type, realAssignment);
+        assert(isConcrete(type));
+
+        memberTypes.push_back(type);
+    }
+
+    uint64_t refMask = getMemberLayout(memberTypes).refMask;
+    uint64_t layout = getStructLayout(constructor->constructorTag(), refMask);
+    _constructorLayouts.emplace(function, layout);
+    return layout;
+}
+
+// The part of the header of a structure which describes it (see library.h)
+uint64_t TACCodeGen::getStructLayout(uint64_t constructorTag, uint64_t refMask)
+{
+    assert(constructorTag <= HEADER_CONSTRUCTOR_MASK);
+
+    if (refMask <= HEADER_LAYOUT_MASK)
+    {
+        return MAKE_STRUCT_LAYOUT(HEADER_STRUCT, constructorTag, refMask);
+    }
+
+    // Bitmaps which don't fit in the header are stored in __typeDescriptors,
+    // and shared by every structure with the same bitmap
+    auto i = _typeDescriptors.find(refMask);
+    if (i == _typeDescriptors.end())
+    {
+        i = _typeDescriptors.emplace(refMask, _context->typeDescriptors.size()).first;
+        _context->typeDescriptors.push_back(refMask);
+    }
+
+    return MAKE_STRUCT_LAYOUT(HEADER_DESCRIBED_STRUCT, constructorTag, i->second);
+}
+
+static FunctionDefNode* getFunctionDefinition(const Symbol* symbol)
+{
+    if (const FunctionSymbol* functionSymbol = dynamic_cast<const FunctionSymbol*>(symbol))
+    {
+        return functionSymbol->definition;
+    }
+    else if (const MethodSymbol* methodSymbol = dynamic_cast<const MethodSymbol*>(symbol))
+    {
+        return methodSymbol->definition;
+    }
+    else
+    {
+        assert(false);
+    }
+}
+
+Value* TACCodeGen::getFunctionValue(const Symbol* symbol, AstNode* node, const TypeAssignment& typeAssignment)
+{
+    auto& instantiations = _functionNames[symbol];
+
+    TypeAssignment realAssignment = combine(_typeContext, typeAssignment);
+
+    for (auto& assignment : realAssignment)
+    {
+        if (!isConcrete(assignment.second))
+        {
+            assert(node);
+
+            YYLTYPE location = node->location;
+            std::stringstream ss;
+
+            ss << location.filename << ":" << location.first_line << ":" << location.first_column
+               << ": cannot infer concrete type of call to function " << symbol->name;
+
+            throw CodegenError(ss.str());
+        }
+    }
+
+    for (auto& instantiation : instantiations)
+    {
+        if (sameAssignment(instantiation.first, realAssignment))
+        {
             return instantiation.second;
         }
     }
@@ -484,6 +1217,7 @@ Value* TACCodeGen::getFunctionValue(const Symbol* symbol, AstNode* node, const T
             }
 
             result = _context->createFunction(ss.str());
+            chooseCallingConvention(result, functionSymbol, realAssignment);
 
             _functions.emplace_back(functionSymbol, realAssignment);
         }
@@ -536,6 +1270,8 @@ Value* TACCodeGen::getFunctionValue(const Symbol* symbol, AstNode* node, const T
         }
 
         result = _context->createFunction(ss.str());
+        chooseCallingConvention(result, methodSymbol, realAssignment);
+
         _functions.emplace_back(methodSymbol, realAssignment);
     }
     else
@@ -547,6 +1283,47 @@ Value* TACCodeGen::getFunctionValue(const Symbol* symbol, AstNode* node, const T
     return result;
 }
 
+// Callers have to know whether a function takes or returns values in
+// registers, so only functions which are never used as closures can. The body
+// must also build every enum it returns, or the caller would box it all over
+// again. A value struct is worth returning in registers regardless, since
+// locals and parameters hold them that way too
+void TACCodeGen::chooseCallingConvention(Function* function, const Symbol* symbol, const TypeAssignment& typeAssignment)
+{
+    FunctionDefNode* definition = getFunctionDefinition(symbol);
+    if (!definition || definition->isClosure)
+        return;
+
+    FunctionType* functionType = substitute(symbol->type, typeAssignment)->get<FunctionType>();
+
+    std::vector<ValueType> registers;
+    std::vector<Type*> unboxedParams;
+    bool anyUnboxed = false;
+    for (Type* input : functionType->inputs())
+    {
+        if (getValueStructRegisters(input, registers))
+        {
+            unboxedParams.push_back(input);
+            anyUnboxed = true;
+        }
+        else
+        {
+            unboxedParams.push_back(nullptr);
+        }
+    }
+
+    if (anyUnboxed)
+    {
+        _unboxedParams.emplace(function, unboxedParams);
+    }
+
+    Type* type = functionType->output();
+    if ((definition->returnsConstructed || getValueStructRegisters(type, registers)) && getReturnRegisters(type, registers))
+    {
+        _registerReturns.emplace(function, type);
+    }
+}
+
 Value* TACCodeGen::getTraitMethodValue(Type* objectType, const Symbol* symbol, AstNode* node, const TypeAssignment& typeAssignment)
 {
     assert(symbol->kind == kTraitMethod);
@@ -594,20 +1371,16 @@ BasicBlock* TACConditionalCodeGen::createBlock()
     return _mainCodeGen->createBlock();
 }
 
-static FunctionDefNode* getFunctionDefinition(const Symbol* symbol)
+// Returns the symbol as a constructor if it's one which has no members
+static const ConstructorSymbol* getMemberlessConstructor(const Symbol* symbol)
 {
-    if (const FunctionSymbol* functionSymbol = dynamic_cast<const FunctionSymbol*>(symbol))
-    {
-        return functionSymbol->definition;
-    }
-    else if (const MethodSymbol* methodSymbol = dynamic_cast<const MethodSymbol*>(symbol))
-    {
-        return methodSymbol->definition;
-    }
-    else
+    const ConstructorSymbol* constructorSymbol = dynamic_cast<const ConstructorSymbol*>(symbol);
+    if (constructorSymbol && constructorSymbol->constructor->members().empty())
     {
-        assert(false);
+        return constructorSymbol;
     }
+
+    return nullptr;
 }
 
 void TACCodeGen::visit(ProgramNode* node)
@@ -639,14 +1412,35 @@ void TACCodeGen::visit(ProgramNode* node)
 
             _currentFunction = function;
             _localNames.clear();
+            _unboxedLocals.clear();
             _typeContext = typeContext;
             setBlock(createBlock());
 
-            // Collect all function parameters
-            for (Symbol* param : funcDefNode->parameterSymbols)
+            // Collect all function parameters. A value struct passed as its
+            // members is a local with the parameters as its variables
+            auto unboxedParams = _unboxedParams.find(function);
+            for (size_t i = 0; i < funcDefNode->parameterSymbols.size(); ++i)
             {
+                Symbol* param = funcDefNode->parameterSymbols[i];
                 assert(dynamic_cast<VariableSymbol*>(param)->isParam);
-                _currentFunction->params.push_back(getValue(param));
+
+                Type* unboxedType = (unboxedParams != _unboxedParams.end()) ? unboxedParams->second.at(i) : nullptr;
+                if (!unboxedType)
+                {
+                    _currentFunction->params.push_back(getValue(param));
+                    continue;
+                }
+
+                std::vector<ValueType> registers;
+                getValueStructRegisters(unboxedType, registers);
+
+                std::vector<Value*>& slots = _unboxedLocals[param];
+                for (ValueType type : registers)
+                {
+                    Value* slot = _context->createArgument(type, param->name);
+                    _currentFunction->params.push_back(slot);
+                    slots.push_back(slot);
+                }
             }
 
             // Generate code for the function body
@@ -655,7 +1449,7 @@ void TACCodeGen::visit(ProgramNode* node)
             // Handle implicit return values
             if (!_currentBlock->isTerminated())
             {
-                emit(new ReturnInst(funcDefNode->body->value));
+                emitReturn(funcDefNode->body->value);
             }
         }
         else
@@ -671,6 +1465,7 @@ void TACCodeGen::visit(ProgramNode* node)
 
                 _currentFunction = function;
                 _localNames.clear();
+                _unboxedLocals.clear();
                 _typeContext = typeContext;
                 setBlock(createBlock());
 
@@ -706,6 +1501,7 @@ void TACCodeGen::visit(ProgramNode* node)
 
                 _currentFunction = function;
                 _localNames.clear();
+                _unboxedLocals.clear();
                 _typeContext = typeContext;
                 setBlock(createBlock());
 
@@ -729,18 +1525,20 @@ void TACCodeGen::visit(ProgramNode* node)
 
 void TACConditionalCodeGen::visit(ComparisonNode* node)
 {
-    Value* lhs = visitAndGet(node->lhs);
-    Value* rhs = visitAndGet(node->rhs);
-
     if (node->method)
     {
+        Value* lhs = _mainCodeGen->visitArgument(node->lhs);
+        Value* rhs = _mainCodeGen->visitArgument(node->rhs);
         Value* method = _mainCodeGen->getTraitMethodValue(node->lhs->type, node->method, node);
         Value* condition = _mainCodeGen->createTemp(ValueType::U64);
-        emit(new CallInst(condition, method, {lhs, rhs}));
+        _mainCodeGen->emitCall(condition, method, {lhs, rhs}, node);
         emit(new JumpIfInst(condition, _trueBranch, _falseBranch));
         return;
     }
 
+    Value* lhs = visitAndGet(node->lhs);
+    Value* rhs = visitAndGet(node->rhs);
+
     switch(node->op)
     {
         case ComparisonNode::kGreater:
@@ -805,17 +1603,20 @@ void TACCodeGen::visit(ComparisonNode* node)
             assert(false);
     }
 
-    Value* lhs = visitAndGet(node->lhs);
-    Value* rhs = visitAndGet(node->rhs);
     node->value = createTemp(ValueType::U64);
 
     if (node->method)
     {
+        Value* lhs = visitArgument(node->lhs);
+        Value* rhs = visitArgument(node->rhs);
         Value* method = getTraitMethodValue(node->lhs->type, node->method, node);
-        emit(new CallInst(node->value, method, {lhs, rhs}));
+        emitCall(node->value, method, {lhs, rhs}, node);
         return;
     }
 
+    Value* lhs = visitAndGet(node->lhs);
+    Value* rhs = visitAndGet(node->rhs);
+
     BasicBlock* trueBranch = createBlock();
     BasicBlock* falseBranch = createBlock();
     BasicBlock* continueAt = createBlock();
@@ -889,101 +1690,735 @@ void TACCodeGen::visit(LogicalNode* node)
         assert (false);
     }
 
-    setBlock(trueBranch);
-    emit(new JumpInst(continueAt));
+    setBlock(trueBranch);
+    emit(new JumpInst(continueAt));
+
+    setBlock(falseBranch);
+    emit(new JumpInst(continueAt));
+
+    setBlock(continueAt);
+    node->value = createTemp(ValueType::U64);
+    PhiInst* phi = new PhiInst(node->value);
+    phi->addSource(falseBranch, _context->False);
+    phi->addSource(trueBranch, _context->True);
+    emit(phi);
+
+}
+
+void TACCodeGen::visit(NullaryNode* node)
+{
+    if (node->kind == NullaryNode::VARIABLE)
+    {
+        // A value struct held in registers is only boxed where it's needed as
+        // a reference (see visitAndGetUnboxed)
+        if (std::vector<Value*>* slots = getUnboxedSlots(node->symbol))
+        {
+            node->value = createTemp(ValueType::Reference);
+
+            Type* type = getConcreteType(node->symbol->type);
+            if (node == _unboxedCall)
+            {
+                setUnboxed(node->value, loadUnboxed(*slots), type);
+            }
+            else
+            {
+                boxValue(node->value, loadUnboxed(*slots), type, node);
+            }
+
+            return;
+        }
+
+        node->value = load(node->symbol);
+    }
+    else
+    {
+        FunctionSymbol* functionSymbol = dynamic_cast<FunctionSymbol*>(node->symbol);
+
+        const ConstructorSymbol* constructorSymbol = getMemberlessConstructor(functionSymbol);
+        if (node->kind == NullaryNode::FUNC_CALL && constructorSymbol)
+        {
+            node->value = getNullaryValue(constructorSymbol, getConcreteType(node->type, node->typeAssignment));
+            return;
+        }
+
+        Value* dest = node->value = createTemp();
+
+        if (node->kind == NullaryNode::FUNC_CALL)
+        {
+            Value* fn = getFunctionValue(node->symbol, node, node->typeAssignment);
+
+            CallInst* inst = new CallInst(dest, fn);
+            inst->ccall = functionSymbol->isExternal;
+            inst->regpass = inst->ccall;
+            emitAllocatingCall(inst, functionSymbol, node);
+        }
+        else
+        {
+            assert(node->kind == NullaryNode::CLOSURE);
+
+            Value* fn = getFunctionValue(node->symbol, node, node->typeAssignment);
+            createClosure(dest, fn, node);
+        }
+
+        dest->type = getValueType(node->type, node->typeAssignment);
+    }
+}
+
+Value* TACCodeGen::getStaticInstance(const ConstructorSymbol* symbol)
+{
+    auto i = _staticInstances.find(symbol);
+    if (i != _staticInstances.end())
+    {
+        return i->second;
+    }
+
+    // The layout doesn't depend on the type parameters, so a single instance
+    // serves every instantiation. The object is only a header
+    uint64_t header = MAKE_HEADER(0) | getStructLayout(symbol->constructor->constructorTag(), 0);
+    std::vector<Value*> contents = {constant(header)};
+    Value* result = _context->createStaticObject(symbol->name + "$I", contents);
+
+    _staticInstances.emplace(symbol, result);
+    return result;
+}
+
+Value* TACCodeGen::getNullaryValue(const ConstructorSymbol* symbol, Type* type)
+{
+    uint64_t constructorTag = symbol->constructor->constructorTag();
+
+    switch (getEnumRepresentation(type))
+    {
+        case EnumRepresentation::Immediate:
+            return constant(constructorTag);
+
+        case EnumRepresentation::Tagged:
+            return _context->createConstantInt(ValueType::Reference, constructorTag);
+
+        case EnumRepresentation::Nullable:
+            return _context->createConstantInt(ValueType::Reference, 0);
+
+        case EnumRepresentation::Boxed:
+            return getStaticInstance(symbol);
+    }
+
+    assert(false);
+}
+
+// The value to test with testConstructorTag. For Nullable types, that's the
+// value itself, and the tag is implied by whether it's null
+Value* TACCodeGen::getConstructorTag(Value* value, Type* type)
+{
+    auto i = _unboxedValues.find(value);
+    if (i != _unboxedValues.end())
+    {
+        return getConcreteType(type)->valueConstructors().size() > 1 ? i->second.at(0) : constant(0);
+    }
+
+    switch (getEnumRepresentation(getConcreteType(type)))
+    {
+        case EnumRepresentation::Immediate:
+        case EnumRepresentation::Nullable:
+            return value;
+
+        case EnumRepresentation::Tagged:
+        {
+            Value* tag = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(tag, value, BinaryOperation::AND, constant(POINTER_TAG_MASK)));
+            return tag;
+        }
+
+        case EnumRepresentation::Boxed:
+        {
+            Value* header = createTemp(ValueType::U64);
+            emit(new IndexedLoadInst(header, value, _context->createConstantInt(ValueType::I64, -8)));
+            Value* shifted = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(shifted, header, BinaryOperation::SHR, constant(HEADER_CONSTRUCTOR_SHIFT)));
+            Value* tag = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(tag, shifted, BinaryOperation::AND, constant(HEADER_CONSTRUCTOR_MASK)));
+            return tag;
+        }
+    }
+
+    assert(false);
+}
+
+void TACCodeGen::testConstructorTag(Value* tag, Type* type, size_t constructorTag, BasicBlock* ifTrue, BasicBlock* ifFalse)
+{
+    type = getConcreteType(type);
+
+    // A Nullable value is its own tag, unless it's held in registers
+    ValueConstructor* null;
+    ValueConstructor* nonNull;
+    if (getEnumRepresentation(type) == EnumRepresentation::Nullable && tag->type == ValueType::Reference &&
+        getNullableConstructors(type, null, nonNull))
+    {
+        const char* op = (constructorTag == null->constructorTag()) ? "==" : "!=";
+        emit(new ConditionalJumpInst(tag, op, _context->createConstantInt(ValueType::Reference, 0), ifTrue, ifFalse));
+    }
+    else
+    {
+        emit(new ConditionalJumpInst(tag, "==", constant(constructorTag), ifTrue, ifFalse));
+    }
+}
+
+// Load a member from a value known to have been built by the given
+// constructor. A tagged pointer is off by the tag, the only member of a
+// Nullable value is the value itself, and an unboxed value is all registers
+void TACCodeGen::loadMember(Value* dest, Value* value, Type* type, size_t constructorTag, size_t index)
+{
+    Type* concreteType = getConcreteType(type);
+    ValueConstructor* constructor = concreteType->valueConstructors().at(constructorTag);
+
+    auto i = _unboxedValues.find(value);
+    if (i != _unboxedValues.end())
+    {
+        size_t count;
+        size_t first = getMemberRegisters(concreteType, constructor, index, count);
+
+        // A value struct member is left in its registers too
+        Type* memberType = getMemberType(concreteType, constructor, index);
+        std::vector<ValueType> registerTypes;
+        if (isUnboxedMember(concreteType, memberType, registerTypes))
+        {
+            std::vector<Value*> registers(i->second.begin() + first, i->second.begin() + first + count);
+            setUnboxed(dest, registers, memberType);
+        }
+        else
+        {
+            emit(new CopyInst(dest, i->second.at(first)));
+        }
+
+        return;
+    }
+
+    MemberLayout layout = getMemberLayout(concreteType, constructor);
+    int64_t offset = layout.offsets.at(index);
+
+    switch (getEnumRepresentation(concreteType))
+    {
+        case EnumRepresentation::Nullable:
+            emit(new CopyInst(dest, value));
+            return;
+
+        case EnumRepresentation::Tagged:
+            offset -= constructorTag;
+            break;
+
+        default:
+            break;
+    }
+
+    loadField(dest, value, _context->createConstantInt(ValueType::I64, offset), layout.storageTypes.at(index));
+}
+
+// Load a member stored as storageType, widening it to the type of dest
+void TACCodeGen::loadField(Value* dest, Value* object, Value* offset, ValueType storageType)
+{
+    if (storageType == dest->type)
+    {
+        emit(new IndexedLoadInst(dest, object, offset));
+    }
+    else
+    {
+        Value* narrow = createTemp(storageType);
+        emit(new IndexedLoadInst(narrow, object, offset));
+        emit(new CopyInst(dest, narrow));
+    }
+}
+
+// Store a member as storageType, narrowing it if necessary
+void TACCodeGen::storeField(Value* object, int64_t offset, Value* value, ValueType storageType)
+{
+    storeField(object, _context->createConstantInt(ValueType::I64, offset), value, storageType);
+}
+
+void TACCodeGen::storeField(Value* object, Value* offset, Value* value, ValueType storageType)
+{
+    if (storageType != value->type)
+    {
+        Value* narrow = createTemp(storageType);
+        emit(new CopyInst(narrow, value));
+        value = narrow;
+    }
+
+    emit(new IndexedStoreInst(object, offset, value));
+}
+
+// The offset in bytes of an element of an array, from the start of the array
+Value* TACCodeGen::getElementOffset(Value* index, size_t elementSize, size_t headerSize)
+{
+    Value* indexAfterHead = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(indexAfterHead, index, BinaryOperation::MUL, constant(elementSize)));
+
+    Value* indexInBytes = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(indexInBytes, indexAfterHead, BinaryOperation::ADD, constant(headerSize)));
+
+    return indexInBytes;
+}
+
+// Copy a value struct between an object and an element of a FlatArray, a word
+// at a time, whatever the types of its members
+void TACCodeGen::copyWords(Value* dest, Value* destOffset, Value* src, Value* srcOffset, size_t size, uint64_t refMask, bool needsBarrier)
+{
+    for (size_t i = 0; i < size / 8; ++i)
+    {
+        Value* from = createTemp(ValueType::U64);
+        emit(new BinaryOperationInst(from, srcOffset, BinaryOperation::ADD, constant(8 * i)));
+        Value* to = createTemp(ValueType::U64);
+        emit(new BinaryOperationInst(to, destOffset, BinaryOperation::ADD, constant(8 * i)));
+
+        bool isReference = refMask & ((uint64_t)1 << i);
+        Value* word = createTemp(isReference ? ValueType::Reference : ValueType::U64);
+        emit(new IndexedLoadInst(word, src, from));
+        emit(new IndexedStoreInst(dest, to, word));
+
+        if (needsBarrier)
+        {
+            writeBarrier(dest, word);
+        }
+    }
+}
+
+// Call a function. If it returns its result in registers, the result is boxed
+// into dest, unless the caller asks for it unboxed, in which case dest becomes
+// a placeholder for the registers (see visitAndGetUnboxed). Value structs are
+// passed as their members to the functions which take them that way, and
+// boxed for the rest
+void TACCodeGen::emitCall(Value* dest, Value* function, const std::vector<Value*>& params, AstNode* node, bool unboxed)
+{
+    std::vector<Value*> arguments;
+    auto unboxedParams = _unboxedParams.find(function);
+    for (size_t k = 0; k < params.size(); ++k)
+    {
+        Type* unboxedType = (unboxedParams != _unboxedParams.end()) ? unboxedParams->second.at(k) : nullptr;
+        if (unboxedType)
+        {
+            std::vector<Value*> members = getRegisters(params[k], unboxedType);
+            arguments.insert(arguments.end(), members.begin(), members.end());
+        }
+        else
+        {
+            arguments.push_back(box(params[k], node));
+        }
+    }
+
+    auto i = _registerReturns.find(function);
+    if (i == _registerReturns.end())
+    {
+        emit(new CallInst(dest, function, arguments));
+        return;
+    }
+
+    Type* type = i->second;
+
+    std::vector<ValueType> registerTypes;
+    getReturnRegisters(type, registerTypes);
+
+    std::vector<Value*> registers;
+    for (ValueType registerType : registerTypes)
+    {
+        registers.push_back(createTemp(registerType));
+    }
+
+    CallInst* inst = new CallInst(registers[0], function, arguments);
+    for (size_t j = 1; j < registers.size(); ++j)
+    {
+        inst->addDest(registers[j]);
+    }
+
+    emit(inst);
+
+    if (unboxed)
+    {
+        setUnboxed(dest, registers, type);
+    }
+    else
+    {
+        boxValue(dest, registers, type, node);
+    }
+}
+
+// Make a placeholder stand for the registers holding an unboxed value. It's
+// never read, but every temporary needs a definition
+void TACCodeGen::setUnboxed(Value* placeholder, const std::vector<Value*>& registers, Type* type)
+{
+    emit(new CopyInst(placeholder, registers[0]));
+    _unboxedValues.emplace(placeholder, registers);
+    _unboxedTypes.emplace(placeholder, type);
+}
+
+// Build the object for a value held in registers
+void TACCodeGen::boxValue(Value* dest, const std::vector<Value*>& registers, Type* type, AstNode* node)
+{
+    const std::vector<ValueConstructor*>& constructors = type->valueConstructors();
+    size_t firstMember = constructors.size() > 1 ? 1 : 0;
+    EnumRepresentation representation = getEnumRepresentation(type);
+
+    BasicBlock* continueAt = createBlock();
+    PhiInst* phi = new PhiInst(dest);
+
+    for (ValueConstructor* constructor : constructors)
+    {
+        size_t constructorTag = constructor->constructorTag();
+
+        BasicBlock* nextTest = nullptr;
+        if (firstMember > 0)
+        {
+            BasicBlock* isConstructor = createBlock();
+            nextTest = createBlock();
+            testConstructorTag(registers[0], type, constructorTag, isConstructor, nextTest);
+            setBlock(isConstructor);
+        }
+
+        Value* result;
+        if (constructor->members().empty())
+        {
+            assert(representation == EnumRepresentation::Tagged || representation == EnumRepresentation::Nullable);
+            result = _context->createConstantInt(ValueType::Reference, representation == EnumRepresentation::Tagged ? constructorTag : 0);
+        }
+        else
+        {
+            // Members with registers of their own are boxed first
+            std::vector<Value*> members;
+            for (size_t i = 0; i < constructor->members().size(); ++i)
+            {
+                size_t count;
+                size_t first = getMemberRegisters(type, constructor, i, count);
+
+                Type* memberType = getMemberType(type, constructor, i);
+                std::vector<ValueType> registerTypes;
+                if (isUnboxedMember(type, memberType, registerTypes))
+                {
+                    Value* member = createTemp(ValueType::Reference);
+                    boxValue(member, std::vector<Value*>(registers.begin() + first, registers.begin() + first + count), memberType, node);
+                    members.push_back(member);
+                }
+                else
+                {
+                    members.push_back(registers.at(first));
+                }
+            }
+
+            if (representation == EnumRepresentation::Nullable)
+            {
+                result = members[0];
+            }
+            else
+            {
+                MemberLayout layout = getMemberLayout(type, constructor);
+
+                Value* object = createTemp(ValueType::Reference);
+                setAllocationSite(constructor->str(), node);
+                gcAllocate(object, layout.size, getStructLayout(constructorTag, layout.refMask));
+
+                for (size_t i = 0; i < members.size(); ++i)
+                {
+                    storeField(object, layout.offsets[i], members[i], layout.storageTypes[i]);
+                }
+
+                result = object;
+                if (representation == EnumRepresentation::Tagged && constructorTag != 0)
+                {
+                    result = createTemp(ValueType::Reference);
+                    emit(new BinaryOperationInst(result, object, BinaryOperation::ADD, constant(constructorTag)));
+                }
+            }
+        }
+
+        phi->addSource(_currentBlock, result);
+        emit(new JumpInst(continueAt));
+
+        if (nextTest)
+        {
+            setBlock(nextTest);
+        }
+    }
+
+    if (firstMember > 0)
+    {
+        emit(new UnreachableInst);
+    }
+
+    setBlock(continueAt);
+    emit(phi);
+}
+
+// A placeholder for an unboxed value has to be boxed wherever a reference is
+// needed after all
+Value* TACCodeGen::box(Value* value, AstNode* node)
+{
+    auto i = _unboxedValues.find(value);
+    if (i == _unboxedValues.end())
+    {
+        return value;
+    }
+
+    Value* result = createTemp(ValueType::Reference);
+    boxValue(result, i->second, _unboxedTypes.at(value), node);
+    return result;
+}
+
+// Evaluate an expression whose value is only going to be taken apart by
+// getConstructorTag and loadMember, or kept in registers. A call to a
+// constructor, or to a function which returns its result in registers, or a
+// local value struct, then doesn't have to be boxed, and the result is only a
+// placeholder for the registers
+Value* TACCodeGen::visitAndGetUnboxed(ExpressionNode* node)
+{
+    Type* type = getConcreteType(node->type);
+
+    std::vector<ValueType> registerTypes;
+    if (!getReturnRegisters(type, registerTypes))
+    {
+        return visitAndGet(node);
+    }
+
+    const ConstructorSymbol* constructorSymbol = nullptr;
+    std::vector<ExpressionNode*> arguments;
+    if (FunctionCallNode* functionCall = dynamic_cast<FunctionCallNode*>(node))
+    {
+        constructorSymbol = dynamic_cast<const ConstructorSymbol*>(functionCall->symbol);
+        arguments = functionCall->arguments;
+    }
+    else if (NullaryNode* nullary = dynamic_cast<NullaryNode*>(node))
+    {
+        if (nullary->kind == NullaryNode::FUNC_CALL)
+            constructorSymbol = dynamic_cast<const ConstructorSymbol*>(nullary->symbol);
+    }
+
+    if (constructorSymbol)
+    {
+        size_t constructorTag = constructorSymbol->constructor->constructorTag();
+
+        std::vector<Value*> registers;
+        if (type->valueConstructors().size() > 1)
+        {
+            registers.push_back(constant(constructorTag));
+        }
+
+        ValueConstructor* constructor = type->valueConstructors().at(constructorTag);
+        for (size_t i = 0; i < arguments.size(); ++i)
+        {
+            Type* memberType = getMemberType(type, constructor, i);
+
+            std::vector<ValueType> memberRegisters;
+            if (isUnboxedMember(type, memberType, memberRegisters))
+            {
+                std::vector<Value*> members = getRegisters(visitAndGetUnboxed(arguments[i]), memberType);
+                registers.insert(registers.end(), members.begin(), members.end());
+            }
+            else
+            {
+                registers.push_back(visitAndGet(arguments[i]));
+            }
+        }
+
+        // Registers past the members of this constructor are never read
+        while (registers.size() < registerTypes.size())
+        {
+            registers.push_back(_context->createConstantInt(registerTypes[registers.size()], 0));
+        }
+
+        node->value = createTemp(ValueType::Reference);
+        setUnboxed(node->value, registers, type);
+        return node->value;
+    }
+
+    AstNode* lastUnboxedCall = _unboxedCall;
+    _unboxedCall = node;
+    node->accept(this);
+    _unboxedCall = lastUnboxedCall;
+
+    return node->value;
+}
+
+// Evaluate an argument of a call. Value structs are left unboxed, since the
+// callee may take them as their members (see emitCall)
+Value* TACCodeGen::visitArgument(ExpressionNode* node)
+{
+    std::vector<ValueType> registers;
+    if (getValueStructRegisters(getConcreteType(node->type), registers))
+    {
+        return visitAndGetUnboxed(node);
+    }
+
+    return visitAndGet(node);
+}
+
+// The registers holding a value, as a function which returns it that way
+// returns it. A value which was boxed has to be taken apart again
+std::vector<Value*> TACCodeGen::getRegisters(Value* value, Type* type)
+{
+    std::vector<ValueType> registerTypes;
+    getReturnRegisters(type, registerTypes);
+
+    auto i = _unboxedValues.find(value);
+    if (i != _unboxedValues.end())
+    {
+        return i->second;
+    }
+
+    std::vector<Value*> registers;
+    if (!value)
+    {
+        for (ValueType registerType : registerTypes)
+        {
+            registers.push_back(_context->createConstantInt(registerType, 0));
+        }
+
+        return registers;
+    }
+
+    const std::vector<ValueConstructor*>& constructors = type->valueConstructors();
+    if (constructors.size() == 1)
+    {
+        appendMemberRegisters(registers, value, type, constructors[0]);
+        return registers;
+    }
+
+    Value* tag = getConstructorTag(value, type);
+
+    BasicBlock* continueAt = createBlock();
+    std::vector<PhiInst*> phis;
+    for (ValueType registerType : registerTypes)
+    {
+        phis.push_back(new PhiInst(createTemp(registerType)));
+    }
+
+    for (ValueConstructor* constructor : constructors)
+    {
+        BasicBlock* isConstructor = createBlock();
+        BasicBlock* nextTest = createBlock();
+        testConstructorTag(tag, type, constructor->constructorTag(), isConstructor, nextTest);
+
+        setBlock(isConstructor);
+        std::vector<Value*> members = {constant(constructor->constructorTag())};
+        appendMemberRegisters(members, value, type, constructor);
+
+        for (size_t j = 0; j < phis.size(); ++j)
+        {
+            if (j < members.size())
+            {
+                phis[j]->addSource(_currentBlock, members[j]);
+            }
+            else
+            {
+                phis[j]->addSource(_currentBlock, _context->createConstantInt(registerTypes[j], 0));
+            }
+        }
+
+        emit(new JumpInst(continueAt));
+        setBlock(nextTest);
+    }
 
-    setBlock(falseBranch);
-    emit(new JumpInst(continueAt));
+    emit(new UnreachableInst);
 
     setBlock(continueAt);
-    node->value = createTemp(ValueType::U64);
-    PhiInst* phi = new PhiInst(node->value);
-    phi->addSource(falseBranch, _context->False);
-    phi->addSource(trueBranch, _context->True);
-    emit(phi);
+    for (PhiInst* phi : phis)
+    {
+        emit(phi);
+        registers.push_back(phi->dest);
+    }
 
+    return registers;
 }
 
-void TACCodeGen::visit(NullaryNode* node)
+// Load the members of a boxed value into registers, those of a value struct
+// member included
+void TACCodeGen::appendMemberRegisters(std::vector<Value*>& registers, Value* value, Type* type, ValueConstructor* constructor)
 {
-    if (node->kind == NullaryNode::VARIABLE)
-    {
-        node->value = load(node->symbol);
-    }
-    else
+    for (size_t i = 0; i < constructor->members().size(); ++i)
     {
-        FunctionSymbol* functionSymbol = dynamic_cast<FunctionSymbol*>(node->symbol);
+        Type* memberType = getMemberType(type, constructor, i);
 
-        Value* dest = node->value = createTemp();
+        std::vector<ValueType> memberRegisters;
+        bool unboxed = isUnboxedMember(type, memberType, memberRegisters);
 
-        if (node->kind == NullaryNode::FUNC_CALL)
-        {
-            Value* fn = getFunctionValue(node->symbol, node, node->typeAssignment);
+        Value* member = createTemp(unboxed ? ValueType::Reference : getRealValueType(memberType));
+        loadMember(member, value, type, constructor->constructorTag(), i);
 
-            CallInst* inst = new CallInst(dest, fn);
-            inst->ccall = functionSymbol->isExternal;
-            inst->regpass = inst->ccall;
-            emit(inst);
+        if (unboxed)
+        {
+            std::vector<Value*> members = getRegisters(member, memberType);
+            registers.insert(registers.end(), members.begin(), members.end());
         }
         else
         {
-            assert(node->kind == NullaryNode::CLOSURE);
-
-            Value* fn = getFunctionValue(node->symbol, node, node->typeAssignment);
-            createClosure(dest, fn);
+            registers.push_back(member);
         }
+    }
+}
 
-        dest->type = getValueType(node->type, node->typeAssignment);
+// Return from the current function, in registers if that's how it returns its
+// result
+void TACCodeGen::emitReturn(Value* value)
+{
+    auto i = _registerReturns.find(_currentFunction);
+    if (i == _registerReturns.end())
+    {
+        emit(new ReturnInst(value));
+        return;
     }
+
+    emit(new ReturnInst(getRegisters(value, i->second)));
 }
 
-void TACCodeGen::createClosure(Value* dest, Value* fn, const std::vector<Symbol*>& captures)
+Value* TACCodeGen::getStaticClosure(Value* fn)
 {
-    Value* env;
-    if (!captures.empty())
+    auto i = _staticClosures.find(fn);
+    if (i != _staticClosures.end())
     {
-        env = createTemp(ValueType::Reference);
+        return i->second;
+    }
 
-        gcAllocate(env, sizeof(SplObject) + 8 * captures.size());
+    // Same format as in createClosure, with a null environment
+    uint64_t header = MAKE_HEADER(2) | getStructLayout(0, 2);
+    std::vector<Value*> contents = {constant(header), fn, _context->Zero};
+    Value* result = _context->createStaticObject(fn->name + "$C", contents);
 
-        // SplObject header fields
-        emit(new IndexedStoreInst(env, constant(offsetof(SplObject, constructorTag)), _context->Zero));
+    _staticClosures.emplace(fn, result);
+    return result;
+}
 
-        uint64_t refMask = 0;
-        for (size_t i = 0; i < captures.size(); ++i)
-        {
-            Type* captureType = substitute(captures[i]->type, _typeContext);
-            if (captureType->isBoxed())
-            {
-                refMask |= (1 << i);
-            }
-        }
+void TACCodeGen::createClosure(Value* dest, Value* fn, AstNode* node, const std::vector<Symbol*>& captures)
+{
+    if (captures.empty())
+    {
+        emit(new CopyInst(dest, getStaticClosure(fn)));
+        return;
+    }
 
-        emit(new IndexedStoreInst(env, constant(offsetof(SplObject, refMask)), constant(refMask)));
+    Value* env = createTemp(ValueType::Reference);
 
-        for (size_t i = 0; i < captures.size(); ++i)
+    uint64_t refMask = 0;
+    for (size_t i = 0; i < captures.size(); ++i)
+    {
+        Type* captureType = substitute(captures[i]->type, _typeContext);
+        if (getRealValueType(captureType) == ValueType::Reference)
         {
-            Symbol* symbol = captures[i];
-
-            Value* temp = load(symbol);
-            emit(new IndexedStoreInst(env, constant(sizeof(SplObject) + 8 * i), temp));
+            refMask |= ((uint64_t)1 << i);
         }
     }
-    else
+
+    setAllocationSite("closure environment", node);
+    gcAllocate(env, 8 * captures.size(), getStructLayout(0, refMask));
+
+    for (size_t i = 0; i < captures.size(); ++i)
     {
-        env = constant(0);
+        Symbol* symbol = captures[i];
+
+        Value* temp = load(symbol);
+        emit(new IndexedStoreInst(env, constant(8 * i), temp));
     }
 
     // Closure format:
     // (offset 0) function address
     // (offset 8) pointer to environment
-    gcAllocate(dest, sizeof(SplObject) + 16);
+    setAllocationSite("closure", node);
+    gcAllocate(dest, 16, getStructLayout(0, 2));
 
-    // SplObject header fields
-    emit(new IndexedStoreInst(dest, constant(offsetof(SplObject, constructorTag)), _context->Zero));
-    emit(new IndexedStoreInst(dest, constant(offsetof(SplObject, refMask)), constant(2)));
-    emit(new IndexedStoreInst(dest, constant(sizeof(SplObject)), fn));
-    emit(new IndexedStoreInst(dest, constant(sizeof(SplObject) + 8), env));
+    emit(new IndexedStoreInst(dest, constant(0), fn));
+    emit(new IndexedStoreInst(dest, constant(8), env));
 }
 
 static void getTrivialAssignment(Type* type, TypeAssignment& result)
@@ -1038,7 +2473,7 @@ void TACCodeGen::visit(LambdaNode* node)
 
     node->value = createTemp();
     Value* fn = getFunctionValue(node->functionSymbol, node, trivialAssignment);
-    createClosure(node->value, fn, node->captures);
+    createClosure(node->value, fn, node, node->captures);
 }
 
 static bool checkIntRange(ValueType type, int64_t value)
@@ -1299,28 +2734,25 @@ void TACCodeGen::visit(ForNode* node)
 
     // Call rhs.iter()
     Value* iterator = createTemp(getValueType(iteratorType));
-    emit(new CallInst(iterator, iter, {iterable}));
+    emitCall(iterator, iter, {iterable}, node);
 
     emit(new JumpInst(loopBegin));
     setBlock(loopBegin);
 
-    // Call iter.next()
+    // Call iter.next(), whose result is only taken apart here
     Value* nextOption = createTemp(getValueType(node->optionType));
-    emit(new CallInst(nextOption, next, {iterator}));
+    emitCall(nextOption, next, {iterator}, node, true);
 
     // Check for Some tag, and otherwise exit the loop
     size_t SomeTag = node->optionType->getValueConstructor("Some").first;
-    Value* tag = createTemp(ValueType::U64);
-    Value* tagOffset = _context->createConstantInt(ValueType::I64, offsetof(SplObject, constructorTag));
-    emit(new IndexedLoadInst(tag, nextOption, tagOffset));
-    emit(new ConditionalJumpInst(tag, "==", constant(SomeTag), isSome, loopExit));
+    Value* tag = getConstructorTag(nextOption, node->optionType);
+    testConstructorTag(tag, node->optionType, SomeTag, isSome, loopExit);
 
     // Extract x from Some(x)
     setBlock(isSome);
     Value* varTemp = createTemp(getValueType(node->symbol->type));
-    Value* varOffset = constant(sizeof(SplObject));
-    emit(new IndexedLoadInst(varTemp, nextOption, varOffset));
-    store(node->symbol, varTemp);
+    loadMember(varTemp, nextOption, node->optionType, SomeTag, 0);
+    store(node->symbol, varTemp, node);
 
     // Push a new inner loop on the (implicit) stack
     BasicBlock* prevLoopExit = _currentLoopExit;
@@ -1341,13 +2773,13 @@ void TACCodeGen::visit(ForNode* node)
 
 void TACCodeGen::visit(IndexNode* node)
 {
-    Value* object = visitAndGet(node->object);
+    Value* object = visitArgument(node->object);
     Value* index = visitAndGet(node->index);
     Value* method = getTraitMethodValue(node->object->type, node->atMethod, node);
 
     node->value = createTemp(getValueType(node->type));
 
-    emit(new CallInst(node->value, method, {object, index}));
+    emitCall(node->value, method, {object, index}, node, node == _unboxedCall);
 }
 
 void TACCodeGen::visit(ForeverNode* node)
@@ -1387,7 +2819,7 @@ void TACCodeGen::visit(ContinueNode* node)
 
 void TACCodeGen::visit(AssignNode* node)
 {
-    Value* value = visitAndGet(node->rhs);
+    Value* value = visitArgument(node->rhs);
 
     TACAssignmentCodeGen assignCG(this, value);
     node->lhs->accept(&assignCG);
@@ -1398,7 +2830,7 @@ void TACAssignmentCodeGen::visit(NullaryNode* node)
     Symbol* symbol = node->symbol;
     assert(symbol->kind == kVariable);
 
-    _mainCG->store(symbol, _value);
+    _mainCG->store(symbol, _value, node);
 }
 
 void TACAssignmentCodeGen::visit(MemberAccessNode* node)
@@ -1407,9 +2839,19 @@ void TACAssignmentCodeGen::visit(MemberAccessNode* node)
 
     Value* structure = node->object->value;
 
-    uint64_t offsetInt = sizeof(SplObject) + 8 * node->memberIndex;
-    Value* offset = _mainCG->_context->createConstantInt(ValueType::U64, offsetInt);
-    _mainCG->emit(new IndexedStoreInst(structure, offset, _value));
+    std::vector<Type*> memberTypes;
+    for (auto& member : node->constructorSymbol->constructor->members())
+    {
+        memberTypes.push_back(_mainCG->getConcreteType(member.type, node->typeAssignment));
+    }
+
+    MemberLayout layout = getMemberLayout(memberTypes);
+
+    Value* value = _mainCG->box(_value, node);
+
+    size_t index = node->memberIndex;
+    _mainCG->storeField(structure, layout.offsets.at(index), value, layout.storageTypes.at(index));
+    _mainCG->writeBarrier(structure, value);
 }
 
 void TACAssignmentCodeGen::visit(IndexNode* node)
@@ -1418,7 +2860,7 @@ void TACAssignmentCodeGen::visit(IndexNode* node)
     Value* index = _mainCG->visitAndGet(node->index);
     Value* method = _mainCG->getTraitMethodValue(node->object->type, node->setMethod, node);
 
-    _mainCG->emit(new CallInst(_mainCG->createTemp(), method, {object, index, _value}));
+    _mainCG->emitCall(_mainCG->createTemp(), method, {object, index, _value}, node);
 }
 
 void TACCodeGen::visit(VariableDefNode* node)
@@ -1429,8 +2871,8 @@ void TACCodeGen::visit(VariableDefNode* node)
     }
     else
     {
-        Value* value = visitAndGet(node->rhs);
-        store(node->symbol, value);
+        Value* value = visitArgument(node->rhs);
+        store(node->symbol, value, node);
     }
 }
 
@@ -1445,9 +2887,8 @@ void TACCodeGen::letHelper(LetNode* node, Value* rhs)
             ValueType type = getValueType(member->type);
 
             Value* tmp = createTemp(type);
-            Value* offset = _context->createConstantInt(ValueType::I64, sizeof(SplObject) + 8 * i);
-            emit(new IndexedLoadInst(tmp, rhs, offset));
-            store(member, tmp);
+            loadMember(tmp, rhs, node->body->type, node->valueConstructor->constructorTag(), i);
+            store(member, tmp, node);
         }
     }
 }
@@ -1456,17 +2897,14 @@ void TACConditionalCodeGen::visit(LetNode* node)
 {
     assert(node->isExpression);
 
-    Value* rhs = visitAndGet(node->body);
-
-    Value* tag = _mainCodeGen->createTemp(ValueType::U64);
-    Value* offset = _context->createConstantInt(ValueType::I64, offsetof(SplObject, constructorTag));
-    emit(new IndexedLoadInst(tag, rhs, offset));
+    Value* rhs = _mainCodeGen->visitAndGetUnboxed(node->body);
+    Value* tag = _mainCodeGen->getConstructorTag(rhs, node->body->type);
 
     ValueConstructor* constructor = node->valueConstructor;
     size_t expectedTag = constructor->constructorTag();
 
     BasicBlock* setupBranch = createBlock();
-    emit(new ConditionalJumpInst(tag, "==", _context->createConstantInt(ValueType::U64, expectedTag), setupBranch, _falseBranch));
+    _mainCodeGen->testConstructorTag(tag, node->body->type, expectedTag, setupBranch, _falseBranch);
 
     setBlock(setupBranch);
     _mainCodeGen->letHelper(node, rhs);
@@ -1477,7 +2915,7 @@ void TACCodeGen::visit(LetNode* node)
 {
     assert(!node->isExpression);
 
-    Value* rhs = visitAndGet(node->body);
+    Value* rhs = visitAndGetUnboxed(node->body);
     letHelper(node, rhs);
 }
 
@@ -1501,8 +2939,7 @@ void TACCodeGen::visit(FunctionCallNode* node)
     std::vector<Value*> arguments;
     for (auto& i : node->arguments)
     {
-        i->accept(this);
-        arguments.push_back(i->value);
+        arguments.push_back(visitArgument(i));
     }
 
     if (node->symbol->kind == kFunction && dynamic_cast<FunctionSymbol*>(node->symbol)->isBuiltin)
@@ -1542,9 +2979,39 @@ void TACCodeGen::visit(FunctionCallNode* node)
 
             Value* array = arguments[0];
             Value* offset = _context->createConstantInt(ValueType::I64, offsetof(Array, numElements));
-            emit(new IndexedLoadInst(node->value, array, offset));
 
-            node->value->type = ValueType::U64;
+            ConstructedType* arrayType = node->arguments[0]->type->get<ConstructedType>();
+            assert(arrayType->name() == "Array");
+            if (!mayBeShortString(arrayType))
+            {
+                emit(new IndexedLoadInst(node->value, array, offset));
+                return;
+            }
+
+            BasicBlock* shortString = createBlock();
+            BasicBlock* arrayString = createBlock();
+            BasicBlock* continueAt = createBlock();
+            testShortString(array, shortString, arrayString);
+
+            setBlock(shortString);
+            Value* bits = createTemp(ValueType::U64);
+            emit(new CopyInst(bits, array));
+            Value* shifted = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(shifted, bits, BinaryOperation::SHR, constant(SHORT_STRING_LENGTH_SHIFT)));
+            Value* shortLength = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(shortLength, shifted, BinaryOperation::AND, constant(SHORT_STRING_LENGTH_MASK)));
+            emit(new JumpInst(continueAt));
+
+            setBlock(arrayString);
+            Value* arrayLength = createTemp(ValueType::U64);
+            emit(new IndexedLoadInst(arrayLength, array, offset));
+            emit(new JumpInst(continueAt));
+
+            setBlock(continueAt);
+            PhiInst* phi = new PhiInst(node->value);
+            phi->addSource(shortString, shortLength);
+            phi->addSource(arrayString, arrayLength);
+            emit(phi);
             return;
         }
         else if (node->target == "unsafeArrayAt")
@@ -1560,18 +3027,81 @@ void TACCodeGen::visit(FunctionCallNode* node)
             ConstructedType* arrayType = node->arguments[0]->type->get<ConstructedType>();
             assert(arrayType->name() == "Array");
             assert(arrayType->typeParameters().size() == 1);
-            ValueType eltType = getValueType(arrayType->typeParameters()[0]);
+            Type* elementType = getConcreteType(arrayType->typeParameters()[0]);
+
+            ValueConstructor* constructor;
+            MemberLayout layout;
+            std::vector<ValueType> registerTypes;
+            if (getFlatElement(elementType, constructor, layout) && node == _unboxedCall &&
+                getValueStructRegisters(elementType, registerTypes))
+            {
+                // Only the members are loaded, if the element is kept unboxed
+                Value* offset = getElementOffset(index, layout.size, sizeof(FlatArray));
 
-            Value* indexAfterHead = createTemp(ValueType::U64);
-            Value* bytesPerElt = constant(getSize(eltType) / 8);
-            emit(new BinaryOperationInst(indexAfterHead, index, BinaryOperation::MUL, bytesPerElt));
+                std::vector<Value*> registers;
+                for (size_t i = 0; i < registerTypes.size(); ++i)
+                {
+                    Value* memberOffset = createTemp(ValueType::U64);
+                    emit(new BinaryOperationInst(memberOffset, offset, BinaryOperation::ADD, constant(layout.offsets[i])));
+
+                    Value* member = createTemp(registerTypes[i]);
+                    loadField(member, array, memberOffset, layout.storageTypes[i]);
+                    registers.push_back(member);
+                }
+
+                node->value->type = ValueType::Reference;
+                setUnboxed(node->value, registers, elementType);
+                return;
+            }
+            else if (getFlatElement(elementType, constructor, layout))
+            {
+                // The element has to be copied out into an object of its own
+                node->value->type = ValueType::Reference;
+                setDefaultAllocationSite(constructor->str(), node);
+                gcAllocate(node->value, layout.size, getStructLayout(constructor->constructorTag(), layout.refMask));
+
+                Value* offset = getElementOffset(index, layout.size, sizeof(FlatArray));
+                copyWords(node->value, constant(0), array, offset, layout.size, layout.refMask, false);
+                return;
+            }
 
-            Value* indexInBytes = createTemp(ValueType::U64);
-            Value* sizeOfHeader = constant(sizeof(Array));
-            emit(new BinaryOperationInst(indexInBytes, indexAfterHead, BinaryOperation::ADD, sizeOfHeader));
+            ValueType eltType = getRealValueType(elementType);
+            Value* indexInBytes = getElementOffset(index, getSize(eltType) / 8, sizeof(Array));
 
-            emit(new IndexedLoadInst(node->value, array, indexInBytes));
             node->value->type = getValueType(node->type);
+            if (!mayBeShortString(arrayType))
+            {
+                emit(new IndexedLoadInst(node->value, array, indexInBytes));
+                return;
+            }
+
+            // The bytes of a short string are stored from the low end
+            BasicBlock* shortString = createBlock();
+            BasicBlock* arrayString = createBlock();
+            BasicBlock* continueAt = createBlock();
+            testShortString(array, shortString, arrayString);
+
+            setBlock(shortString);
+            Value* bits = createTemp(ValueType::U64);
+            emit(new CopyInst(bits, array));
+            Value* shift = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(shift, index, BinaryOperation::SHL, constant(3)));
+            Value* shifted = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(shifted, bits, BinaryOperation::SHR, shift));
+            Value* shortChar = createTemp(node->value->type);
+            emit(new CopyInst(shortChar, shifted));
+            emit(new JumpInst(continueAt));
+
+            setBlock(arrayString);
+            Value* arrayChar = createTemp(node->value->type);
+            emit(new IndexedLoadInst(arrayChar, array, indexInBytes));
+            emit(new JumpInst(continueAt));
+
+            setBlock(continueAt);
+            PhiInst* phi = new PhiInst(node->value);
+            phi->addSource(shortString, shortChar);
+            phi->addSource(arrayString, arrayChar);
+            emit(phi);
             return;
         }
         else if (node->target == "unsafeArraySet")
@@ -1586,56 +3116,155 @@ void TACCodeGen::visit(FunctionCallNode* node)
             ConstructedType* arrayType = node->arguments[0]->type->get<ConstructedType>();
             assert(arrayType->name() == "Array");
             assert(arrayType->typeParameters().size() == 1);
-            ValueType eltType = getValueType(arrayType->typeParameters()[0]);
+            Type* elementType = getConcreteType(arrayType->typeParameters()[0]);
+
+            ValueConstructor* constructor;
+            MemberLayout layout;
+            if (getFlatElement(elementType, constructor, layout))
+            {
+                Value* offset = getElementOffset(index, layout.size, sizeof(FlatArray));
+
+                // An unboxed element is stored a member at a time
+                auto i = _unboxedValues.find(value);
+                if (i != _unboxedValues.end())
+                {
+                    for (size_t j = 0; j < layout.offsets.size(); ++j)
+                    {
+                        Value* memberOffset = createTemp(ValueType::U64);
+                        emit(new BinaryOperationInst(memberOffset, offset, BinaryOperation::ADD, constant(layout.offsets[j])));
+
+                        Value* member = i->second.at(j);
+                        storeField(array, memberOffset, member, layout.storageTypes[j]);
+                        writeBarrier(array, member);
+                    }
+
+                    return;
+                }
+
+                copyWords(array, offset, value, constant(0), layout.size, layout.refMask, true);
+                return;
+            }
+
+            value = box(value, node);
+
+            if (mayBeShortString(arrayType))
+            {
+                BasicBlock* shortString = createBlock();
+                BasicBlock* arrayString = createBlock();
+                testShortString(array, shortString, arrayString);
 
-            Value* indexAfterHead = createTemp(ValueType::U64);
-            Value* bytesPerElt = constant(getSize(eltType) / 8);
-            emit(new BinaryOperationInst(indexAfterHead, index, BinaryOperation::MUL, bytesPerElt));
+                setBlock(shortString);
+                CallInst* callInst = new CallInst(createTemp(ValueType::U64), _shortStringModified, {});
+                callInst->regpass = true;
+                emit(callInst);
+                emit(new UnreachableInst);
 
-            Value* indexInBytes = createTemp(ValueType::U64);
-            Value* sizeOfHeader = constant(sizeof(Array));
-            emit(new BinaryOperationInst(indexInBytes, indexAfterHead, BinaryOperation::ADD, sizeOfHeader));
+                setBlock(arrayString);
+            }
+
+            ValueType eltType = getRealValueType(elementType);
+            Value* indexInBytes = getElementOffset(index, getSize(eltType) / 8, sizeof(Array));
 
             emit(new IndexedStoreInst(array, indexInBytes, value));
+            writeBarrier(array, value);
+            return;
+        }
+        else if (node->target == "packShortStrings")
+        {
+            assert(arguments.empty());
+
+            node->value = _packShortStrings ? _context->True : _context->False;
+            return;
+        }
+        else if (node->target == "unsafeShortString")
+        {
+            assert(arguments.size() == 2);
+
+            // bytes | ((length | tag) << SHORT_STRING_LENGTH_SHIFT)
+            Value* bytes = arguments[0];
+            Value* length = arguments[1];
+
+            Value* tagged = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(tagged, length, BinaryOperation::ADD, constant(1 << (SHORT_STRING_TAG_BIT - SHORT_STRING_LENGTH_SHIFT))));
+            Value* shifted = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(shifted, tagged, BinaryOperation::SHL, constant(SHORT_STRING_LENGTH_SHIFT)));
+            Value* bits = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(bits, shifted, BinaryOperation::ADD, bytes));
+
+            node->value = createTemp(ValueType::Reference);
+            emit(new CopyInst(node->value, bits));
             return;
         }
     }
 
+    if (const ConstructorSymbol* constructorSymbol = getMemberlessConstructor(node->symbol))
+    {
+        node->value = getNullaryValue(constructorSymbol, getConcreteType(node->type));
+        return;
+    }
+
+    // The non-null constructor of a Nullable type is the identity function
+    if (dynamic_cast<const ConstructorSymbol*>(node->symbol) &&
+        getEnumRepresentation(getConcreteType(node->type)) == EnumRepresentation::Nullable)
+    {
+        assert(arguments.size() == 1);
+        node->value = box(arguments[0], node);
+        return;
+    }
+
     node->value = createTemp();
     Value* result = node->value;
 
     if (node->symbol->kind == kFunction)
     {
         Value* fn = getFunctionValue(node->symbol, node, node->typeAssignment);
-        CallInst* inst = new CallInst(result, fn, arguments);
 
         FunctionSymbol* functionSymbol = dynamic_cast<FunctionSymbol*>(node->symbol);
-        inst->ccall = functionSymbol->isExternal;
-        inst->regpass = inst->ccall;
-        emit(inst);
+        if (_registerReturns.count(fn) || _unboxedParams.count(fn))
+        {
+            emitCall(result, fn, arguments, node, node == _unboxedCall);
+        }
+        else
+        {
+            // Constructors and external functions take everything boxed
+            for (Value*& argument : arguments)
+            {
+                argument = box(argument, node);
+            }
+
+            CallInst* inst = new CallInst(result, fn, arguments);
+            inst->ccall = functionSymbol->isExternal;
+            inst->regpass = inst->ccall;
+            emitAllocatingCall(inst, functionSymbol, node);
+        }
     }
     else if (node->symbol->kind == kMethod)
     {
         // Methods can't be ccall or regpass
         Value* fn = getFunctionValue(node->symbol, node, node->typeAssignment);
-        emit(new CallInst(result, fn, arguments));
+        emitCall(result, fn, arguments, node, node == _unboxedCall);
     }
     else if (node->symbol->kind == kTraitMethod)
     {
         // Static trait method
         Value* method = getTraitMethodValue(node->typeName->type, node->symbol, node, node->typeAssignment);
-        emit(new CallInst(result, method, arguments));
+        emitCall(result, method, arguments, node, node == _unboxedCall);
     }
     else /* node->symbol->kind == kVariable */
     {
+        for (Value*& argument : arguments)
+        {
+            argument = box(argument, node);
+        }
+
         // The variable represents a closure
         Value* closure = load(node->symbol);
 
         Value* fn = createTemp(ValueType::NonHeapAddress);
-        emit(new IndexedLoadInst(fn, closure, constant(sizeof(SplObject))));
+        emit(new IndexedLoadInst(fn, closure, constant(0)));
 
         Value* env = createTemp(ValueType::Reference);
-        emit(new IndexedLoadInst(env, closure, constant(sizeof(SplObject) + 8)));
+        emit(new IndexedLoadInst(env, closure, constant(8)));
 
         arguments.push_back(env);
 
@@ -1648,18 +3277,21 @@ void TACCodeGen::visit(FunctionCallNode* node)
 
 void TACCodeGen::visit(BinopNode* node)
 {
-    Value* lhs = visitAndGet(node->lhs);
-    Value* rhs = visitAndGet(node->rhs);
     node->value = createTemp(getValueType(node->type));
 
     // Overloaded operators
     if (node->method)
     {
+        Value* lhs = visitArgument(node->lhs);
+        Value* rhs = visitArgument(node->rhs);
         Value* method = getTraitMethodValue(node->lhs->type, node->method, node);
-        emit(new CallInst(node->value, method, {lhs, rhs}));
+        emitCall(node->value, method, {lhs, rhs}, node);
         return;
     }
 
+    Value* lhs = visitAndGet(node->lhs);
+    Value* rhs = visitAndGet(node->rhs);
+
     // Otherwise, built-in numerical operator
 
     switch(node->op)
@@ -1701,13 +3333,11 @@ void TACCodeGen::visit(MethodCallNode* node)
     std::vector<Value*> arguments;
 
     // Target object is implicitly the first argument
-    node->object->accept(this);
-    arguments.push_back(node->object->value);
+    arguments.push_back(visitArgument(node->object));
 
     for (auto& i : node->arguments)
     {
-        i->accept(this);
-        arguments.push_back(i->value);
+        arguments.push_back(visitArgument(i));
     }
 
     node->value = createTemp();
@@ -1715,12 +3345,12 @@ void TACCodeGen::visit(MethodCallNode* node)
     if (node->symbol->kind == kMethod)
     {
         Value* method = getFunctionValue(node->symbol, node, node->typeAssignment);
-        emit(new CallInst(node->value, method, arguments));
+        emitCall(node->value, method, arguments, node, node == _unboxedCall);
     }
     else if (node->symbol->kind == kTraitMethod)
     {
         Value* method = getTraitMethodValue(node->object->type, node->symbol, node, node->typeAssignment);
-        emit(new CallInst(node->value, method, arguments));
+        emitCall(node->value, method, arguments, node, node == _unboxedCall);
     }
 
     node->value->type = getValueType(node->type);
@@ -1728,23 +3358,151 @@ void TACCodeGen::visit(MethodCallNode* node)
 
 void TACCodeGen::visit(ReturnNode* node)
 {
-    Value* result = node->expression ? visitAndGet(node->expression) : nullptr;
-    emit(new ReturnInst(result));
+    Value* result = nullptr;
+    if (node->expression)
+    {
+        // The result doesn't need boxing if it's returned in registers
+        if (_registerReturns.count(_currentFunction))
+        {
+            result = visitAndGetUnboxed(node->expression);
+        }
+        else
+        {
+            result = visitAndGet(node->expression);
+        }
+    }
+
+    emitReturn(result);
 }
 
 void TACCodeGen::visit(MemberAccessNode* node)
 {
     node->value = createTemp(getValueType(node->type));
 
+    IndexNode* indexNode = dynamic_cast<IndexNode*>(node->object);
+    if (indexNode && loadElementMember(node, indexNode))
+    {
+        return;
+    }
+
+    // A member of a value struct held in registers is just one of them
+    Type* objectType = getConcreteType(node->object->type);
+    std::vector<ValueType> registerTypes;
+    if (getValueStructRegisters(objectType, registerTypes))
+    {
+        Value* object = visitAndGetUnboxed(node->object);
+        loadMember(node->value, object, objectType, 0, node->memberIndex);
+        return;
+    }
+
     node->object->accept(this);
 
     Value* structure = node->object->value;
-    Value* offset = _context->createConstantInt(ValueType::I64, sizeof(SplObject) + 8 * node->memberIndex);
-    emit(new IndexedLoadInst(node->value, structure, offset));
+
+    std::vector<Type*> memberTypes;
+    for (auto& member : node->constructorSymbol->constructor->members())
+    {
+        memberTypes.push_back(getConcreteType(member.type, node->typeAssignment));
+    }
+
+    MemberLayout layout = getMemberLayout(memberTypes);
+
+    size_t index = node->memberIndex;
+    loadField(node->value, structure, _context->createConstantInt(ValueType::I64, layout.offsets.at(index)), layout.storageTypes.at(index));
+}
+
+// Load a member of an element of an Array or Vector of a value struct in place,
+// instead of copying the element out of the FlatArray first. An out-of-range
+// index goes through the Index method as usual, which fails
+bool TACCodeGen::loadElementMember(MemberAccessNode* node, IndexNode* indexNode)
+{
+    Type* containerType = getConcreteType(indexNode->object->type);
+    ConstructedType* constructedType = containerType->get<ConstructedType>();
+    if (!constructedType || constructedType->typeParameters().size() != 1)
+        return false;
+
+    bool isVector = constructedType->name() == "Vector";
+    if (constructedType->name() != "Array" && !isVector)
+        return false;
+
+    Type* indexType = getConcreteType(indexNode->index->type);
+    if (!indexType->equals(indexType->table()->UInt))
+        return false;
+
+    ValueConstructor* constructor;
+    MemberLayout layout;
+    if (!getFlatElement(getConcreteType(constructedType->typeParameters()[0]), constructor, layout))
+        return false;
+
+    Value* object = visitAndGet(indexNode->object);
+    Value* index = visitAndGet(indexNode->index);
+
+    // The elements of a Vector are in its content array (see lib/core.enc)
+    Value* array = object;
+    if (isVector)
+    {
+        ValueConstructor* vectorConstructor = containerType->valueConstructors().at(0);
+        MemberLayout vectorLayout = getMemberLayout(containerType, vectorConstructor);
+
+        size_t content = 0;
+        while (vectorConstructor->members().at(content).name != "content")
+            ++content;
+
+        array = createTemp(ValueType::Reference);
+        loadField(array, object, constant(vectorLayout.offsets.at(content)), ValueType::Reference);
+    }
+
+    size_t memberOffset = layout.offsets.at(node->memberIndex);
+    ValueType storageType = layout.storageTypes.at(node->memberIndex);
+
+    BasicBlock* inRange = createBlock();
+    BasicBlock* outOfRange = createBlock();
+    BasicBlock* continueAt = createBlock();
+
+    Value* length = createTemp(ValueType::U64);
+    emit(new IndexedLoadInst(length, array, constant(offsetof(FlatArray, numElements))));
+    emit(new ConditionalJumpInst(index, "<", length, inRange, outOfRange));
+
+    setBlock(inRange);
+    Value* elementOffset = getElementOffset(index, layout.size, sizeof(FlatArray));
+    Value* offset = createTemp(ValueType::U64);
+    emit(new BinaryOperationInst(offset, elementOffset, BinaryOperation::ADD, constant(memberOffset)));
+    Value* inRangeValue = createTemp(node->value->type);
+    loadField(inRangeValue, array, offset, storageType);
+    emit(new JumpInst(continueAt));
+
+    setBlock(outOfRange);
+    Value* method = getTraitMethodValue(indexNode->object->type, indexNode->atMethod, indexNode);
+    Value* element = createTemp(ValueType::Reference);
+    emitCall(element, method, {object, index}, indexNode);
+    Value* outOfRangeValue = createTemp(node->value->type);
+    loadField(outOfRangeValue, element, constant(memberOffset), storageType);
+    BasicBlock* outOfRangeEnd = _currentBlock;
+    emit(new JumpInst(continueAt));
+
+    setBlock(continueAt);
+    PhiInst* phi = new PhiInst(node->value);
+    phi->addSource(inRange, inRangeValue);
+    phi->addSource(outOfRangeEnd, outOfRangeValue);
+    emit(phi);
+
+    return true;
 }
 
 void TACCodeGen::visit(EnumDeclaration* node)
 {
+    // The constructor tag has to fit in the object header
+    if (node->constructorSymbols.size() > HEADER_CONSTRUCTOR_MASK + 1)
+    {
+        YYLTYPE location = node->location;
+        std::stringstream ss;
+
+        ss << location.filename << ":" << location.first_line << ":" << location.first_column
+           << ": enum `" << node->name << "` cannot have more than " << HEADER_CONSTRUCTOR_MASK + 1 << " constructors";
+
+        throw CodegenError(ss.str());
+    }
+
     for (ConstructorSymbol* symbol : node->constructorSymbols)
     {
         _constructors.push_back(symbol);
@@ -1765,13 +3523,8 @@ void TACCodeGen::visit(MatchNode* node)
     }
     BasicBlock* continueAt = createBlock();
 
-    Value* expr = visitAndGet(node->expr);
-
-    // TODO: Handle case where all constructors are parameter-less
-
-    Value* tag = createTemp(ValueType::U64);
-    Value* offset = _context->createConstantInt(ValueType::I64, offsetof(SplObject, constructorTag));
-    emit(new IndexedLoadInst(tag, expr, offset));
+    Value* expr = visitAndGetUnboxed(node->expr);
+    Value* tag = getConstructorTag(expr, node->expr->type);
 
     // Jump to the appropriate case based on the tag
     BasicBlock* nextTest = _currentBlock;
@@ -1786,7 +3539,7 @@ void TACCodeGen::visit(MatchNode* node)
 
         setBlock(nextTest);
         nextTest = createBlock();
-        emit(new ConditionalJumpInst(tag, "==", constant(armTag), block, nextTest));
+        testConstructorTag(tag, node->expr->type, armTag, block, nextTest);
     }
 
     setBlock(nextTest);
@@ -1802,7 +3555,9 @@ void TACCodeGen::visit(MatchNode* node)
 
     // Individual arms
     Value* lastSwitchExpr = _currentSwitchExpr;
+    Type* lastSwitchType = _currentSwitchType;
     _currentSwitchExpr = expr;
+    _currentSwitchType = node->expr->type;
     bool canReach = false;
     for (auto& item : caseLabels)
     {
@@ -1820,6 +3575,7 @@ void TACCodeGen::visit(MatchNode* node)
     }
 
     _currentSwitchExpr = lastSwitchExpr;
+    _currentSwitchType = lastSwitchType;
 
     setBlock(continueAt);
     if (!canReach)
@@ -1841,9 +3597,8 @@ void TACCodeGen::visit(MatchArm* node)
             if (member)
             {
                 Value* tmp = createTemp(getValueType(member->type));
-                Value* offset = _context->createConstantInt(ValueType::I64, sizeof(SplObject) + 8 * i);
-                emit(new IndexedLoadInst(tmp, _currentSwitchExpr, offset));
-                store(member, tmp);
+                loadMember(tmp, _currentSwitchExpr, _currentSwitchType, constructor->constructorTag(), i);
+                store(member, tmp, node);
             }
         }
     }
@@ -1853,6 +3608,20 @@ void TACCodeGen::visit(MatchArm* node)
 
 void TACCodeGen::visit(StringLiteralNode* node)
 {
+    // Short literals are packed into the reference, with no static data
+    const std::string& content = node->content;
+    if (_packShortStrings && content.size() <= SHORT_STRING_MAX)
+    {
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < content.size(); ++i)
+        {
+            bytes |= uint64_t(uint8_t(content[i])) << (8 * i);
+        }
+
+        node->value = _context->createConstantInt(ValueType::Reference, (int64_t)MAKE_SHORT_STRING(bytes, content.size()));
+        return;
+    }
+
     node->value = getValue(node->symbol);
 }
 
@@ -1862,19 +3631,42 @@ void TACCodeGen::createConstructor(const ConstructorSymbol* symbol, const TypeAs
     const std::vector<ValueConstructor::MemberDesc> members = constructor->members();
     size_t constructorTag = constructor->constructorTag();
 
-    Value* result = createTemp(ValueType::Reference);
+    Type* type = getConcreteType(symbol->type->get<FunctionType>()->output(), typeAssignment);
+    EnumRepresentation representation = getEnumRepresentation(type);
 
-    // For now, every member takes up exactly 8 bytes (either directly or as a pointer).
-    size_t size = sizeof(SplObject) + 8 * members.size();
-    gcAllocate(result, size);
+    // Only reached when the constructor is used as a function value
+    if (members.empty())
+    {
+        emit(new ReturnInst(getNullaryValue(symbol, type)));
+        return;
+    }
+    else if (representation == EnumRepresentation::Nullable)
+    {
+        Value* param = _context->createArgument(ValueType::Reference, members[0].name);
+        _currentFunction->params.push_back(param);
 
-    //// Fill in the members with the constructor arguments
+        Value* temp = createTemp(ValueType::Reference);
+        emit(new LoadInst(temp, param));
+        emit(new ReturnInst(temp));
+        return;
+    }
+
+    Value* result = createTemp(ValueType::Reference);
 
-    // SplObject header fields
-    uint64_t refMask = getConstructorLayout(symbol, nullptr, typeAssignment);
+    // The members are packed as described by getMemberLayout. The constructor
+    // tag and the reference bitmap go in the header
+    std::vector<Type*> memberTypes;
+    for (auto& member : members)
+    {
+        memberTypes.push_back(substitute(member.type, typeAssignment));
+    }
 
-    emit(new IndexedStoreInst(result, constant(offsetof(SplObject, constructorTag)), constant(constructorTag)));
-    emit(new IndexedStoreInst(result, constant(offsetof(SplObject, refMask)), constant(refMask)));
+    MemberLayout memberLayout = getMemberLayout(memberTypes);
+    uint64_t layout = getConstructorLayout(symbol, nullptr, typeAssignment);
+    setDefaultAllocationSite(symbol->name, symbol->node);
+    gcAllocate(result, memberLayout.size, layout);
+
+    //// Fill in the members with the constructor arguments
 
     // Individual members
     for (size_t i = 0; i < members.size(); ++i)
@@ -1887,9 +3679,16 @@ void TACCodeGen::createConstructor(const ConstructorSymbol* symbol, const TypeAs
         Value* param = _context->createArgument(getValueType(member.type, typeAssignment), name);
         _currentFunction->params.push_back(param);
 
-        Value* temp = createTemp(getValueType(substitute(member.type, typeAssignment)));
+        Value* temp = createTemp(getValueType(memberTypes[i]));
         emit(new LoadInst(temp, param));
-        emit(new IndexedStoreInst(result, constant(sizeof(SplObject) + 8 * i), temp));
+        storeField(result, memberLayout.offsets[i], temp, memberLayout.storageTypes[i]);
+    }
+
+    if (representation == EnumRepresentation::Tagged && constructorTag != 0)
+    {
+        Value* tagged = createTemp(ValueType::Reference);
+        emit(new BinaryOperationInst(tagged, result, BinaryOperation::ADD, constant(constructorTag)));
+        result = tagged;
     }
 
     emit(new ReturnInst(result));
@@ -1913,40 +3712,62 @@ void TACCodeGen::makeArray(Type* functionType, bool zero)
     ConstructedType* arrayType = resultType->get<ConstructedType>();
     assert(arrayType->name() == "Array");
     assert(arrayType->typeParameters().size() == 1);
-    ValueType eltType = getValueType(arrayType->typeParameters()[0]);
+    Type* elementType = getConcreteType(arrayType->typeParameters()[0]);
+
+    // Elements of a FlatArray are filled in a word at a time
+    ValueConstructor* constructor;
+    MemberLayout layout;
+    bool isFlat = getFlatElement(elementType, constructor, layout);
+
+    ValueType eltType = isFlat ? ValueType::U64 : getRealValueType(elementType);
+    size_t wordsPerElt = isFlat ? layout.size / 8 : 1;
+    size_t headerSize = isFlat ? sizeof(FlatArray) : sizeof(Array);
 
     Value* sizeAfterHead = createTemp(ValueType::U64);
-    Value* bytesPerElt = constant(getSize(eltType) / 8);
+    Value* bytesPerElt = constant(wordsPerElt * getSize(eltType) / 8);
     Value* tempSize = createTemp(ValueType::U64);
     emit(new LoadInst(tempSize, size));
     emit(new BinaryOperationInst(sizeAfterHead, tempSize, BinaryOperation::MUL, bytesPerElt));
     Value* sizeInBytes = createTemp(ValueType::U64);
-    Value* sizeOfHeader = constant(sizeof(SplObject));
+    Value* sizeOfHeader = constant(headerSize);
     emit(new BinaryOperationInst(sizeInBytes, sizeAfterHead, BinaryOperation::ADD, sizeOfHeader));
 
+    uint64_t kind = eltType == ValueType::Reference ? HEADER_BOXED_ARRAY : HEADER_UNBOXED_ARRAY;
+    if (isFlat && layout.refMask != 0)
+    {
+        kind = HEADER_FLAT_ARRAY;
+    }
+
     // Allocate room for the object
     Value* result = createTemp(ValueType::Reference);
-    gcAllocate(result, sizeInBytes);
-
-    // Fill in the header information
-    uint64_t constructorTag = eltType == ValueType::Reference ? BOXED_ARRAY_TAG : UNBOXED_ARRAY_TAG;
-
-    emit(new IndexedStoreInst(
-        result,
-        constant(offsetof(Array, constructorTag)),
-        constant(constructorTag)));
+    setDefaultAllocationSite("Array", nullptr);
+    gcAllocate(result, sizeInBytes, kind);
 
     emit(new IndexedStoreInst(result,
         constant(offsetof(Array, numElements)),
         tempSize));
 
+    if (isFlat)
+    {
+        // The references of an element come first (see getMemberLayout)
+        uint64_t elementLayout = MAKE_ELEMENT_LAYOUT(wordsPerElt, __builtin_popcountll(layout.refMask));
+        emit(new IndexedStoreInst(result, constant(offsetof(FlatArray, elementLayout)), constant(elementLayout)));
+    }
+
     // Zero out all elements
     if (zero)
     {
+        Value* count = tempSize;
+        if (wordsPerElt != 1)
+        {
+            count = createTemp(ValueType::U64);
+            emit(new BinaryOperationInst(count, tempSize, BinaryOperation::MUL, constant(wordsPerElt)));
+        }
+
         emit(new MemsetFn(
             result,
             sizeOfHeader,
-            tempSize,
+            count,
             _context->createConstantInt(eltType, 0)));
     }
 
@@ -103,7 +103,7 @@ private:
 class TACCodeGen : public AstVisitor
 {
 public:
-    TACCodeGen(TACContext* context);
+    TACCodeGen(TACContext* context, bool profileAllocations = false);
 
     void codeGen(AstContext* astContext);
 
@@ -161,7 +161,13 @@ private:
     std::unordered_map<const Symbol*, std::vector<std::pair<TypeAssignment, Function*>>> _functionNames;
 
     Value* load(const Symbol* symbol);
-    void store(const Symbol* symbol, Value* src);
+    void store(const Symbol* symbol, Value* src, AstNode* node = nullptr);
+
+    // Local variables of small value structs hold each member in a variable of
+    // its own, instead of a reference to a box
+    std::unordered_map<const Symbol*, std::vector<Value*>> _unboxedLocals;
+    std::vector<Value*>* getUnboxedSlots(const Symbol* symbol);
+    std::vector<Value*> loadUnboxed(const std::vector<Value*>& slots);
 
     Value* getValue(const Symbol* symbol);
     Value* getFunctionValue(const Symbol* symbol, AstNode* node, const TypeAssignment& typeAssignment = {});
@@ -170,8 +176,12 @@ private:
     Type* getConcreteType(Type* type, const TypeAssignment& typeAssignment = {});
     ValueType getValueType(Type* type, const TypeAssignment& typeAssignment = {});
 
+    // Constructors and closures write their layout into the object header.
+    // Bitmaps too wide for the header are indices into _context->typeDescriptors
     std::unordered_map<Function*, uint64_t> _constructorLayouts;
+    std::unordered_map<uint64_t, uint64_t> _typeDescriptors;
     uint64_t getConstructorLayout(const ConstructorSymbol* symbol, AstNode* node, const TypeAssignment& typeAssignment = {});
+    uint64_t getStructLayout(uint64_t constructorTag, uint64_t refMask);
 
     // The entry / exit labels of the current loop (used by break & continue)
     BasicBlock* _currentLoopEntry;
@@ -189,7 +199,27 @@ private:
     std::vector<ConstructorSymbol*> _constructors;
     void createConstructor(const ConstructorSymbol* constructor, const TypeAssignment& typeAssignment);
 
-    void createClosure(Value* dest, Value* fn, const std::vector<Symbol*>& captures = {});
+    void createClosure(Value* dest, Value* fn, AstNode* node, const std::vector<Symbol*>& captures = {});
+
+    // Constructors without members and closures without captures are never
+    // allocated: every use shares one instance in the data section
+    std::unordered_map<const Symbol*, Value*> _staticInstances;
+    std::unordered_map<Value*, Value*> _staticClosures;
+    Value* getStaticInstance(const ConstructorSymbol* symbol);
+    Value* getStaticClosure(Value* fn);
+
+    // Enum values don't always point to an object holding the constructor tag
+    // (see EnumRepresentation)
+    Value* getNullaryValue(const ConstructorSymbol* symbol, Type* type);
+    Value* getConstructorTag(Value* value, Type* type);
+    void testConstructorTag(Value* tag, Type* type, size_t constructorTag, BasicBlock* ifTrue, BasicBlock* ifFalse);
+    void loadMember(Value* dest, Value* value, Type* type, size_t constructorTag, size_t index);
+    void loadField(Value* dest, Value* object, Value* offset, ValueType storageType);
+    bool loadElementMember(MemberAccessNode* node, IndexNode* indexNode);
+    Value* getElementOffset(Value* index, size_t elementSize, size_t headerSize);
+    void copyWords(Value* dest, Value* destOffset, Value* src, Value* srcOffset, size_t size, uint64_t refMask, bool needsBarrier);
+    void storeField(Value* object, int64_t offset, Value* value, ValueType storageType);
+    void storeField(Value* object, Value* offset, Value* value, ValueType storageType);
 
     // Current assignment of type variables to types
     TypeAssignment _typeContext;
@@ -200,6 +230,7 @@ private:
 
     Function* _currentFunction;
     Value* _currentSwitchExpr = nullptr;
+    Type* _currentSwitchType = nullptr;
 
     TACConditionalCodeGen _conditionalCodeGen;
     friend class TACConditionalCodeGen;
@@ -219,19 +250,72 @@ private:
         return _context->createConstantInt(ValueType::U64, value);
     }
 
+    // Allocation is inlined, with a call to gcAllocate when the nursery is full
     Value* _gcAllocate = nullptr;
+    Value* _nurseryPointer = nullptr;
+    void gcAllocate(Value* dest, Value* size, uint64_t layout);
+    void callAllocator(Value* dest, Value* size, uint64_t layout);
 
-    void gcAllocate(Value* dest, Value* size)
+    void gcAllocate(Value* dest, size_t size, uint64_t layout)
     {
-        CallInst* callInst = new CallInst(dest, _gcAllocate, {size});
-        callInst->regpass = true;
-        emit(callInst);
+        gcAllocate(dest, constant(size), layout);
     }
 
-    void gcAllocate(Value* dest, size_t size)
-    {
-        gcAllocate(dest, constant(size));
-    }
+    // With --profile-alloc, every allocation goes through gcAllocate, and is
+    // preceded by a store of the index of its site into allocationSite
+    bool _profileAllocations;
+    Value* _allocationSite = nullptr;
+    std::unordered_map<std::string, size_t> _allocationSiteIds;
+    size_t getAllocationSite(const std::string& name, AstNode* node);
+    void setAllocationSite(const std::string& name, AstNode* node);
+
+    // Used by functions which allocate on behalf of their caller (constructors
+    // and arrays), when the caller hasn't given a site
+    void setDefaultAllocationSite(const std::string& name, AstNode* node);
+
+    // Emit a call to a function which may allocate, attributed to node
+    void emitAllocatingCall(CallInst* inst, const FunctionSymbol* functionSymbol, AstNode* node);
+
+    // Functions which return a small value in registers instead of boxing it
+    // (see getReturnRegisters), and the type of that value
+    std::unordered_map<Value*, Type*> _registerReturns;
+
+    // Functions which take small value structs as their members, one parameter
+    // each, and the type of each such parameter (nullptr for the others)
+    std::unordered_map<Value*, std::vector<Type*>> _unboxedParams;
+
+    void chooseCallingConvention(Function* function, const Symbol* symbol, const TypeAssignment& typeAssignment);
+    void emitCall(Value* dest, Value* function, const std::vector<Value*>& params, AstNode* node, bool unboxed = false);
+    void emitReturn(Value* value);
+    void boxValue(Value* dest, const std::vector<Value*>& registers, Type* type, AstNode* node);
+    Value* box(Value* value, AstNode* node);
+    std::vector<Value*> getRegisters(Value* value, Type* type);
+    void appendMemberRegisters(std::vector<Value*>& registers, Value* value, Type* type, ValueConstructor* constructor);
+
+    // Placeholders for values which were never boxed, and the registers which
+    // hold them instead
+    std::unordered_map<Value*, std::vector<Value*>> _unboxedValues;
+    std::unordered_map<Value*, Type*> _unboxedTypes;
+    AstNode* _unboxedCall = nullptr;
+    Value* visitAndGetUnboxed(ExpressionNode* node);
+    Value* visitArgument(ExpressionNode* node);
+    void setUnboxed(Value* placeholder, const std::vector<Value*>& registers, Type* type);
+
+    // Must follow every store of a reference into an object which may already
+    // have been promoted out of the nursery
+    Value* _gcWriteBarrier = nullptr;
+    Value* _nurseryStart = nullptr;
+    Value* _nurseryEnd = nullptr;
+    void writeBarrier(Value* object, Value* value);
+
+    // A String may be packed into the reference instead of pointing to an array
+    // (see SHORT_STRING_TAG_BIT), so every access to an Array<Char> first
+    // tests for one. Unless the program stores into strings, in which case
+    // none are packed
+    Value* _shortStringModified = nullptr;
+    bool _packShortStrings = true;
+    bool mayBeShortString(ConstructedType* arrayType);
+    void testShortString(Value* string, BasicBlock* ifShort, BasicBlock* ifArray);
 
     void setBlock(BasicBlock* block) { _currentBlock = block; }
     BasicBlock* _currentBlock = nullptr;
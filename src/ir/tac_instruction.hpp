@@ -5,6 +5,7 @@
 #include "ir/tac_visitor.hpp"
 #include "ir/value.hpp"
 
+#include <algorithm>
 #include <sstream>
 #include <string>
 
@@ -226,15 +227,28 @@ struct ReturnInst : public Instruction
             value->uses.insert(this);
     }
 
+    ReturnInst(const std::vector<Value*>& values)
+    : value(values.at(0)), extraValues(values.begin() + 1, values.end())
+    {
+        for (Value* value : values)
+            value->uses.insert(this);
+    }
+
     virtual void dropReferences()
     {
         if (value)
             value->uses.erase(this);
+
+        for (Value* extraValue : extraValues)
+            extraValue->uses.erase(this);
     }
 
     virtual void replaceReferences(Value* from, Value* to)
     {
         replaceReference(value, from, to);
+
+        for (size_t i = 0; i < extraValues.size(); ++i)
+            replaceReference(extraValues[i], from, to);
     }
 
     MAKE_VISITABLE();
@@ -245,6 +259,10 @@ struct ReturnInst : public Instruction
         {
             std::stringstream ss;
             ss << "return " << value->str();
+
+            for (Value* extraValue : extraValues)
+                ss << ", " << extraValue->str();
+
             return ss.str();
         }
         else
@@ -254,6 +272,10 @@ struct ReturnInst : public Instruction
     }
 
     Value* value;
+
+    // The rest of a result returned in more than one register (see
+    // TACCodeGen::getReturnRegisters)
+    std::vector<Value*> extraValues;
 };
 
 struct JumpInst : public Instruction
@@ -352,11 +374,23 @@ struct CallInst : public Instruction
         }
     }
 
+    void addDest(Value* extraDest)
+    {
+        extraDest->definition = this;
+        extraDests.push_back(extraDest);
+    }
+
     virtual void dropReferences()
     {
         if (this == dest->definition)
             dest->definition = nullptr;
 
+        for (Value* extraDest : extraDests)
+        {
+            if (this == extraDest->definition)
+                extraDest->definition = nullptr;
+        }
+
         function->uses.erase(this);
 
         for (auto& param : params)
@@ -368,6 +402,7 @@ struct CallInst : public Instruction
     virtual void replaceReferences(Value* from, Value* to)
     {
         assert(dest != from);
+        assert(std::find(extraDests.begin(), extraDests.end(), from) == extraDests.end());
 
         replaceReference(function, from, to);
 
@@ -383,9 +418,11 @@ struct CallInst : public Instruction
     {
         std::stringstream ss;
 
-        ss << dest->str() << " = ";
+        ss << dest->str();
+        for (Value* extraDest : extraDests)
+            ss << ", " << extraDest->str();
 
-        ss << "call " << function->str() << "(";
+        ss << " = call " << function->str() << "(";
 
         for (size_t i = 0; i < params.size(); ++i)
         {
@@ -403,6 +440,9 @@ struct CallInst : public Instruction
     Value* dest;
     Value* function;
     std::vector<Value*> params;
+
+    // The rest of a result which comes back in more than one register
+    std::vector<Value*> extraDests;
 };
 
 struct LoadInst : public Instruction
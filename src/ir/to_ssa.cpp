@@ -291,29 +291,36 @@ void ToSSA::rename(BasicBlock* block, PhiList& phis)
         }
     }
 
+    // Loads of arguments outside of the entry block, which stand in for later
+    // loads in the same block. The recursion below follows successors rather
+    // than the dominator tree, so they can't be reused beyond it
+    std::unordered_map<Value*, Value*> argumentLoads;
+
     // Rewrite load and store instructions with new names
     for (Instruction* inst = block->first; inst != nullptr;)
     {
         if (LoadInst* load = dynamic_cast<LoadInst*>(inst))
         {
-            if (_phiStack[load->src].empty())
+            if (_phiStack[load->src].empty() && argumentLoads.find(load->src) == argumentLoads.end())
             {
-                if (dynamic_cast<Argument*>(load->src))
+                if (dynamic_cast<Argument*>(load->src) && block == _function->blocks[0])
                 {
-                    // For any node dominated by this one, don't re-load, just
-                    // use this value
+                    // The entry block dominates every other node, so don't
+                    // re-load anywhere, just use this value
                     _phiStack[load->src].push(load->dest);
                     toPop.push_back(load->src);
                 }
-                else
+                else if (dynamic_cast<Argument*>(load->src))
                 {
-                    inst = inst->next;
-                    continue;
+                    argumentLoads[load->src] = load->dest;
                 }
+
+                inst = inst->next;
+                continue;
             }
             else
             {
-                Value* newName = _phiStack[load->src].top();
+                Value* newName = _phiStack[load->src].empty() ? argumentLoads.at(load->src) : _phiStack[load->src].top();
                 Value* oldName = load->dest;
 
                 inst = inst->next;
@@ -73,7 +73,7 @@ protected:
     {}
 };
 
-enum class GlobalTag {Variable, Function, Static, ExternFunction};
+enum class GlobalTag {Variable, Function, Static, ExternFunction, ExternVariable};
 
 struct GlobalValue : public Constant
 {
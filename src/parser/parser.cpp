@@ -4,6 +4,7 @@
 
 #include <iostream>
 #include <boost/lexical_cast.hpp>
+#include <cstring>
 
 //// Lexing machinery //////////////////////////////////////////////////////////
 
@@ -176,6 +177,10 @@ std::vector<StatementNode*> Parser::statement()
         {
             return {variable_declaration()};
         }
+        else if (peek2ndType() == tSTRUCT && strcmp(nextTokens[0].value.str, "value") == 0)
+        {
+            return struct_declaration();
+        }
 
         // Else fallthrough
 
@@ -484,11 +489,31 @@ ReturnNode* Parser::return_statement()
 }
 
 /// struct_declaration
-///     : STRUCT UIDENT constrained_type_params [ where_clause ] EOL INDENT struct_vars [ impl_body ] DEDENT
+///     : [ VALUE ] STRUCT UIDENT constrained_type_params [ where_clause ] EOL INDENT struct_vars [ impl_body ] DEDENT
+///
+/// VALUE is the identifier `value`, which isn't reserved
 std::vector<StatementNode*> Parser::struct_declaration()
 {
     YYLTYPE location = getLocation();
 
+    bool isValue = false;
+    if (peekType() == tLIDENT)
+    {
+        if (strcmp(nextTokens[0].value.str, "value") != 0)
+        {
+            std::stringstream ss;
+
+            ss << location.filename << ":" << location.first_line << ":" << location.first_column
+               << ": expected value or struct, but got identifier "
+               << nextTokens[0].value.str;
+
+            throw LexerError(ss.str());
+        }
+
+        advance();
+        isValue = true;
+    }
+
     expect(tSTRUCT);
     Token name = expect(tUIDENT);
 
@@ -500,7 +525,7 @@ std::vector<StatementNode*> Parser::struct_declaration()
     std::vector<StructVarNode*> varList = struct_vars();
 
     std::vector<StatementNode*> result;
-    result.push_back(new StructDefNode(_context, location, name.value.str, std::move(varList), std::move(typeParams), std::move(whereClause)));
+    result.push_back(new StructDefNode(_context, location, name.value.str, std::move(varList), std::move(typeParams), std::move(whereClause), isValue));
 
     if (peekType() == tDEF)
     {
@@ -18,6 +18,13 @@
 #include <boost/lexical_cast.hpp>
 
 
+// The library only stores into strings which it has just allocated itself
+static bool isLibraryCode(const YYLTYPE& location)
+{
+    return strncmp(location.filename, "lib/", 4) == 0;
+}
+
+
 //// Type inference functions //////////////////////////////////////////////////
 
 static void inferenceError(AstNode* node, const std::string& msg)
@@ -222,6 +229,7 @@ bool SemanticAnalyzer::analyze()
         }
 
         checkTraitCoherence();
+        checkStringStores();
 
         _symbolTable->popScope();
 	}
@@ -292,6 +300,13 @@ void SemanticAnalyzer::injectSymbols()
     FunctionSymbol* unsafeArraySet = createBuiltin("unsafeArraySet");
     unsafeArraySet->type = _typeTable->createFunctionType({ArrayT, _typeTable->UInt, T}, _typeTable->Unit);
 
+    Type* ArrayChar = _typeTable->Array->get<ConstructedType>()->instantiate({_typeTable->Char});
+    FunctionSymbol* unsafeShortString = createBuiltin("unsafeShortString");
+    unsafeShortString->type = _typeTable->createFunctionType({_typeTable->UInt, _typeTable->UInt}, ArrayChar);
+
+    FunctionSymbol* packShortStrings = createBuiltin("packShortStrings");
+    packShortStrings->type = _typeTable->createFunctionType({}, _typeTable->Bool);
+
 
 	//// These definitions are only needed so that we list them as external
 	//// symbols in the output assembly file. They can't be called from
@@ -999,6 +1014,7 @@ void LValueAnalyzer::visit(NullaryNode* node)
 
 void LValueAnalyzer::visit(MemberAccessNode* node)
 {
+    node->isAssigned = true;
     node->accept(_mainAnalyzer);
     _good = true;
 }
@@ -1028,6 +1044,11 @@ void LValueAnalyzer::visit(IndexNode* node)
 
     assert(equals(methodType->output(), _mainAnalyzer->_typeTable->Unit));
 
+    if (!isLibraryCode(node->location))
+    {
+        _mainAnalyzer->_storedInto.push_back(node->object);
+    }
+
     _good = true;
 }
 
@@ -1081,6 +1102,11 @@ void SemanticAnalyzer::visit(FunctionCallNode* node)
         paramTypes.push_back(argument->type);
     }
 
+    if (name == "unsafeArraySet" && !isLibraryCode(node->location))
+    {
+        _storedInto.push_back(node->arguments[0]);
+    }
+
 	node->symbol = symbol;
 
     if (node->type)
@@ -1098,6 +1124,11 @@ void SemanticAnalyzer::visit(MethodCallNode* node)
     node->object->accept(this);
     Type* objectType = node->object->type;
 
+    if (node->methodName == "set" && !isLibraryCode(node->location))
+    {
+        _storedInto.push_back(node->object);
+    }
+
     std::vector<MemberSymbol*> symbols;
     _symbolTable->resolveMemberSymbol(node->methodName, objectType, symbols);
     CHECK(!symbols.empty(), "no method named `{}` found for type `{}`", node->methodName, objectType->str());
@@ -1261,6 +1292,9 @@ void SemanticAnalyzer::visit(NullaryNode* node)
 
             node->type = functionType;
             node->kind = NullaryNode::CLOSURE;
+
+            if (functionSymbol->definition)
+                functionSymbol->definition->isClosure = true;
         }
 	}
 }
@@ -1521,6 +1555,21 @@ void SemanticAnalyzer::visit(StringLiteralNode* node)
     node->symbol = symbol;
 }
 
+// Whether an expression builds a new value, like `Some(x)` or `None`
+static bool isConstructorCall(ExpressionNode* node)
+{
+    if (FunctionCallNode* functionCall = dynamic_cast<FunctionCallNode*>(node))
+    {
+        return dynamic_cast<ConstructorSymbol*>(functionCall->symbol);
+    }
+    else if (NullaryNode* nullary = dynamic_cast<NullaryNode*>(node))
+    {
+        return nullary->kind == NullaryNode::FUNC_CALL && dynamic_cast<ConstructorSymbol*>(nullary->symbol);
+    }
+
+    return false;
+}
+
 void SemanticAnalyzer::visit(ReturnNode* node)
 {
     CHECK(_enclosingFunction, "Cannot return from top level");
@@ -1533,6 +1582,9 @@ void SemanticAnalyzer::visit(ReturnNode* node)
     {
         node->expression->accept(this);
         unify(node->expression->type, functionType->output(), node);
+
+        if (!isConstructorCall(node->expression))
+            _enclosingFunction->returnsConstructed = false;
     }
     else
     {
@@ -1656,7 +1708,7 @@ void SemanticAnalyzer::visit(StructDefNode* node)
             memberSymbols.push_back(memberSymbol);
         }
 
-        ValueConstructor* valueConstructor = _typeTable->createValueConstructor(typeName, 0, memberTypes, memberNames);
+        ValueConstructor* valueConstructor = _typeTable->createValueConstructor(typeName, 0, memberTypes, memberNames, node->isValue);
         node->valueConstructor = valueConstructor;
         newType->addValueConstructor(valueConstructor);
 
@@ -1703,8 +1755,9 @@ void SemanticAnalyzer::visit(StructDefNode* node)
 
         popTypeContext();
 
-        ValueConstructor* valueConstructor = _typeTable->createValueConstructor(typeName, 0, memberTypes, memberNames);
+        ValueConstructor* valueConstructor = _typeTable->createValueConstructor(typeName, 0, memberTypes, memberNames, node->isValue);
         node->valueConstructor = valueConstructor;
+        newType->addValueConstructor(valueConstructor);
 
         // Create a symbol for the constructor
         ConstructorSymbol* constructorSymbol = _symbolTable->createConstructorSymbol(typeName, node, valueConstructor, memberSymbols);
@@ -1756,6 +1809,9 @@ void SemanticAnalyzer::visit(MemberAccessNode* node)
     node->constructorSymbol = symbol->constructorSymbol;
     node->memberIndex = symbol->index;
 
+    ValueConstructor* constructor = node->constructorSymbol->constructor;
+    CHECK(!node->isAssigned || !constructor->isValue(), "cannot assign to member `{}` of value struct `{}`", node->memberName, constructor->str());
+
     if (node->type)
     {
         unify(node->type, functionType->output(), node);
@@ -2106,6 +2162,27 @@ void SemanticAnalyzer::visit(PassNode* node)
     node->type = _typeTable->Unit;
 }
 
+// A short string is the reference itself, so storing into one can't be seen
+// through other references to it. Strings are only packed if nothing in the
+// program could be a store into a string. Stores in generic code count
+void SemanticAnalyzer::checkStringStores()
+{
+    for (ExpressionNode* object : _storedInto)
+    {
+        Type* type = object->type;
+        if (type->tag() == ttConstructed && type->get<ConstructedType>()->name() == "Array")
+        {
+            type = type->get<ConstructedType>()->typeParameters()[0];
+        }
+
+        if (type->isVariable() || equals(type, _typeTable->Char))
+        {
+            _context->setPackShortStrings(false);
+            return;
+        }
+    }
+}
+
 void SemanticAnalyzer::checkTraitCoherence()
 {
     std::vector<Trait*> traits = _typeTable->traits();
@@ -108,6 +108,7 @@ private:
     void resolveTypeNameWhere(AstNode* node, TypeName* typeName, const std::vector<TypeParam>& whereClause);
 
     void checkTraitCoherence();
+    void checkStringStores();
 
     ProgramNode* _root;
     AstContext* _context;
@@ -120,6 +121,10 @@ private:
     TraitDefNode* _enclosingTraitDef = nullptr;
     LambdaNode* _enclosingLambda = nullptr;
 
+    // Objects which the program (outside of the library) stores into, by
+    // indexing, set or unsafeArraySet. Their types are checked at the end
+    std::vector<ExpressionNode*> _storedInto;
+
     /// Deferred processing
     bool _allowDefer = true;
 
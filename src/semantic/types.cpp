@@ -304,9 +304,11 @@ int TypeVariable::_count;
 ValueConstructor::ValueConstructor(const std::string& name,
                                    size_t constructorTag,
                                    const std::vector<Type*>& memberTypes,
-                                   const std::vector<std::string>& memberNames)
+                                   const std::vector<std::string>& memberNames,
+                                   bool isValue)
 : _name(name)
 , _constructorTag(constructorTag)
+, _isValue(isValue)
 {
     assert(memberNames.empty() || (memberNames.size() == memberTypes.size()));
 
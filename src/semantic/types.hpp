@@ -364,14 +364,23 @@ public:
         return _constructorTag;
     }
 
+    // The constructor of a value struct, whose members can't be assigned to,
+    // so that its values can be copied without changing the meaning of the
+    // program
+    bool isValue() const
+    {
+        return _isValue;
+    }
+
 private:
     friend TypeTable;
 
-    ValueConstructor(const std::string& name, size_t constructorTag, const std::vector<Type*>& memberTypes, const std::vector<std::string>& memberNames = {});
+    ValueConstructor(const std::string& name, size_t constructorTag, const std::vector<Type*>& memberTypes, const std::vector<std::string>& memberNames = {}, bool isValue = false);
 
     std::string _name;
     std::vector<MemberDesc> _members;
     size_t _constructorTag;
+    bool _isValue;
 };
 
 class Trait
@@ -518,9 +527,9 @@ public:
         return type;
     }
 
-    ValueConstructor* createValueConstructor(const std::string& name, size_t constructorTag, const std::vector<Type*>& memberTypes, const std::vector<std::string>& memberNames = {})
+    ValueConstructor* createValueConstructor(const std::string& name, size_t constructorTag, const std::vector<Type*>& memberTypes, const std::vector<std::string>& memberNames = {}, bool isValue = false)
     {
-        ValueConstructor* valueConstructor = new ValueConstructor(name, constructorTag, memberTypes, memberNames);
+        ValueConstructor* valueConstructor = new ValueConstructor(name, constructorTag, memberTypes, memberNames, isValue);
         _valueConstructors.emplace_back(valueConstructor);
 
         return valueConstructor;
@@ -19,6 +19,7 @@
 #include "semantic/semantic.hpp"
 
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <unistd.h>
 
@@ -30,19 +31,42 @@ extern void shutdownLexer();
 
 int main(int argc, char* argv[])
 {
-	if (argc < 2)
+	// Options:
+	//   --profile-alloc    Instrument every allocation site. The program prints
+	//                      an allocation profile at exit
+	const char* fileName = nullptr;
+	bool profileAllocations = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--profile-alloc") == 0)
+		{
+			profileAllocations = true;
+		}
+		else if (argv[i][0] == '-')
+		{
+			std::cerr << "Unknown option " << argv[i] << std::endl;
+			return 1;
+		}
+		else
+		{
+			fileName = argv[i];
+		}
+	}
+
+	if (!fileName)
 	{
 		std::cerr << "Please specify a source file to compile." << std::endl;
 		return 1;
 	}
 
-	if (access(argv[1], R_OK) == -1)
+	if (access(fileName, R_OK) == -1)
 	{
-		std::cerr << "Can't read file " << argv[1] << std::endl;
+		std::cerr << "Can't read file " << fileName << std::endl;
 		return 1;
 	}
 
-	initializeLexer(argv[1]);
+	initializeLexer(fileName);
 	importFile("lib/prelude.enc");
 
 	// Translate an input file to an AST (lexer and scanner)
@@ -72,7 +96,7 @@ int main(int argc, char* argv[])
 
 	// Convert the AST to IR code
 	TACContext* tacContext = new TACContext;
-	TACCodeGen tacGen(tacContext);
+	TACCodeGen tacGen(tacContext, profileAllocations);
 
 	try
 	{
@@ -143,11 +167,37 @@ int main(int argc, char* argv[])
 		machineContext->staticStrings.emplace_back(item.first->name, item.second);
 	}
 
+	for (auto& item : tacContext->staticObjects)
+	{
+		std::vector<MachineOperand*> contents;
+		for (Value* value : item.second)
+		{
+			if (ConstantInt* constInt = dynamic_cast<ConstantInt*>(value))
+			{
+				contents.push_back(machineContext->createImmediate(constInt->value, ValueType::U64));
+			}
+			else
+			{
+				GlobalValue* global = dynamic_cast<GlobalValue*>(value);
+				assert(global);
+
+				bool clinkage = global->tag == GlobalTag::ExternFunction;
+				contents.push_back(machineContext->createGlobal(global->name, global->type, clinkage));
+			}
+		}
+
+		machineContext->staticObjects.emplace_back(item.first->name, contents);
+	}
+
 	for (Value* global : tacContext->globals)
 	{
 		machineContext->globals.emplace_back(global->name, global->type);
 	}
 
+	machineContext->allocationSites = tacContext->allocationSites;
+	machineContext->typeDescriptors = tacContext->typeDescriptors;
+	machineContext->packShortStrings = tacContext->packShortStrings;
+
 	delete tacContext;
 
 
@@ -19,9 +19,32 @@ def assert_matches(result, expected):
             raise AssertionError('{} != {}'.format(result.strip(), expected.strip()))
 
 
+def site(path, line_text, name, after=None):
+    """The escaped path:line:column of name, in the first line containing
+    line_text (after the first line containing after, if given). Library lines
+    move whenever the library changes, so tests look them up instead of
+    hard-coding them"""
+    with open(path) as f:
+        lines = f.read().split('\n')
+
+    start = 0
+    if after is not None:
+        start = next(i for i, line in enumerate(lines) if after in line) + 1
+
+    for i in range(start, len(lines)):
+        if line_text in lines[i]:
+            column = lines[i].index(line_text) + line_text.index(name)
+            return re.escape('{}:{}:{}'.format(path, i + 1, column + 1))
+
+    raise ValueError('{!r} not found in {}'.format(line_text, path))
+
+
 class TestAcceptance(object):
-    def run(self, name, result=None, build_error=None, runtime_error=None, input_file=None, command=None):
+    def run(self, name, result=None, build_error=None, runtime_error=None, input_file=None, command=None, build_options=None):
         build_cmd = './sbuild {}'.format(name)
+        if build_options:
+            build_cmd += ' ' + build_options
+
         build_proc = subprocess.Popen(build_cmd, shell=True, stderr=subprocess.PIPE)
 
         if build_error:
@@ -154,6 +177,140 @@ class TestAcceptance(object):
     def test_bigList(self):
         self.run('bigList', result='')
 
+    def test_generational(self):
+        self.run('generational', result='45000')
+
+    def test_gcStats(self):
+        self.run('gcStats', result='True\nTrue\nTrue\nTrue\nTrue')
+
+    def test_heapShrink(self):
+        self.run('heapShrink', result='Shrunk')
+
+    def test_heapLimit(self):
+        self.run('heapLimit', command='--gc-max-heap=64M', runtime_error='*** Exception: Out of memory')
+
+    def test_largeObjects(self):
+        self.run('largeObjects', result='5001949955')
+
+    def test_parallelGC(self):
+        self.run('generational', command='--gc-threads=4', result='45000')
+        self.run('largeObjects', command='--gc-threads=4', result='5001949955')
+
+    def test_copyOrder(self):
+        self.run('generational', command='--gc-copy-order=breadth', result='45000')
+        self.run('gcStats', command='--gc-copy-order=breadth', result='True\nTrue\nTrue\nTrue\nTrue')
+
+    def test_markRegion(self):
+        self.run('fragmentation', result='10000350933')
+        self.run('fragmentation', command='--gc-collector=mark-region', result='10000350933')
+        self.run('generational', command='--gc-collector=mark-region', result='45000')
+        self.run('largeObjects', command='--gc-collector=mark-region', result='5001949955')
+        self.run('heapShrink', command='--gc-collector=mark-region', result='Shrunk')
+        self.run('heapLimit', command='--gc-collector=mark-region --gc-max-heap=64M', runtime_error='*** Exception: Out of memory')
+
+    def test_allocProfile(self):
+        self.run('allocProfile', build_options='--profile-alloc', command='2>&1 >/dev/null', result=Regex(
+            r'Allocation profile:\n.*site\n'
+            r' +1000000 +24000000 +0  Point \(testing/allocProfile.enc:13:10\)\n'
+            r'(.*\n)* +1000 +24000 +[1-9][0-9]*  Point \(testing/allocProfile.enc:9:15\)'))
+
+    def test_staticInstances(self):
+        self.run('staticInstances', result='1500000500012')
+        self.run('staticInstances', build_options='--profile-alloc', command='2>&1 >/dev/null', result=Regex(
+            r'(?s)(?!.*staticInstances\.enc:2[4-6])Allocation profile:\n'
+            r'.* +1 +16 +0  Circle \(testing/staticInstances.enc:28:15\)'))
+
+    def test_taggedEnums(self):
+        self.run('taggedEnums', result='499500324\n10\n499506\n5\n1\n100')
+
+    def test_nullableOption(self):
+        self.run('nullableOption', result='7000000\nDave\nSome(None)\nNone\nFrank\nNeither\nNone\n25')
+        self.run('nullableOption', build_options='--profile-alloc', command='2>&1 >/dev/null', result=Regex(
+            r'(?s)(?!.*Some \(({})\))Allocation profile:\n'.format('|'.join([
+                site('lib/prelude.enc', 'return Some(head)', 'Some'),
+                site('lib/prelude.enc', 'return Some(result)', 'Some', after='for VectorIterator<T>'),
+                site('lib/Dict.enc', 'Some $ Pair(key, value)', 'Some'),
+                site('lib/Dict.enc', 'Some $ Pair(key, value)', 'Some', after='Some $ Pair(key, value)'),
+                site('lib/Dict.enc', 'return Some(p)', 'Some'),
+                site('lib/Dict.enc', 'return Some(k)', 'Some')])) +
+            r'(.*\n)* +100000 +2400000 +0  VectorIterator \({}\)'.format(
+                site('lib/prelude.enc', 'return VectorIterator(self, 0)', 'VectorIterator'))))
+
+    def test_compactHeaders(self):
+        self.run('compactHeaders', result='2761336')
+        self.run('compactHeaders', command='--gc-threads=2', result='2761336')
+
+    def test_packedFields(self):
+        self.run('packedFields', result='5021928527\n-370000\nz\n15')
+        self.run('packedFields', build_options='--profile-alloc', command='2>&1 >/dev/null', result=Regex(
+            r'(?s)Allocation profile:\n.* +200000 +6400000 +\d+  Record \(testing/packedFields.enc:53:12\)'))
+
+    def test_flatArrays(self):
+        self.run('flatArrays', result='499500\n1666883337\nlabel5 12345\nabcdefghij120')
+        self.run('flatArrays', command='--gc-threads=2', result='499500\n1666883337\nlabel5 12345\nabcdefghij120')
+
+        # The elements are copied in and out of the arrays through registers,
+        # the for loops included, and never boxed
+        self.run('flatArrays', build_options='--profile-alloc', command='2>&1 >/dev/null', result=Regex(
+            r'(?s)(?!.*(Point|Label|Couple) \()Allocation profile:\n'))
+
+    def test_registerReturns(self):
+        self.run('registerReturns', result='213837072847\n1021201\n3 -4\n7 0\n1334000667')
+
+        # Only the results kept in the vector are boxed. Value struct locals
+        # and arguments stay in registers too
+        self.run('registerReturns', build_options='--profile-alloc', command='2>&1 >/dev/null', result=Regex(
+            r'(?s)(?!.*registerReturns\.enc:(1[0-9]|2[0-9]|4[0-9]|5[0-3]|8[0-9]|9[0-9]|10[01]):)Allocation profile:\n'
+            r'(.*\n)* +4 +96 +0  Ok \(testing/registerReturns.enc:58:17\)'))
+
+    def test_shortStrings(self):
+        self.run('shortStrings', result='389000 w345 100\nabcdefgdefg\n-1234567x12345678')
+
+        # Only the concatenations too long to pack allocate
+        self.run('shortStrings', build_options='--profile-alloc', command='2>&1 >/dev/null', result=Regex(
+            r'(?s)Allocation profile:\n(.*\n)* +100007 +3200224 +\d+  unsafeEmptyArray \({}\)'.format(
+                site('lib/prelude.enc', 'result := unsafeEmptyArray(n1 + n2)', 'unsafeEmptyArray'))))
+
+    def test_stringStores(self):
+        self.run('stringStores', result='72 72 abcx c')
+
+        # None of the strings in a program which stores into strings are packed
+        self.run('stringStores', build_options='--profile-alloc', command='2>&1 >/dev/null', result=Regex(
+            r'(?s)Allocation profile:\n(.*\n)* +1 +24 +\d+  unsafeEmptyArray \({}\)'.format(
+                site('lib/prelude.enc', 'result := unsafeEmptyArray(length)', 'unsafeEmptyArray'))))
+
+    def test_bufferedOutput(self):
+        self.run('bufferedOutput', command='| tail -n 2', result='99999\n-1234567 98765432109876 -1234567890123')
+        self.run('bufferedOutput', command='| wc -c', result='588929')
+
+    def test_bufferedInput(self):
+        self.run('bufferedInput', input_file='testing/bufferedInput.txt',
+            result='first line\n-20\nword1,word2,word3,\n12345678901234\nlast line without newline\nDone')
+
+    def test_mappedFile(self):
+        self.run('mappedFile', result='Same\n46447 2884124 MARY\nNone')
+
+    def test_stringKernels(self):
+        self.run('stringKernels', result='17 the|\n5 gamma-delta-epsilon-zeta-eta-theta-iota-kappa lambda\n'
+            '[the quick brown fox\tjumps over] [] [x] [the]\n46\nSame hash')
+
+    def test_stringBuilder(self):
+        self.run('stringBuilder', result='627787 -50000,-49999, ,49999,end\none, two, three|solo\n1267650600228229401496703205376')
+
+    def test_stringViews(self):
+        self.run('stringViews', result='34999650000 user99000 9\n3 a||bc\net soup')
+
+        # Splitting, storing and comparing views never boxes one
+        self.run('stringViews', build_options='--profile-alloc', command='2>&1 >/dev/null', result=Regex(
+            r'(?s)(?!.*StrView \()Allocation profile:\n'))
+
+    def test_flatIndexRange(self):
+        self.run('flatIndexRange', runtime_error=Regex(r'\*\*\* Exception: Assertion failed at {}'.format(
+            site('lib/prelude.enc', 'assert n < arrayLength(self)', 'assert')) + '$'))
+
+    def test_valueStructAssign(self):
+        self.run('valueStructAssign', build_error='Error: testing/valueStructAssign.enc:6:1: cannot assign to member `x` of value struct `Point`')
+
     def test_multiRef(self):
         self.run('multiRef', result='6')
 